@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ext2_utils.h"
+
+/*
+ * This program runs many cp, mkdir, ln, rm and restore commands against one image.
+ * The image is loaded once, and what one command has looked up (directory indexes,
+ * free space summaries, allocation cursors) is reused by the next one.
+ *
+ * Commands are read one per line from the script file, or from standard input if no script is given.
+ * They take the same arguments as the tools, without the image:
+ *     cp <path to source file> <path to dest>
+ *     cp -r <path to source directory> <path to dest>
+ *     mkdir <path>
+ *     ln [-s] <source path> <dest path>
+ *     rm <path to link>
+ *     restore <path to file or directory>
+ *     restore --scan [<path to directory>]
+ * Empty lines and lines starting with '#' are skipped. Arguments are separated by spaces or tabs.
+ *
+ * For every command it prints the line number, the command and its status (the exit code the tool would return).
+ * The changes are committed when the script ends, or after every command with EXT2_SYNC=op.
+ * The image is mapped, or read and written block by block with EXT2_IO=pread through a cache
+ * of EXT2_CACHE_BLOCKS blocks (EXT2_CACHE_POLICY=lru or clock).
+ * It returns EXIT_SUCCESS if every command succeeds, EXIT_FAILURE otherwise.
+ *
+ * The tools' sources are built with EXT2_BATCH defined, which leaves their main() out:
+ *     gcc -DEXT2_BATCH -o ext2_batch ext2_batch.c ext2_cp.c ext2_mkdir.c ext2_ln.c ext2_rm.c ext2_restore.c ext2_utils.c -lpthread
+ */
+
+#define BATCH_MAX_ARGS 4 //The command name and up to three arguments (ln -s <source> <dest>)
+
+//This function runs one command
+//It returns the status of the command, or EINVAL if the command or its arguments are not valid
+int run_command(int argc, char *argv[]){
+
+    if(strcmp(argv[0], "cp") == 0 && argc == 3){
+        return copy_file(argv[1], argv[2]);
+    }
+    if(strcmp(argv[0], "cp") == 0 && argc == 4 && strcmp(argv[1], "-r") == 0){
+        return copy_tree(argv[2], argv[3]);
+    }
+    if(strcmp(argv[0], "mkdir") == 0 && argc == 2){
+        return make_directory(argv[1]);
+    }
+    if(strcmp(argv[0], "ln") == 0 && argc == 3){
+        return link_file(argv[1], argv[2], EXT2_FT_REG_FILE);
+    }
+    if(strcmp(argv[0], "ln") == 0 && argc == 4 && strcmp(argv[1], "-s") == 0){
+        return link_file(argv[2], argv[3], EXT2_FT_SYMLINK);
+    }
+    if(strcmp(argv[0], "rm") == 0 && argc == 2){
+        return remove_file(argv[1]);
+    }
+    if(strcmp(argv[0], "restore") == 0 && argc == 2 && strcmp(argv[1], "--scan") == 0){
+        return restore_scan("/");
+    }
+    if(strcmp(argv[0], "restore") == 0 && argc == 2){
+        return restore_path(argv[1]);
+    }
+    if(strcmp(argv[0], "restore") == 0 && argc == 3 && strcmp(argv[1], "--scan") == 0){
+        return restore_scan(argv[2]);
+    }
+    return EINVAL;
+}
+
+int main(int argc, char *argv[]) {
+
+    //Check if the number of arguments is correct
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <image file name> [script file]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    char *image_file_name = argv[1];
+    FILE *script = stdin;
+    if(argc == 3 && strcmp(argv[2], "-") != 0){
+        script = fopen(argv[2], "r");
+        if(script == NULL){
+            perror("Error: cannot open script");
+            exit(ENOENT);
+        }
+    }
+
+    load_image(image_file_name, EXT2_MAP_RANDOM | EXT2_MAP_JOURNAL);
+
+    char *line = NULL;
+    size_t line_size = 0;
+    int line_num = 0;
+    int failed_count = 0;
+    while(getline(&line, &line_size, script) != -1){
+        line_num++;
+
+        //Keep the command as it was written for the status line
+        line[strcspn(line, "\r\n")] = '\0';
+        char command[strlen(line) + 1];
+        strcpy(command, line);
+
+        //Split the command into its arguments
+        char *cmd_argv[BATCH_MAX_ARGS + 1];
+        int cmd_argc = 0;
+        char *save_ptr;
+        char *token = strtok_r(line, " \t", &save_ptr);
+        while(token != NULL && cmd_argc <= BATCH_MAX_ARGS){
+            cmd_argv[cmd_argc++] = token;
+            token = strtok_r(NULL, " \t", &save_ptr);
+        }
+        if(cmd_argc == 0 || cmd_argv[0][0] == '#'){
+            continue;
+        }
+
+        int status = cmd_argc <= BATCH_MAX_ARGS ? run_command(cmd_argc, cmd_argv) : EINVAL;
+
+        //With EXT2_SYNC=op every command is made durable before the next one starts
+        int sync_status = ext2_end_operation(current_image);
+        if(status == EXIT_SUCCESS){
+            status = sync_status;
+        }
+        if(status == EXIT_SUCCESS){
+            printf("%d: %s: 0 OK\n", line_num, command);
+        }else{
+            printf("%d: %s: %d %s\n", line_num, command, status, strerror(status));
+            failed_count++;
+        }
+    }
+
+    free(line);
+    if(script != stdin){
+        fclose(script);
+    }
+    return failed_count == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+}
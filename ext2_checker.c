@@ -8,89 +8,181 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <math.h>
+#include <pthread.h>
+#include <time.h>
 #include "ext2.h"
 #include "ext2_utils.h"
+#include "ext2_image_fields.h"
+
+
+//--dry-run: the image is mapped read-only, nothing is fixed and every inconsistency is printed as a JSON finding
+int dry_run;
+int findings_count;                    //Number of findings printed so far
+unsigned char *dry_run_marked_blocks;  //Blocks a repair would have marked in the block bitmap, indexed by block number
+unsigned int *dry_run_inodes_marked;   //Number of inodes a repair would have marked in use in every group
+unsigned int *dry_run_blocks_marked;   //Number of blocks a repair would have marked in use in every group
+
+//This function prints one finding of --dry-run as an element of the JSON findings array
+//subject names what subject_num is ("inode" or "group"), or is NULL for the superblock
+void print_finding(const char *finding, const char *subject, unsigned int subject_num, int count){
+    printf("%s\n    {\"finding\": \"%s\"", findings_count == 0 ? "" : ",", finding);
+    if(subject != NULL){
+        printf(", \"%s\": %u", subject, subject_num);
+    }
+    printf(", \"count\": %d}", count);
+    findings_count++;
+}
 
+//This function prints the string as a JSON string
+void print_json_string(const char *str){
+    putchar('"');
+    for(; *str != '\0'; str++){
+        if(*str == '"' || *str == '\\'){
+            printf("\\%c", *str);
+        }else if((unsigned char) *str < 0x20){
+            printf("\\u%04x", *str);
+        }else{
+            putchar(*str);
+        }
+    }
+    putchar('"');
+}
 
+//This function returns the time in milliseconds since an arbitrary point
+double now_ms(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
 
 //This function returns the number of bit 0 on the given bitmap 
-//Input: bitmap and the number of bytes in the bitmap
-int num_of_zero_in_bitmap(unsigned char *bitmap, int num_bytes){
-    int count = 0;
-    int i;
-    for(i = 0; i < num_bytes; i++){
-        unsigned char byte = bitmap[i];
-
-        int j;//8 bits in one byte
-        for(j = 0; j < 8; j++){
-            int bit = byte & (1<<j) ? 1 : 0;
-            //Find an bit 0
-            if(bit == 0){
-                count++;
-            }
-        }
-    }
-    return count;
+//Input: bitmap and the number of bits in the bitmap
+int num_of_zero_in_bitmap(unsigned char *bitmap, int num_bits){
+    return num_bits - (int) count_set_bits(bitmap, num_bits);
 }
 
 /*
  * This function makes sure the superblock and block group counters for free inodes
- * matches the number of free inodes in the inode bitmap
+ * matches the number of free inodes in the inode bitmaps
  * It will fix the mismatches in the sb or bg and output the corresponding message
+ * With --dry-run, the bitmaps and counters are taken as a repair would have left them after marking inodes in use
  * Return the the total number of fixes (in absolute value)
  */
 unsigned int match_free_inodes_count(){
 
-    //Get the number of free inodes in its bitmap
-    unsigned char *bitmap = get_inode_bitmap();
-    int num_bytes = sb->s_inodes_count / 8;
-    int free_inode_count = num_of_zero_in_bitmap(bitmap, num_bytes);
+    //Get the number of free inodes in the bitmap of every group
+    int *group_free_count = malloc(groups_count * sizeof(int));
+    int free_inode_count = 0;
+    unsigned int group;
+    unsigned short *group_counter = malloc(groups_count * sizeof(unsigned short));
+    if(group_free_count == NULL || group_counter == NULL){
+        perror("Error: match_free_inodes_count() malloc fail");
+        ext2_abort(EXIT_FAILURE);
+    }
+    unsigned int sb_counter = sb->s_free_inodes_count;
+    for(group = 0; group < groups_count; group++){
+        unsigned int scope = begin_block_scope();
+        group_free_count[group] = num_of_zero_in_bitmap(get_inode_bitmap(group), sb->s_inodes_per_group);
+        end_block_scope(scope);
+        group_counter[group] = gd[group].bg_free_inodes_count;
+        if(dry_run){
+            //Every inode marked in use took a bit from the bitmap and one from the counters
+            group_free_count[group] -= dry_run_inodes_marked[group];
+            group_counter[group] -= dry_run_inodes_marked[group];
+            sb_counter -= dry_run_inodes_marked[group];
+        }
+        free_inode_count += group_free_count[group];
+    }
 
     //Check super block
-    int diff_in_sb = abs(free_inode_count - (int) sb->s_free_inodes_count);//the difference in absolute value
-    if(diff_in_sb != 0){
+    int diff_in_sb = abs(free_inode_count - (int) sb_counter);//the difference in absolute value
+    if(diff_in_sb != 0 && dry_run){
+        print_finding("superblock_free_inodes_count", NULL, 0, diff_in_sb);
+    }else if(diff_in_sb != 0){
         sb->s_free_inodes_count = free_inode_count;
+        mark_dirty(sb, sizeof(struct ext2_super_block));
         printf("Fixed: superblock's free inodes counter was off by %d compared to the bitmap\n", diff_in_sb);
     }
     
-    //Check group descipher
-    int diff_in_gd = abs(free_inode_count - (int) gd->bg_free_inodes_count);//the difference in absolute value
-    if(diff_in_gd != 0){
-        gd->bg_free_inodes_count = free_inode_count;
-        printf("Fixed: block group's free inodes counter was off by %d compared to the bitmap\n", diff_in_gd);
+    //Check group desciphers
+    int total_diff_in_gd = 0;
+    for(group = 0; group < groups_count; group++){
+        int diff_in_gd = abs(group_free_count[group] - (int) group_counter[group]);//the difference in absolute value
+        if(diff_in_gd != 0 && dry_run){
+            print_finding("group_free_inodes_count", "group", group, diff_in_gd);
+        }else if(diff_in_gd != 0){
+            gd[group].bg_free_inodes_count = group_free_count[group];
+            mark_dirty(&gd[group], sizeof(struct ext2_group_desc));
+            printf("Fixed: block group's free inodes counter was off by %d compared to the bitmap\n", diff_in_gd);
+        }
+        total_diff_in_gd += diff_in_gd;
     }
 
-    return diff_in_sb + diff_in_gd;
+    free(group_free_count);
+    free(group_counter);
+    return diff_in_sb + total_diff_in_gd;
 }
 
 /*
  * This function makes sure the superblock and block group counters for free blocks
- * matches the number of free blocks in the block bitmap
+ * matches the number of free blocks in the block bitmaps
  * It will fix the mismatches in the sb or bg and output the corresponding message
+ * With --dry-run, the bitmaps and counters are taken as a repair would have left them after marking blocks in use
  * Return the the total number of fixes (in absolute value)
  */
 unsigned int match_free_blocks_count(){
 
-    //Get the number of free blocks in its bitmap
-    unsigned char *bitmap = get_block_bitmap();
-    int num_bytes = sb->s_blocks_count / 8;
-    int free_block_count = num_of_zero_in_bitmap(bitmap, num_bytes);
+    //Get the number of free blocks in the bitmap of every group
+    int *group_free_count = malloc(groups_count * sizeof(int));
+    int free_block_count = 0;
+    unsigned int group;
+    unsigned short *group_counter = malloc(groups_count * sizeof(unsigned short));
+    if(group_free_count == NULL || group_counter == NULL){
+        perror("Error: match_free_blocks_count() malloc fail");
+        ext2_abort(EXIT_FAILURE);
+    }
+    unsigned int sb_counter = sb->s_free_blocks_count;
+    for(group = 0; group < groups_count; group++){
+        unsigned int scope = begin_block_scope();
+        group_free_count[group] = num_of_zero_in_bitmap(get_block_bitmap(group), blocks_in_group(group));
+        end_block_scope(scope);
+        group_counter[group] = gd[group].bg_free_blocks_count;
+        if(dry_run){
+            //Every block marked in use took a bit from the bitmap and one from the counters
+            group_free_count[group] -= dry_run_blocks_marked[group];
+            group_counter[group] -= dry_run_blocks_marked[group];
+            sb_counter -= dry_run_blocks_marked[group];
+        }
+        free_block_count += group_free_count[group];
+    }
 
     //Check super block
-    int diff_in_sb = abs(free_block_count - (int) sb->s_free_blocks_count);//the difference in absolute value
-    if(diff_in_sb != 0){
+    int diff_in_sb = abs(free_block_count - (int) sb_counter);//the difference in absolute value
+    if(diff_in_sb != 0 && dry_run){
+        print_finding("superblock_free_blocks_count", NULL, 0, diff_in_sb);
+    }else if(diff_in_sb != 0){
         sb->s_free_blocks_count = free_block_count;
+        mark_dirty(sb, sizeof(struct ext2_super_block));
         printf("Fixed: superblock's free blocks counter was off by %d compared to the bitmap\n", diff_in_sb);
     }
     
-    //Check group descipher
-    int diff_in_gd = abs(free_block_count - (int) gd->bg_free_blocks_count);//the difference in absolute value
-    if(diff_in_gd != 0){
-        gd->bg_free_blocks_count = free_block_count;
-        printf("Fixed: block group's free blocks counter was off by %d compared to the bitmap\n", diff_in_gd);
+    //Check group desciphers
+    int total_diff_in_gd = 0;
+    for(group = 0; group < groups_count; group++){
+        int diff_in_gd = abs(group_free_count[group] - (int) group_counter[group]);//the difference in absolute value
+        if(diff_in_gd != 0 && dry_run){
+            print_finding("group_free_blocks_count", "group", group, diff_in_gd);
+        }else if(diff_in_gd != 0){
+            gd[group].bg_free_blocks_count = group_free_count[group];
+            mark_dirty(&gd[group], sizeof(struct ext2_group_desc));
+            printf("Fixed: block group's free blocks counter was off by %d compared to the bitmap\n", diff_in_gd);
+        }
+        total_diff_in_gd += diff_in_gd;
     }
 
-    return diff_in_sb + diff_in_gd;
+    free(group_free_count);
+    free(group_counter);
+    return diff_in_sb + total_diff_in_gd;
 }
 
 //This function returns the file_type(entry) corresponding to the i_mode
@@ -106,6 +198,16 @@ unsigned char imode_to_fileType(unsigned short imode){
     }
 }
 
+//This function returns the file type the entries of the inode should have
+//The root's i_mode is fixed before any entry is checked, so the root is always a directory
+unsigned char correct_file_type(unsigned int inode_num){
+    unsigned short imode = get_inode(inode_num)->i_mode;
+    if(inode_num == EXT2_ROOT_INO){
+        imode |= EXT2_S_IFDIR;
+    }
+    return imode_to_fileType(imode);
+}
+
 //This function checks the entry's file type matches its imode
 //If there is a mismatch, it will output information, change file_type based on its i_mode and return 1.
 //Otherwise, return 0.
@@ -114,19 +216,19 @@ int match_fileType(struct ext2_dir_entry *entry){
     //Make sure the entry is in use
     if(entry->inode == 0){
         //printf("match_fileType(): entry is not in use\n");
-        exit(1);
+        ext2_abort(1);
     }
 
-    //Get its i_mode from its inode
-    struct ext2_inode *inode_table = get_inode_table();
-    struct ext2_inode *inode = &inode_table[entry->inode - 1];
-    unsigned short imode = inode->i_mode;
-
-    unsigned char correct_fileType = imode_to_fileType(imode);
+    unsigned char correct_fileType = correct_file_type(entry->inode);
     unsigned char curr_fileType = entry->file_type;//File type in the entry
     
+    if(curr_fileType != correct_fileType && dry_run){
+        print_finding("entry_type_mismatch", "inode", entry->inode, 1);
+        return 1;
+    }
     if(curr_fileType != correct_fileType){//Mismatch
         entry->file_type = correct_fileType;
+        mark_dirty(entry, sizeof(struct ext2_dir_entry));
         printf("Fixed: Entry type vs inode mismatch: inode [%d]\n", entry->inode);
         return 1;
     }
@@ -141,8 +243,12 @@ int match_fileType(struct ext2_dir_entry *entry){
 //Otherwise, return 0.
 int match_inode_allocation_in_bitmap(int num){
     
-    unsigned char *bitmap = get_inode_bitmap();
-    int is_in_use = check_resource_in_use(bitmap, num);
+    int is_in_use = check_inode_in_use(num);
+    if(is_in_use == 0 && dry_run){
+        dry_run_inodes_marked[group_of_inode(num)]++;
+        print_finding("inode_not_marked_in_use", "inode", num, 1);
+        return 1;
+    }
     if(is_in_use == 0){//the given inode is marked as not in use in the bitmap
         set_resource_in_use(num, 1);
         printf("Fixed: inode [%d] not marked as in-use\n", num);
@@ -152,6 +258,102 @@ int match_inode_allocation_in_bitmap(int num){
 
 }
 
+//What the checker needs to know about the blocks of one inode
+//With -j, the inode table is scanned by worker threads before the tree is walked, otherwise an inode is scanned
+//the first time the walk reaches it. The fixes and the messages come from the walk alone, so the output is the same.
+struct inode_scan {
+    int scanned;
+    unsigned int *unmarked_blocks;   //Blocks of the inode that were not marked in the block bitmap when it was scanned
+    unsigned int unmarked_count;
+    unsigned int *dir_blocks;        //Data blocks of a directory, in order
+    unsigned int dir_blocks_count;
+};
+struct inode_scan *inode_scans;      //Indexed by inode number
+unsigned int next_scan_group;        //The next group of the inode table a worker takes
+
+//This function appends the block number to the list
+void append_block(unsigned int **blocks, unsigned int *count, unsigned int block_num){
+    //Grow the list when its count reaches a power of two
+    if((*count & (*count - 1)) == 0){
+        *blocks = realloc(*blocks, (*count == 0 ? 1 : *count * 2) * sizeof(unsigned int));
+        if(*blocks == NULL){
+            perror("Error: append_block() realloc fail");
+            ext2_abort(EXIT_FAILURE);
+        }
+    }
+    (*blocks)[(*count)++] = block_num;
+}
+
+//This function walks the blocks of the inode and records the ones not marked in the block bitmap
+//and, for a directory, its data blocks. Only block numbers are kept, so none of the blocks stays pinned
+void scan_inode(unsigned int inode_num, struct inode_scan *scan){
+    unsigned int scope = begin_block_scope();
+    struct ext2_inode *inode = get_inode(inode_num);
+    //The root is walked as a directory even if its i_mode is fixed only after the scan
+    int is_dir = imode_to_fileType(inode->i_mode) == EXT2_FT_DIR || inode_num == EXT2_ROOT_INO;
+
+    struct block_iter iter;
+    block_iter_init(&iter, inode);
+    unsigned int block_num;
+    int is_pointer;
+    while ((block_num = block_iter_next(&iter, NULL, &is_pointer)) != 0) {
+        if (!check_block_in_use(block_num)) {
+            append_block(&scan->unmarked_blocks, &scan->unmarked_count, block_num);
+        }
+        if (is_dir && !is_pointer) {
+            append_block(&scan->dir_blocks, &scan->dir_blocks_count, block_num);
+        }
+    }
+    scan->scanned = TRUE;
+    end_block_scope(scope);
+}
+
+//This function returns the scan of the inode, scanning it now if it has not been scanned yet
+struct inode_scan *get_inode_scan(unsigned int inode_num){
+    struct inode_scan *scan = &inode_scans[inode_num];
+    if(!scan->scanned){
+        scan_inode(inode_num, scan);
+    }
+    return scan;
+}
+
+//This function is run by the worker threads of -j: each takes the next group of the inode table
+//and scans the inodes that are in use or still have links, the ones the walk is going to reach
+void *scan_inode_table(void *image){
+    ext2_use_image(image);
+    unsigned int group;
+    while((group = __sync_fetch_and_add(&next_scan_group, 1)) < groups_count){
+        unsigned int first = group * sb->s_inodes_per_group + 1;
+        unsigned int inode_num;
+        for(inode_num = first; inode_num < first + sb->s_inodes_per_group && inode_num <= sb->s_inodes_count; inode_num++){
+            unsigned int scope = begin_block_scope();
+            if(check_inode_in_use(inode_num) || get_inode(inode_num)->i_links_count > 0){
+                scan_inode(inode_num, &inode_scans[inode_num]);
+            }
+            end_block_scope(scope);
+        }
+    }
+    return NULL;
+}
+
+//This function scans the inode table with threads_count worker threads
+//If a thread cannot be started, the inodes it would have scanned are scanned by the walk
+void scan_inodes_in_parallel(int threads_count){
+    pthread_t *threads = malloc(threads_count * sizeof(pthread_t));
+    if(threads == NULL){
+        return;
+    }
+    int started = 0;
+    while(started < threads_count && pthread_create(&threads[started], NULL, scan_inode_table, current_image) == 0){
+        started++;
+    }
+    int i;
+    for(i = 0; i < started; i++){
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
 //This function makes sure all the blocks inside the given inode are marked as in use in block bitmap
 //Input: inode number
 //If there is any mismatch, it will:1. output information, 
@@ -162,48 +364,26 @@ int match_block_allocation_in_bitmap(int num){
     
     int mismatch_count = 0;
 
-    unsigned char *block_bitmap = get_block_bitmap();
-    struct ext2_inode *inode_table = get_inode_table();
-    struct ext2_inode *inode = &inode_table[num-1];
-    
-    //12 direct blocks
-    int n;
-    for (n = 0; n < EXT2_DIRECT_BLOCK_NUM; n++) {
-        unsigned int block_num = inode->i_block[n];
+    //Data blocks and the indirect, double indirect and triple indirect blocks that were not marked when scanned
+    //Some of them may have been marked since through another inode
+    struct inode_scan *scan = get_inode_scan(num);
+    unsigned int i;
+    for (i = 0; i < scan->unmarked_count; i++) {
+        unsigned int block_num = scan->unmarked_blocks[i];
         //The block is in use but marked as 0 in the bitmap
-        if (block_num != 0 && !check_resource_in_use(block_bitmap, block_num)) {
-            set_resource_in_use(block_num, 0);
+        if (dry_run && !(dry_run_marked_blocks[block_num / 8] & (1 << (block_num % 8)))) {
+            dry_run_marked_blocks[block_num / 8] |= 1 << (block_num % 8);
+            dry_run_blocks_marked[group_of_block(block_num)]++;
             mismatch_count++;
-        }
-    }
-
-    //Check the 13-th block
-    unsigned int indirect_block_num = inode->i_block[EXT2_DIRECT_BLOCK_NUM];
-    
-    if (indirect_block_num != 0) {
-
-        //Check the 13-th block itself
-        if (!check_resource_in_use(block_bitmap, indirect_block_num)) {
-            set_resource_in_use(indirect_block_num, 0);
+        } else if (!dry_run && !check_block_in_use(block_num)) {
+            set_resource_in_use(block_num, 0);
             mismatch_count++;
         }
-
-        // Get the indirect block
-        unsigned int *indirect_block = (unsigned int *)(disk + indirect_block_num * EXT2_BLOCK_SIZE);
-        
-        int max_indirect_blocks = EXT2_BLOCK_SIZE / sizeof(unsigned int);//1024 / 4 = 256 blocks
-        
-        int j;
-        for(j = 0; j < max_indirect_blocks; j++){
-            unsigned int direct_block_num = indirect_block[j];//The direct block store in indirect_block
-            if ((direct_block_num != 0) && (!check_resource_in_use(block_bitmap, direct_block_num))) {
-                set_resource_in_use(direct_block_num, 0);
-                mismatch_count++;
-            }
-        }
     }
 
-    if(mismatch_count > 0){
+    if(mismatch_count > 0 && dry_run){
+        print_finding("blocks_not_marked_in_use", "inode", num, mismatch_count);
+    }else if(mismatch_count > 0){
         printf("Fixed: %d in-use data blocks not marked in data bitmap for inode: [%d]\n", mismatch_count, num);
     }
 
@@ -217,12 +397,16 @@ int match_block_allocation_in_bitmap(int num){
 //Otherwise, return 0.
 int zero_i_dtime(unsigned int inode_num) {
     //Get its i_dtime from its inode
-    struct ext2_inode *inode_table = get_inode_table();
-    struct ext2_inode *inode = &inode_table[inode_num - 1];
+    struct ext2_inode *inode = get_inode(inode_num);
     unsigned int i_dtime = inode->i_dtime;
     
+    if(i_dtime != 0 && dry_run){
+        print_finding("deletion_time_set", "inode", inode_num, 1);
+        return 1;
+    }
     if(i_dtime != 0){
         inode->i_dtime = 0;
+        mark_inode_dirty(inode);
         printf("Fixed: valid inode marked for deletion: [%d]\n", inode_num);
         return 1;
     }
@@ -232,148 +416,132 @@ int zero_i_dtime(unsigned int inode_num) {
 
 
 
-//This function starts form the current enrty,
-//recursively checks all the inconsistences in itself and its child files
-//Input: the current entry
-//Return: the total number of inconsistences
-int fix_enrty_inconsis_recursively(struct ext2_dir_entry *entry) {
-    
-    if(entry->inode == 0){//The entry is not in use
+//Inodes whose checks have run, indexed by inode number
+unsigned char *visited_inodes;
+
+//A directory on the stack of fix_tree_inconsis()
+struct dir_frame {
+    struct inode_scan *scan;  //The data blocks of the directory
+    unsigned int block_idx;   //The block being walked
+    unsigned int offset;      //The offset of the next entry in that block
+};
+
+//This function returns TRUE if the entry is "." or ".."
+int is_dot_entry(struct ext2_dir_entry *entry){
+    return (entry->name_len == 1 && entry->name[0] == '.')
+        || (entry->name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.');
+}
+
+//This function runs the checks of the inode, unless they have already run through another entry
+//It returns the number of inconsistences fixed
+int fix_inode_inconsis(unsigned int inode_num){
+
+    if(visited_inodes[inode_num / 8] & (1 << (inode_num % 8))){
         return 0;
     }
-    //Get the inode of this entry
-    struct ext2_inode *inode = &(get_inode_table()[entry->inode - 1]);
+    visited_inodes[inode_num / 8] |= 1 << (inode_num % 8);
+
     int inconsis_count = 0;
-    inconsis_count += match_fileType(entry);//Fix file type mismatch b)
-    inconsis_count += match_inode_allocation_in_bitmap(entry->inode);//Fix inode allocation mismatch in bitmap c)
-    inconsis_count += zero_i_dtime(entry->inode);//Fix inode deletion time d)
-    inconsis_count += match_block_allocation_in_bitmap(entry->inode);//Fix block allocation mismatch in bitmap e)
-
-    // If entry is not a directory, we have reached the end.
-    if (entry->file_type != EXT2_FT_DIR) {
-        return inconsis_count;
-    }
-
-    // No need to check "." and ".." 
-    if (strncmp(entry->name, ".", strlen(".")) == 0 || strncmp(entry->name, "..", strlen("..")) == 0){
-        return inconsis_count;
-    }
-
-    //Check its 12 blocks:
-    int j;
-    for (j = 0 ; j < 12; j++) {
-        int i_block = inode->i_block[j];
-        if(i_block != 0){//The block is in use
-            int curr_len = 0;
-            while (curr_len < EXT2_BLOCK_SIZE) {
-                struct ext2_dir_entry *entry = (struct ext2_dir_entry *) (disk + EXT2_BLOCK_SIZE * i_block + curr_len);
-                if(entry->inode == EXT2_ROOT_INO || entry->inode >= 12){//Only check inode2 and inodes after inode11
-                    inconsis_count += fix_enrty_inconsis_recursively(entry);
-                }
-                curr_len += entry->rec_len;
-            }
-        }
+    inconsis_count += match_inode_allocation_in_bitmap(inode_num);//Fix inode allocation mismatch in bitmap c)
+    inconsis_count += zero_i_dtime(inode_num);//Fix inode deletion time d)
+    inconsis_count += match_block_allocation_in_bitmap(inode_num);//Fix block allocation mismatch in bitmap e)
+    return inconsis_count;
+}
+
+//This function checks every entry under the directory, in the order a depth first walk reaches them
+//The type of every entry is checked, the inode it points to only the first time it is reached,
+//and a directory is only walked the first time it is reached, so a corrupted directory cycle ends the walk.
+//The directories being walked are kept on an explicit stack, so a deep tree cannot overflow the C stack.
+//Return: the total number of inconsistences
+int fix_tree_inconsis(unsigned int dir_inode_num) {
+
+    int inconsis_count = 0;
+    unsigned int capacity = 64;
+    unsigned int depth = 1;
+    struct dir_frame *stack = malloc(capacity * sizeof(struct dir_frame));
+    if(stack == NULL){
+        perror("Error: fix_tree_inconsis() malloc fail");
+        ext2_abort(1);
     }
-    //Check the 13-th block
-    unsigned int indirect_block_num = inode->i_block[12];
-    
-    if (indirect_block_num != 0) {// The indirect block (12-th) is in use
-        // Get the indirect block
-        unsigned int *indirect_block = (unsigned int *)(disk + indirect_block_num * EXT2_BLOCK_SIZE);
-        
-        int max_indirect_blocks = EXT2_BLOCK_SIZE / sizeof(unsigned int);//1024 / 4 = 256 blocks
-        
-        int j;
-        for(j = 0; j < max_indirect_blocks; j++){
-            //The direct block store in indirect_block
-            unsigned int direct_block_num = indirect_block[j];
-            if(direct_block_num != 0){
-                int curr_len = 0;
-                while (curr_len < EXT2_BLOCK_SIZE) {//search every entry
-                    struct ext2_dir_entry *entry = (struct ext2_dir_entry *) (disk + EXT2_BLOCK_SIZE * direct_block_num + curr_len);
-
-                    if(entry->inode == EXT2_ROOT_INO || entry->inode >= 12){//Only check inode2 and inodes after inode11
-                        if (strncmp(entry->name, ".", strlen(".")) != 0 && strncmp(entry->name, "..", strlen("..")) != 0){
-                            inconsis_count += fix_enrty_inconsis_recursively(entry);
-                        }
-                    }
-                    
-                    curr_len += entry->rec_len;
+    stack[0].scan = get_inode_scan(dir_inode_num);
+    stack[0].block_idx = 0;
+    stack[0].offset = 0;
+
+    unsigned int scope = begin_block_scope();
+    while (depth > 0) {
+        //Nothing read for the last entry is used any more
+        end_block_scope(scope);
+        scope = begin_block_scope();
+        struct dir_frame *frame = &stack[depth - 1];
+
+        //Go to the next block, or back to the parent directory after the last one
+        if (frame->block_idx == frame->scan->dir_blocks_count) {
+            depth--;
+            continue;
+        }
+        if (frame->offset >= EXT2_BLOCK_SIZE) {
+            frame->block_idx++;
+            frame->offset = 0;
+            continue;
+        }
+
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *) (get_block(frame->scan->dir_blocks[frame->block_idx]) + frame->offset);
+        if (entry->rec_len == 0) {
+            //Corrupted block, skip the rest of it
+            frame->offset = EXT2_BLOCK_SIZE;
+            continue;
+        }
+        frame->offset += entry->rec_len;
+
+        if (entry->inode == 0 || entry->inode > sb->s_inodes_count) {//The entry is not in use
+            continue;
+        }
+        int first_visit = !(visited_inodes[entry->inode / 8] & (1 << (entry->inode % 8)));
+        inconsis_count += match_fileType(entry);//Fix file type mismatch b)
+        inconsis_count += fix_inode_inconsis(entry->inode);
+
+        //Walk a directory reached for the first time, "." and ".." point to directories already reached
+        if (first_visit && correct_file_type(entry->inode) == EXT2_FT_DIR && !is_dot_entry(entry)) {
+            if (depth == capacity) {
+                capacity *= 2;
+                stack = realloc(stack, capacity * sizeof(struct dir_frame));
+                if (stack == NULL) {
+                    perror("Error: fix_tree_inconsis() realloc fail");
+                    ext2_abort(1);
                 }
             }
+            stack[depth].scan = get_inode_scan(entry->inode);
+            stack[depth].block_idx = 0;
+            stack[depth].offset = 0;
+            depth++;
         }
     }
+    end_block_scope(scope);
 
-
+    free(stack);
     return inconsis_count;
 }
 
-//This function checks root itself and every entry in root directory
+//This function checks the root inode itself
 //It returns the total number of inconsistences
 int fix_root_dir(){
     
-    struct ext2_inode *inode_table = get_inode_table();
-    struct ext2_inode *inode = &inode_table[EXT2_ROOT_INO - 1];//Root inode
+    struct ext2_inode *inode = get_inode(EXT2_ROOT_INO);//Root inode
     int inconsis_count = 0;
 
     //Check if the root i_mode is correct b)
-    if ((inode->i_mode & EXT2_S_IFDIR) != EXT2_S_IFDIR) {
+    if ((inode->i_mode & EXT2_S_IFDIR) != EXT2_S_IFDIR && dry_run) {
+        inconsis_count += 1;
+        print_finding("entry_type_mismatch", "inode", EXT2_ROOT_INO, 1);
+    } else if ((inode->i_mode & EXT2_S_IFDIR) != EXT2_S_IFDIR) {
         inode->i_mode = inode->i_mode | EXT2_S_IFDIR;
+        mark_inode_dirty(inode);
         inconsis_count += 1;
         //Root inode's i_mode is not marked as EXT2_S_IFDIR
         printf("Fixed: Entry type vs inode mismatch: inode [2]\n");
     }
 
-    inconsis_count += match_inode_allocation_in_bitmap(EXT2_ROOT_INO);//Fix inode allocation mismatch in bitmap c)
-    inconsis_count += zero_i_dtime(EXT2_ROOT_INO);//Fix inode deletion time d)
-    inconsis_count += match_block_allocation_in_bitmap(EXT2_ROOT_INO);//Fix block allocation mismatch in bitmap e)
-    
-    //Check its 12 direct blocks
-    for (int j = 0 ; j < 12 ; j++){
-        int i_block = inode->i_block[j];
-        if(i_block != 0){//This blcok is in use
-            
-            int curr_len = 0;
-            while (curr_len < EXT2_BLOCK_SIZE) {//search every entry
-                struct ext2_dir_entry *entry = (struct ext2_dir_entry *) (disk + EXT2_BLOCK_SIZE * i_block + curr_len);
-
-                if(entry->inode != 0){
-                    if (strncmp(entry->name, ".", strlen(".")) != 0 && strncmp(entry->name, "..", strlen("..")) != 0){
-                        inconsis_count += fix_enrty_inconsis_recursively(entry);
-                    }
-                }
-                
-                curr_len += entry->rec_len;
-            }
-        }
-    }
-    //Check the 13-th block
-    unsigned int indirect_block_num = inode->i_block[12];
-    
-    if (indirect_block_num != 0) {// The indirect block (12-th) is in use
-        // Get the indirect block
-        unsigned int *indirect_block = (unsigned int *)(disk + indirect_block_num * EXT2_BLOCK_SIZE);
-        
-        int max_indirect_blocks = EXT2_BLOCK_SIZE / sizeof(unsigned int);//1024 / 4 = 256 blocks
-        
-        int j;
-        for(j = 0; j < max_indirect_blocks; j++){
-            //The direct block store in indirect_block
-            unsigned int direct_block_num = indirect_block[j];
-            if(direct_block_num != 0){
-                int curr_len = 0;
-                while (curr_len < EXT2_BLOCK_SIZE) {//search every entry
-                    struct ext2_dir_entry *entry = (struct ext2_dir_entry *) (disk + EXT2_BLOCK_SIZE * direct_block_num + curr_len);
-                    if(entry->inode != 0){
-                        if (strncmp(entry->name, ".", strlen(".")) != 0 && strncmp(entry->name, "..", strlen("..")) != 0){
-                            inconsis_count += fix_enrty_inconsis_recursively(entry);
-                        }
-                    }
-                    curr_len += entry->rec_len;
-                }
-            }
-        }
-    }
+    inconsis_count += fix_inode_inconsis(EXT2_ROOT_INO);
 
     return inconsis_count;
 }
@@ -381,22 +549,71 @@ int fix_root_dir(){
 
 int main(int argc, char *argv[]) {
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <image file name>\n", argv[0]);
+    //Options come before the image
+    int threads_count = 0;
+    int arg;
+    for (arg = 1; arg < argc - 1; arg++) {
+        if (strcmp(argv[arg], "--dry-run") == 0) {
+            dry_run = TRUE;
+        } else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc - 1 && atoi(argv[arg + 1]) >= 1) {
+            threads_count = atoi(argv[++arg]);
+        } else {
+            break;
+        }
+    }
+    if (argc < 2 || arg != argc - 1) {
+        fprintf(stderr, "Usage: %s [--dry-run] [-j <threads>] <image file name>\n", argv[0]);
         exit(1);
     }
 
-    char *image_file_name = argv[1];
-    load_image(image_file_name);
+    char *image_file_name = argv[argc - 1];
+    load_image(image_file_name, EXT2_MAP_PREFETCH_METADATA | (dry_run ? EXT2_MAP_READ_ONLY : EXT2_MAP_JOURNAL));
+
+    inode_scans = calloc(sb->s_inodes_count + 1, sizeof(struct inode_scan));
+    visited_inodes = calloc(sb->s_inodes_count / 8 + 1, 1);
+    if (dry_run) {
+        dry_run_marked_blocks = calloc(sb->s_blocks_count / 8 + 1, 1);
+        dry_run_inodes_marked = calloc(groups_count, sizeof(unsigned int));
+        dry_run_blocks_marked = calloc(groups_count, sizeof(unsigned int));
+    }
+    if (inode_scans == NULL || visited_inodes == NULL
+        || (dry_run && (dry_run_marked_blocks == NULL || dry_run_inodes_marked == NULL || dry_run_blocks_marked == NULL))) {
+        perror("Error: calloc fail");
+        exit(1);
+    }
+
+    if (dry_run) {
+        printf("{\n  \"image\": ");
+        print_json_string(image_file_name);
+        printf(",\n  \"findings\": [");
+    }
+
+    //Time every phase for --dry-run
+    double phase_ms[5];
+    double start = now_ms();
+    if (threads_count > 0) {
+        //Scan the inode table with worker threads before walking the tree
+        scan_inodes_in_parallel(threads_count);
+    }
+    phase_ms[0] = now_ms();
 
     unsigned int inconsis_count = 0;
 
     //Start from root inode, check inconsistences
-    inconsis_count += fix_root_dir();//Check every entry in roots
+    inconsis_count += fix_root_dir();//Check the root itself
+    phase_ms[1] = now_ms();
+    inconsis_count += fix_tree_inconsis(EXT2_ROOT_INO);//Check every entry under root
+    phase_ms[2] = now_ms();
     inconsis_count += match_free_inodes_count();//Fix a) inodes counter in sb and gd
+    phase_ms[3] = now_ms();
     inconsis_count += match_free_blocks_count();//Fix a) blocks counter in sb and gd
+    phase_ms[4] = now_ms();
 
-    if (inconsis_count > 0) {
+    if (dry_run) {
+        printf("%s],\n  \"inconsistencies\": %u,\n", findings_count == 0 ? "" : "\n  ", inconsis_count);
+        printf("  \"timings_ms\": {\"scan\": %.3f, \"root\": %.3f, \"traversal\": %.3f, \"inode_counters\": %.3f, \"block_counters\": %.3f}\n}\n",
+               phase_ms[0] - start, phase_ms[1] - phase_ms[0], phase_ms[2] - phase_ms[1], phase_ms[3] - phase_ms[2], phase_ms[4] - phase_ms[3]);
+    } else if (inconsis_count > 0) {
         printf("%d file system inconsistencies repaired!\n", inconsis_count);
     } else {
         printf("No file system inconsistencies detected!\n");
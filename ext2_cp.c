@@ -1,124 +1,803 @@
+//SEEK_DATA and SEEK_HOLE are GNU extensions of lseek()
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
 #include "ext2_utils.h"
 
+//Maximum number of blocks read from the source with one read() call
+#define COPY_RUN_BLOCKS 1024
 
-//This function copies the data from the source file src to the inode
-void cope_data_from_file(struct ext2_inode *inode, FILE *stream){
-	unsigned int bytes_num;//The total number of bytes that is read by fread()
+//Copying a tree (-r): files up to this size are read into memory by the reader threads,
+//larger ones are only opened by them and copied by the committer straight into the image
+#define TREE_BUFFER_MAX (1024 * 1024)
+//Maximum number of files the readers may be ahead of the committer
+#define TREE_READ_AHEAD 64
+//Maximum number of reader threads
+#define TREE_MAX_READERS 8
+
+//Blocks reserved for the file being copied, kept in the image. They are handed out in block order by take_block()
+#define reserved_extents (current_image->im_reserved)
+#define reserved_extents_count (current_image->im_reserved_count)
+#define next_extent (current_image->im_next_extent)
+#define next_offset (current_image->im_next_offset)
+
+//This function reserves count blocks for the file in as few contiguous runs as possible
+//so that the file is laid out sequentially on the image.
+//It returns EXIT_SUCCESS if all blocks are reserved, or ENOMEM if there is not enough free blocks or memory
+int reserve_blocks(unsigned int count){
+
+    while(count > 0){
+        unsigned int len;
+        unsigned int start = allocate_blocks(count, &len);
+        if(start == 0){
+            return ENOMEM;
+        }
+
+        struct ext2_extent *extents = realloc(reserved_extents, (reserved_extents_count + 1) * sizeof(struct ext2_extent));
+        if(extents == NULL){
+            //Give the run back, the runs reserved before it are released by the caller
+            unsigned int i;
+            for(i = 0; i < len; i++){
+                free_block(start + i);
+            }
+            return ENOMEM;
+        }
+        reserved_extents = extents;
+        reserved_extents[reserved_extents_count].start = start;
+        reserved_extents[reserved_extents_count].len = len;
+        reserved_extents_count++;
+
+        count -= len;
+    }
+    return EXIT_SUCCESS;
+}
+
+//This function returns the next reserved block
+//It falls back to allocate_block() if the source file grew after its size was read
+int take_block(){
+
+    if(next_extent < reserved_extents_count){
+        unsigned int block_num = reserved_extents[next_extent].start + next_offset;
+        next_offset++;
+        if(next_offset == reserved_extents[next_extent].len){
+            next_extent++;
+            next_offset = 0;
+        }
+        return block_num;
+    }
+    return allocate_block();
+}
+
+//This function hands a block that turned out not to be needed back
+//If it is the last block take_block() returned from the reservation, it goes back to the reservation
+//so that the next data block reuses it. Otherwise it is freed.
+void give_back_block(unsigned int block_num){
+
+    int prev_extent = next_extent;
+    unsigned int prev_offset = next_offset;
+    if(prev_offset == 0){
+        if(prev_extent == 0){
+            free_block(block_num);
+            return;
+        }
+        prev_extent--;
+        prev_offset = reserved_extents[prev_extent].len;
+    }
+    prev_offset--;
+
+    if(prev_extent < reserved_extents_count && reserved_extents[prev_extent].start + prev_offset == block_num){
+        next_extent = prev_extent;
+        next_offset = prev_offset;
+    }else{
+        free_block(block_num);
+    }
+}
+
+//This function frees the reserved blocks that were not used
+void release_reserved_blocks(){
+
+    while(next_extent < reserved_extents_count){
+        free_block(reserved_extents[next_extent].start + next_offset);
+        next_offset++;
+        if(next_offset == reserved_extents[next_extent].len){
+            next_extent++;
+            next_offset = 0;
+        }
+    }
+    free(reserved_extents);
+    reserved_extents = NULL;
+    reserved_extents_count = 0;
+    next_extent = 0;
+    next_offset = 0;
+}
+
+//This function returns the number of blocks (data blocks and pointer blocks) to reserve for the source file
+//Only the space the source actually has allocated is counted, holes in a sparse file need no block
+unsigned int blocks_needed(struct stat *source_stat){
+    off_t allocated = (off_t) source_stat->st_blocks * 512;
+    off_t size = allocated < source_stat->st_size ? allocated : source_stat->st_size;
+    unsigned int data_blocks = (size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    //Pointer blocks are laid out right before the data they point to
+    return blocks_with_pointers(data_blocks);
+}
+
+//This function reads up to count bytes, retrying short reads until end of file
+//It returns the number of bytes read, or -1 on error
+ssize_t read_fully(int fd, unsigned char *buf, size_t count){
+    size_t total = 0;
+    while(total < count){
+        ssize_t bytes_num = read(fd, buf + total, count - total);
+        if(bytes_num < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if(bytes_num == 0){//End of file
+            break;
+        }
+        total += bytes_num;
+    }
+    return total;
+}
+
+//This function reads from the offset of the file into the buffers of iov until they are full or the file ends
+//It resumes short reads, the iov entries are consumed as they are filled
+//It returns the number of bytes read, or -1 if the file cannot be read
+ssize_t preadv_fully(int fd, struct iovec *iov, int count, off_t offset){
+    size_t total = 0;
+    while(count > 0){
+        ssize_t bytes_num = preadv(fd, iov, count, offset + total);
+        if(bytes_num < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if(bytes_num == 0){//End of file
+            break;
+        }
+        total += bytes_num;
+
+        //Skip the buffers that were filled, and the filled part of the next one
+        while(count > 0 && (size_t) bytes_num >= iov->iov_len){
+            bytes_num -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0){
+            iov->iov_base = (unsigned char *) iov->iov_base + bytes_num;
+            iov->iov_len -= bytes_num;
+        }
+    }
+    return total;
+}
+
+//This function returns TRUE if the block only contains zeros, FALSE otherwise
+//It checks 64 bits at a time without branching inside the loop, so the compiler can vectorize it
+int block_is_zero(const unsigned char *block){
+    const uint64_t *words = (const uint64_t *) block;
+    uint64_t bits = 0;
+    size_t i;
+    for(i = 0; i < EXT2_BLOCK_SIZE / sizeof(uint64_t); i++){
+        bits |= words[i];
+    }
+    return bits == 0;
+}
+
+//This function copies the data from a source that is not a regular file (e.g. a pipe) to the inode
+//The size is unknown in advance, so data is read one block at a time
+//It returns EXIT_SUCCESS if all data is copied, ENOMEM if the image runs out of free blocks
+//or the file is too large for the block map, or EIO if the source cannot be read
+int cope_data_from_stream(struct ext2_inode *inode, int source_fd){
+	ssize_t bytes_num;//The number of bytes that is read by read()
     unsigned char buffer[EXT2_BLOCK_SIZE];
-    int block_idx = 0;
+    unsigned int block_idx = 0;//Logical index of the block inside the file
+    uint64_t file_size = 0;
 
     //Read date with the size of one block each time and copy it to one block
-    //Copy data into direct blocks (EXT2_DIRECT_BLOCK_NUM == 12)
-    while(block_idx < EXT2_DIRECT_BLOCK_NUM){
-    	
-    	bytes_num = fread(buffer, 1, EXT2_BLOCK_SIZE, stream);
-    	
-    	if(bytes_num <= 0){//All data in stream has been read
-    		return;
-    	}else{
-	    	//Allocate a new block
-	        unsigned int block_num = allocate_block();
-	        unsigned char *new_block = disk + (block_num * EXT2_BLOCK_SIZE);
-	        
-	        //Update inode information
-	        inode->i_block[block_idx] = block_num;
-	        inode->i_blocks += EXT2_BLOCK_SIZE / EXT2_SECTOR_SIZE;//Increase two sectors(512 byte * 2 = one block)
-	        inode->i_size += bytes_num;
-
-	        //Copy data into the new block
-	        memcpy(new_block, buffer, bytes_num);
-	        block_idx++;
-    	}
-    }
-
-    // After 12 blocks are full, if there is data unread in stream, 
-    // continue the work in the indirect blocks
-    if ((bytes_num = fread(buffer, 1, EXT2_BLOCK_SIZE, stream)) <= 0) {
-        return;
+    while((bytes_num = read_fully(source_fd, buffer, EXT2_BLOCK_SIZE)) > 0){
+
+        //A block of zeros is left as a hole
+        memset(buffer + bytes_num, 0, EXT2_BLOCK_SIZE - bytes_num);
+        if(block_is_zero(buffer)){
+            file_size += bytes_num;
+            block_idx++;
+            continue;
+        }
+
+        //Allocate a new block (and the pointer blocks leading to it)
+        unsigned int block_num = map_block(inode, block_idx, take_block);
+        if(block_num == 0){
+            set_inode_size(inode, file_size);
+            return ENOMEM;
+        }
+
+        //Copy data into the new block, the rest of the buffer is already clean
+        memcpy(get_block(block_num), buffer, EXT2_BLOCK_SIZE);
+        mark_block_dirty(block_num);
+        release_block(block_num);
+        file_size += bytes_num;
+        block_idx++;
     }
 
-    //Copy data to indirect blocks
-    //With 1 indirect block, we can address up to 1024 / 4 = 256 blocks
-    //Since our file system has only 128 blocks, we will not use double indirect block
-    unsigned int indirect_block_num = allocate_block();//The indirect block
-    inode->i_block[EXT2_DIRECT_BLOCK_NUM] = indirect_block_num;//The 13-th block stores the indirect block
-    inode->i_blocks += EXT2_BLOCK_SIZE / EXT2_SECTOR_SIZE;
+    //Update inode information
+    set_inode_size(inode, file_size);
+    return bytes_num < 0 ? EIO : EXIT_SUCCESS;
 
-    int max_indir_blocks = EXT2_BLOCK_SIZE / sizeof(unsigned int);//1024 / 4 = 256 blocks
-    int indir_blocks_count = 0;
-    unsigned int *indirect_block = (unsigned int *)(disk + EXT2_BLOCK_SIZE * indirect_block_num);
+}
 
-    while(indir_blocks_count <= max_indir_blocks){
-    	if(bytes_num <= 0){
-    		return;
-    	}else{
-    		// Allocate direct block to store data from stream
-        	unsigned int block_num = allocate_block();
-        	unsigned char *new_block = disk + (block_num * EXT2_BLOCK_SIZE);
+//This function copies the blocks of the regular source file from logical block block_idx up to byte end to the inode
+//Blocks are mapped in runs that are contiguous on the image and the source is read straight into
+//the blocks of the image with one preadv(), so the data is copied once by the kernel without a bounce buffer.
+//Blocks that only read zeros are then unmapped: the data after them is moved down the run so that
+//the file stays contiguous and the unused blocks at the end of the run go back to the reservation.
+//If the source shrinks while it is copied, the missing tail reads as zeros.
+//It returns EXIT_SUCCESS if all data is copied, ENOMEM if the image runs out of free blocks
+//or the file is too large for the block map, or EIO if the source cannot be read
+int copy_data_range(struct ext2_inode *inode, int source_fd, unsigned int block_idx, off_t end){
 
-        	//Update inode information
-	        *indirect_block = block_num;//Store block number in the indirect block
-	        indirect_block += 1;//Pointer moves to next int in the indirect block
-	        inode->i_blocks += EXT2_BLOCK_SIZE / EXT2_SECTOR_SIZE;//Increase two sectors
-	        inode->i_size += bytes_num;
+    unsigned int end_idx = (end + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+    unsigned int max_run = held_blocks_limit(COPY_RUN_BLOCKS);//The run is read into the buffers of the image
 
-	        //Copy data into the new block
-	        memcpy(new_block, buffer, bytes_num);
-	        
-	        indir_blocks_count++;
-    	}
+    while(block_idx < end_idx){
 
-    	bytes_num = fread(buffer, 1, EXT2_BLOCK_SIZE, stream);
+        //Map a run of blocks that are contiguous on the image
+        //A pointer block in the middle of the file ends the run
+        unsigned int first_block = map_block(inode, block_idx, take_block);
+        if(first_block == 0){
+            return ENOMEM;
+        }
+        unsigned int run = 1;
+        while(block_idx + run < end_idx && run < max_run){
+            unsigned int next_block = map_block(inode, block_idx + run, take_block);
+            if(next_block == 0){
+                return ENOMEM;
+            }
+            if(next_block != first_block + run){
+                //Already mapped, it starts the next run
+                break;
+            }
+            run++;
+        }
 
-    }
+        //Read the run straight into the image and clean what is not covered by the source
+        //The blocks are not contiguous in memory when the image is read with the pread backend
+        off_t offset = (off_t) block_idx * EXT2_BLOCK_SIZE;
+        size_t run_bytes = (size_t) run * EXT2_BLOCK_SIZE;
+        size_t remaining = end - offset;//block_idx < end_idx, so the run starts before end
+        size_t wanted = remaining < run_bytes ? remaining : run_bytes;
+        struct iovec iov[COPY_RUN_BLOCKS];
+        unsigned int iov_count = 0;
+        unsigned int i;
+        for(i = 0; i < run && (size_t) i * EXT2_BLOCK_SIZE < wanted; i++){
+            iov[i].iov_base = get_block(first_block + i);
+            iov[i].iov_len = wanted - (size_t) i * EXT2_BLOCK_SIZE < EXT2_BLOCK_SIZE ? wanted - (size_t) i * EXT2_BLOCK_SIZE : EXT2_BLOCK_SIZE;
+            iov_count++;
+        }
+        ssize_t bytes_num = preadv_fully(source_fd, iov, iov_count, offset);
+        if(bytes_num < 0){
+            return EIO;
+        }
+        for(i = 0; i < run; i++){
+            size_t filled = (size_t) bytes_num > (size_t) i * EXT2_BLOCK_SIZE ? (size_t) bytes_num - (size_t) i * EXT2_BLOCK_SIZE : 0;
+            if(filled < EXT2_BLOCK_SIZE){
+                memset(get_block(first_block + i) + filled, 0, EXT2_BLOCK_SIZE - filled);
+            }
+            mark_block_dirty(first_block + i);
+        }
+
+        //Punch out the blocks of zeros and keep the data packed at the start of the run
+        unsigned int kept = 0;
+        for(i = 0; i < run; i++){
+            if(block_is_zero(get_block(first_block + i))){
+                remap_block(inode, block_idx + i, 0);
+                continue;
+            }
+            if(kept != i){
+                memcpy(get_block(first_block + kept), get_block(first_block + i), EXT2_BLOCK_SIZE);
+                remap_block(inode, block_idx + i, first_block + kept);
+            }
+            kept++;
+        }
+        for(i = run; i > kept; i--){
+            give_back_block(first_block + i - 1);
+        }
 
-    //The function should not reach this point
-    //("Error: cope_data_from_file() fails\n");
-    return;
+        //The data of the run is in the cache, its buffers can be written back and reused
+        for(i = 0; i < run; i++){
+            release_block(first_block + i);
+        }
 
+        block_idx += run;
+    }
+    return EXIT_SUCCESS;
 }
 
-int main(int argc, char *argv[]) {
+//This function copies size bytes that were already read from the source to the inode
+//Blocks of zeros are left as holes.
+//It returns EXIT_SUCCESS if all data is copied, ENOMEM if the image runs out of free blocks
+//or the file is too large for the block map
+int cope_data_from_buffer(struct ext2_inode *inode, const unsigned char *data, size_t size){
 
-	//Check if the number of arguments is correct
-	if (argc != 4) {
-        fprintf(stderr, "Usage: %s <image file name> <path to source file> <path to dest>\n", argv[0]);
-        exit(EXIT_FAILURE);
+    unsigned char last_block[EXT2_BLOCK_SIZE];
+    unsigned int block_idx = 0;
+    size_t offset;
+    for(offset = 0; offset < size; offset += EXT2_BLOCK_SIZE, block_idx++){
+
+        //The last block is padded with zeros
+        const unsigned char *block = data + offset;
+        if(size - offset < EXT2_BLOCK_SIZE){
+            memcpy(last_block, block, size - offset);
+            memset(last_block + size - offset, 0, EXT2_BLOCK_SIZE - (size - offset));
+            block = last_block;
+        }
+        if(block_is_zero(block)){
+            continue;
+        }
+
+        unsigned int block_num = map_block(inode, block_idx, take_block);
+        if(block_num == 0){
+            set_inode_size(inode, offset);
+            return ENOMEM;
+        }
+        memcpy(get_block(block_num), block, EXT2_BLOCK_SIZE);
+        mark_block_dirty(block_num);
+        release_block(block_num);
     }
 
-    char *image_file_name = argv[1];
-    char *path_to_source = argv[2];
-    char *path_to_dest = argv[3];
+    set_inode_size(inode, size);
+    return EXIT_SUCCESS;
+}
+
+//This function copies size bytes of the regular source file to the inode
+//Only the data regions of the source (found with SEEK_DATA and SEEK_HOLE) are read,
+//holes stay unmapped in the inode and read back as zeros.
+//It returns EXIT_SUCCESS if all data is copied, ENOMEM if the image runs out of free blocks
+//or the file is too large for the block map, or EIO if the source cannot be read
+int cope_data_from_file(struct ext2_inode *inode, int source_fd, off_t size){
+
+    posix_fadvise(source_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    off_t offset = 0;//Everything before offset has been copied
+    while(offset < size){
 
+        //Find the next data region of the source
+        off_t data_start = lseek(source_fd, offset, SEEK_DATA);
+        if(data_start == -1){
+            if(errno == ENXIO){
+                //Only a hole is left up to the end of the file
+                break;
+            }
+            //The source file system cannot tell, copy everything
+            data_start = offset;
+        }
+        if(data_start >= size){
+            break;
+        }
+        off_t data_end = lseek(source_fd, data_start, SEEK_HOLE);
+        if(data_end == -1){
+            data_end = size;
+        }
 
-    //‘rb’: read in binary mode 
-    FILE *source_file = fopen(path_to_source, "rb");
-    if (source_file == NULL) {
-        exit(ENOENT);
+        //Copy whole blocks, so the next region starts in a block that has not been read yet
+        off_t copy_end = (data_end + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE * EXT2_BLOCK_SIZE;
+        if(copy_end > size){
+            copy_end = size;
+        }
+        int result = copy_data_range(inode, source_fd, data_start / EXT2_BLOCK_SIZE, copy_end);
+        if(result != EXIT_SUCCESS){
+            set_inode_size(inode, offset);
+            return result;
+        }
+        offset = copy_end;
     }
 
-    load_image(image_file_name);
+    //Update inode information, a hole at the end of the file is covered by the size alone
+    set_inode_size(inode, size);
+    return EXIT_SUCCESS;
+}
 
-    //Create a new file and get its entry
-    struct ext2_dir_entry *new_entry = create_file(path_to_dest, 0, EXT2_FT_REG_FILE);
+/*
+ * This function creates the regular file path_to_dest on the image and copies the source into it
+ * The source is either the open file source_fd, or, if data is not NULL, the size bytes already read from it
+ * which need data_blocks blocks that are not only zeros.
+ * It returns EXIT_SUCCESS if successful, ENOENT if the parent directory of the destination doesn't exist,
+ * EEXIST if the destination already exists, ENAMETOOLONG if the new name is too long,
+ * ENOMEM if the image runs out of free inodes or blocks, or EIO if the source cannot be read
+ */
+int import_file(char *path_to_dest, int source_fd, const unsigned char *data, size_t size, unsigned int data_blocks){
+
+    //Check the destination before creating anything
+    unsigned int parent_inode_num;
+    char file_name[EXT2_NAME_LEN + 1];
+    unsigned int inode_num;
+    unsigned char file_type;
+    int result = resolve_path(path_to_dest, &parent_inode_num, file_name);
+    if(result == EXIT_SUCCESS && lookup_entry(parent_inode_num, file_name, &inode_num, &file_type)){
+        result = EEXIST;
+    }
+    if(result != EXIT_SUCCESS){
+        return result;
+    }
+
+    //Create a new file, only its inode is used from its entry on
+    struct ext2_dir_entry *new_entry;
+    unsigned int scope = begin_block_scope();
+    result = create_file(path_to_dest, 0, EXT2_FT_REG_FILE, &new_entry);
+    if(result == EXIT_SUCCESS){
+        inode_num = new_entry->inode;
+    }
+    end_block_scope(scope);
+    if(result != EXIT_SUCCESS){
+        return result;
+    }
 
     //Get the inode for the newly created file
-    struct ext2_inode *inodes = get_inode_table();
-	struct ext2_inode * new_inode = &inodes[new_entry->inode - 1];
+    struct ext2_inode *new_inode = get_inode(inode_num);
 	
-	//Copy data from soure file to the new inode
-	cope_data_from_file(new_inode, source_file);
+	//Reserve contiguous blocks for the whole file before copying
+	//so that the data (and the pointer blocks before it) is laid out sequentially
+	struct stat source_stat;
+	result = EIO;
+	if(data != NULL){
+		if(reserve_blocks(blocks_with_pointers(data_blocks)) == EXIT_SUCCESS){
+			//Copy data from the buffer to the new inode
+			result = cope_data_from_buffer(new_inode, data, size);
+		}else{
+			result = ENOMEM;
+		}
+	}else if(fstat(source_fd, &source_stat) == 0){
+		if(!S_ISREG(source_stat.st_mode)){
+			//Copy data from soure stream to the new inode
+			result = cope_data_from_stream(new_inode, source_fd);
+		}else if(reserve_blocks(blocks_needed(&source_stat)) == EXIT_SUCCESS){
+			//Copy data from soure file to the new inode
+			result = cope_data_from_file(new_inode, source_fd, source_stat.st_size);
+		}else{
+			result = ENOMEM;
+		}
+	}
+	release_reserved_blocks();
+
+	if(result != EXIT_SUCCESS){
+        //Roll back by removing the partially copied file
+        delete_file(parent_inode_num, file_name);
+    }
+    return result;
+}
+
+//This function copies the file at path_to_source on the host to path_to_dest on the image
+//It returns EXIT_SUCCESS if successful, ENOENT if the source or the parent directory of the destination doesn't exist,
+//EEXIST if the destination already exists, ENAMETOOLONG if the new name is too long,
+//ENOMEM if the image runs out of free inodes or blocks, or EIO if the source cannot be read
+int copy_file(char *path_to_source, char *path_to_dest){
+
+    int source_fd = open(path_to_source, O_RDONLY);
+    if (source_fd == -1) {
+        return ENOENT;
+    }
+
+    int result = import_file(path_to_dest, source_fd, NULL, 0, 0);
 
 	//Close the source file
-    fclose(source_file);
-    
-    return 0;
+    close(source_fd);
+    return result;
+}
+
+//One directory or regular file of the host tree being copied
+struct tree_item {
+    char *source_path;
+    char *dest_path;
+    int is_dir;
+    //Filled in by a reader thread for a regular file
+    int ready;
+    int error;                //errno of a failed open() or read(), 0 otherwise
+    int fd;                   //The open source if it was not read into memory, -1 otherwise
+    unsigned char *data;      //The contents of the source if it was read into memory
+    size_t size;
+    unsigned int data_blocks; //Blocks of data that are not only zeros
+};
 
+//The items of the tree in the order they are created on the image, and the threads working on them
+struct tree_copy {
+    struct tree_item *items;
+    unsigned int count;
+    unsigned int capacity;
+    unsigned int next_read;   //The next item a reader takes
+    unsigned int committed;   //Items before this one are on the image
+    pthread_mutex_t lock;
+    pthread_cond_t item_read; //A reader finished an item
+    pthread_cond_t item_done; //The committer finished an item, or the copy stops
+    int stop;
+};
 
-}
\ No newline at end of file
+//This function appends an item to the tree
+//It returns EXIT_SUCCESS, or ENOMEM if the item cannot be allocated
+int add_tree_item(struct tree_copy *copy, const char *source_path, const char *dest_path, int is_dir){
+    if(copy->count == copy->capacity){
+        unsigned int capacity = copy->capacity == 0 ? 256 : copy->capacity * 2;
+        struct tree_item *items = realloc(copy->items, capacity * sizeof(struct tree_item));
+        if(items == NULL){
+            return ENOMEM;
+        }
+        copy->items = items;
+        copy->capacity = capacity;
+    }
+    struct tree_item *item = &copy->items[copy->count];
+    memset(item, 0, sizeof(struct tree_item));
+    item->source_path = strdup(source_path);
+    item->dest_path = strdup(dest_path);
+    item->is_dir = is_dir;
+    item->fd = -1;
+    if(item->source_path == NULL || item->dest_path == NULL){
+        free(item->source_path);
+        free(item->dest_path);
+        return ENOMEM;
+    }
+    copy->count++;
+    return EXIT_SUCCESS;
+}
+
+//This function lists the host directory source_dir, copied to dest_dir, and everything under it
+//Directories come before what they contain and names are sorted, so the image is built in a stable order.
+//Entries that are neither directories nor regular files are skipped.
+//It returns EXIT_SUCCESS, ENOENT if a directory cannot be read, ENAMETOOLONG if a path is too long
+//or ENOMEM if the list cannot be allocated
+int list_tree(struct tree_copy *copy, const char *source_dir, const char *dest_dir){
+
+    int result = add_tree_item(copy, source_dir, dest_dir, TRUE);
+    if(result != EXIT_SUCCESS){
+        return result;
+    }
+
+    struct dirent **names;
+    int names_count = scandir(source_dir, &names, NULL, alphasort);
+    if(names_count < 0){
+        return ENOENT;
+    }
+
+    int i;
+    for(i = 0; i < names_count; i++){
+        char *name = names[i]->d_name;
+        if(result != EXIT_SUCCESS || strcmp(name, ".") == 0 || strcmp(name, "..") == 0){
+            free(names[i]);
+            continue;
+        }
+
+        char source_path[PATH_MAX];
+        char dest_path[PATH_MAX];
+        if(snprintf(source_path, PATH_MAX, "%s/%s", source_dir, name) >= PATH_MAX
+           || snprintf(dest_path, PATH_MAX, "%s/%s", dest_dir, name) >= PATH_MAX){
+            result = ENAMETOOLONG;
+        }
+
+        struct stat source_stat;
+        if(result == EXIT_SUCCESS && lstat(source_path, &source_stat) == 0){
+            if(S_ISDIR(source_stat.st_mode)){
+                result = list_tree(copy, source_path, dest_path);
+            }else if(S_ISREG(source_stat.st_mode)){
+                result = add_tree_item(copy, source_path, dest_path, FALSE);
+            }else{
+                fprintf(stderr, "Warning: %s is not a directory or a regular file, skipped\n", source_path);
+            }
+        }
+        free(names[i]);
+    }
+    free(names);
+    return result;
+}
+
+//This function reads one regular file of the tree: small files are read into memory, larger ones are opened
+void read_tree_item(struct tree_item *item){
+
+    item->fd = open(item->source_path, O_RDONLY);
+    struct stat source_stat;
+    if(item->fd == -1 || fstat(item->fd, &source_stat) == -1){
+        item->error = ENOENT;
+        return;
+    }
+    if(source_stat.st_size > TREE_BUFFER_MAX){
+        //The committer reads it straight into the image, start bringing it in
+        posix_fadvise(item->fd, 0, 0, POSIX_FADV_WILLNEED);
+        return;
+    }
+
+    item->data = malloc(source_stat.st_size > 0 ? source_stat.st_size : 1);
+    if(item->data == NULL){
+        item->error = ENOMEM;
+        return;
+    }
+    ssize_t bytes_num = read_fully(item->fd, item->data, source_stat.st_size);
+    close(item->fd);
+    item->fd = -1;
+    if(bytes_num < 0){
+        item->error = EIO;
+        return;
+    }
+    item->size = bytes_num;
+
+    //Count the blocks to reserve here, so the committer does not have to
+    size_t offset;
+    for(offset = 0; offset + EXT2_BLOCK_SIZE <= item->size; offset += EXT2_BLOCK_SIZE){
+        if(!block_is_zero(item->data + offset)){
+            item->data_blocks++;
+        }
+    }
+    if(offset < item->size){
+        item->data_blocks++;
+    }
+}
+
+//This function is run by the reader threads: they take the regular files of the tree in order
+//and read them, staying at most TREE_READ_AHEAD items ahead of the committer
+void *tree_reader(void *arg){
+    struct tree_copy *copy = arg;
+
+    pthread_mutex_lock(&copy->lock);
+    while(!copy->stop){
+        //Skip the directories, the committer creates them
+        while(copy->next_read < copy->count && copy->items[copy->next_read].is_dir){
+            copy->items[copy->next_read].ready = TRUE;
+            copy->next_read++;
+        }
+        if(copy->next_read == copy->count){
+            break;
+        }
+        if(copy->next_read >= copy->committed + TREE_READ_AHEAD){
+            pthread_cond_wait(&copy->item_done, &copy->lock);
+            continue;
+        }
+
+        struct tree_item *item = &copy->items[copy->next_read++];
+        pthread_mutex_unlock(&copy->lock);
+        read_tree_item(item);
+        pthread_mutex_lock(&copy->lock);
+
+        item->ready = TRUE;
+        pthread_cond_broadcast(&copy->item_read);
+    }
+    pthread_cond_broadcast(&copy->item_read);
+    pthread_mutex_unlock(&copy->lock);
+    return NULL;
+}
+
+//This function creates one item of the tree on the image
+//It returns EXIT_SUCCESS or the errno of the failure
+int commit_tree_item(struct tree_item *item){
+    if(item->is_dir){
+        return make_directory(item->dest_path);
+    }
+    if(item->error != 0){
+        return item->error;
+    }
+    if(item->data != NULL){
+        return import_file(item->dest_path, -1, item->data, item->size, item->data_blocks);
+    }
+    return import_file(item->dest_path, item->fd, NULL, 0, 0);
+}
+
+/*
+ * This function copies the directory at source_dir on the host, and everything under it, to path_to_dest on the image
+ * A pool of reader threads reads the files ahead while this thread, the only one touching the image,
+ * creates the directories and files in order. The copy stops at the first failure, what was created before stays.
+ * It returns EXIT_SUCCESS if successful, or the errno of the first failure as copy_file() and make_directory() do.
+ * A source that is not a directory is copied like copy_file() does.
+ */
+int copy_tree(char *source_dir, char *path_to_dest){
+
+    struct stat source_stat;
+    if(stat(source_dir, &source_stat) == -1){
+        return ENOENT;
+    }
+    if(!S_ISDIR(source_stat.st_mode)){
+        return copy_file(source_dir, path_to_dest);
+    }
+
+    struct tree_copy copy;
+    memset(&copy, 0, sizeof(struct tree_copy));
+    int result = list_tree(&copy, source_dir, path_to_dest);
+
+    pthread_mutex_init(&copy.lock, NULL);
+    pthread_cond_init(&copy.item_read, NULL);
+    pthread_cond_init(&copy.item_done, NULL);
+
+    //Start the readers
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    int readers_count = cpu_count < 1 ? 1 : (cpu_count > TREE_MAX_READERS ? TREE_MAX_READERS : cpu_count);
+    pthread_t readers[TREE_MAX_READERS];
+    int started = 0;
+    while(result == EXIT_SUCCESS && started < readers_count
+          && pthread_create(&readers[started], NULL, tree_reader, &copy) == 0){
+        started++;
+    }
+    if(result == EXIT_SUCCESS && started == 0){
+        result = ENOMEM;
+    }
+
+    //Commit the items in order as they are read
+    unsigned int i;
+    for(i = 0; result == EXIT_SUCCESS && i < copy.count; i++){
+        struct tree_item *item = &copy.items[i];
+        if(!item->is_dir){
+            pthread_mutex_lock(&copy.lock);
+            while(!item->ready){
+                pthread_cond_wait(&copy.item_read, &copy.lock);
+            }
+            pthread_mutex_unlock(&copy.lock);
+        }
+
+        //The blocks read to create the item are put back once it is created
+        unsigned int scope = begin_block_scope();
+        result = commit_tree_item(item);
+        end_block_scope(scope);
+
+        pthread_mutex_lock(&copy.lock);
+        copy.committed = i + 1;
+        pthread_cond_broadcast(&copy.item_done);
+        pthread_mutex_unlock(&copy.lock);
+    }
+
+    //Stop the readers and free the items
+    pthread_mutex_lock(&copy.lock);
+    copy.stop = TRUE;
+    pthread_cond_broadcast(&copy.item_done);
+    pthread_mutex_unlock(&copy.lock);
+    int t;
+    for(t = 0; t < started; t++){
+        pthread_join(readers[t], NULL);
+    }
+    for(i = 0; i < copy.count; i++){
+        if(copy.items[i].fd != -1){
+            close(copy.items[i].fd);
+        }
+        free(copy.items[i].data);
+        free(copy.items[i].source_path);
+        free(copy.items[i].dest_path);
+    }
+    free(copy.items);
+    pthread_mutex_destroy(&copy.lock);
+    pthread_cond_destroy(&copy.item_read);
+    pthread_cond_destroy(&copy.item_done);
+    return result;
+}
+
+#ifndef EXT2_BATCH
+int main(int argc, char *argv[]) {
+
+	//Check if the number of arguments is correct
+	if (argc < 4 || argc > 5) {
+        fprintf(stderr, "Usage: %s <image file name> <path to source file> <path to dest> or\n"
+                        "       %s <image file name> -r <path to source directory> <path to dest>\n", argv[0], argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    char *image_file_name = argv[1];
+
+    if (argc == 5) {//Copy a directory tree
+        if(strcmp(argv[2], "-r") != 0){//flag is not '-r'
+            fprintf(stderr, "Error: flag %s is not '-r'\n", argv[2]);
+            exit(EXIT_FAILURE);
+        }
+        load_image(image_file_name, EXT2_MAP_SEQUENTIAL | EXT2_MAP_JOURNAL);
+        return copy_tree(argv[3], argv[4]);
+    }
+
+    char *path_to_source = argv[2];
+    char *path_to_dest = argv[3];
+
+    load_image(image_file_name, EXT2_MAP_SEQUENTIAL | EXT2_MAP_JOURNAL);
+
+    return copy_file(path_to_source, path_to_dest);
+
+}
+#endif
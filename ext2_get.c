@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include "ext2_utils.h"
+#include "ext2_image_fields.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+//Holes of sparse files are written from this block
+static const unsigned char zero_block[EXT2_BLOCK_SIZE];
+
+//The pieces of the file waiting to be written with one writev()
+struct get_output {
+    int fd;
+    struct iovec iov[IOV_MAX];
+    int count;
+    unsigned int blocks[IOV_MAX];//The blocks of the image the pieces point into, released once they are written
+    int block_count;
+    int max_blocks;//Blocks held at most before writing them, so that they fit in the buffer cache
+};
+
+//This function writes all the queued pieces, resuming after short writes
+//It returns EXIT_SUCCESS if successful, or the errno of the failed write
+int flush_output(struct get_output *out){
+
+    struct iovec *iov = out->iov;
+    int count = out->count;
+    while(count > 0){
+        ssize_t written = writev(out->fd, iov, count);
+        if(written < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return errno;
+        }
+
+        //Skip the pieces that were written completely, and the written part of the next one
+        while(count > 0 && (size_t) written >= iov->iov_len){
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0){
+            iov->iov_base = (unsigned char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    out->count = 0;
+    while(out->block_count > 0){
+        release_block(out->blocks[--out->block_count]);
+    }
+    return EXIT_SUCCESS;
+}
+
+//This function queues len bytes at data to be written after the pieces already queued
+//A piece that starts where the previous one ends in the image is merged with it,
+//so a run of contiguous blocks is written as one piece
+//It returns EXIT_SUCCESS if successful, or the errno of a failed write
+int queue_output(struct get_output *out, const unsigned char *data, size_t len){
+
+    if(out->count > 0){
+        struct iovec *last = &out->iov[out->count - 1];
+        if((unsigned char *) last->iov_base + last->iov_len == data && data != zero_block){
+            last->iov_len += len;
+            return EXIT_SUCCESS;
+        }
+    }
+    if(out->count == IOV_MAX){
+        int result = flush_output(out);
+        if(result != EXIT_SUCCESS){
+            return result;
+        }
+    }
+    out->iov[out->count].iov_base = (void *) data;
+    out->iov[out->count].iov_len = len;
+    out->count++;
+    return EXIT_SUCCESS;
+}
+
+//This function queues the first len bytes of the block of the image
+//The block stays in memory until it is written
+//It returns EXIT_SUCCESS if successful, or the errno of a failed read or write
+int queue_block(struct get_output *out, unsigned int block_num, size_t len){
+    if(out->count == IOV_MAX || out->block_count == out->max_blocks){
+        int result = flush_output(out);
+        if(result != EXIT_SUCCESS){
+            return result;
+        }
+    }
+    unsigned char *data;
+    int result = read_block(block_num, &data);
+    if(result != EXIT_SUCCESS){
+        return result;
+    }
+    out->blocks[out->block_count++] = block_num;
+    return queue_output(out, data, len);
+}
+
+//This function queues the zeros of a hole from byte offset 'from' up to byte offset 'to' of the file
+//It returns EXIT_SUCCESS if successful, or the errno of a failed write
+int queue_hole(struct get_output *out, uint64_t from, uint64_t to){
+    while(from < to){
+        size_t len = to - from < EXT2_BLOCK_SIZE ? to - from : EXT2_BLOCK_SIZE;
+        int result = queue_output(out, zero_block, len);
+        if(result != EXIT_SUCCESS){
+            return result;
+        }
+        from += len;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * This function writes the contents of the file at path_in_image to fd
+ * It walks the block map once and writes straight from the mapped image (or the buffers of the image)
+ * with writev(), one piece per run of contiguous blocks, so the data is never copied into a buffer.
+ * The blocks are released as soon as they are written, so a large file goes through a small cache.
+ * Holes are written as zeros, and a symbolic link gives the path it points to.
+ * It returns EXIT_SUCCESS if successful, ENOENT if the file doesn't exist, EISDIR if it is a directory,
+ * EIO if its block map points outside the image, or the errno of a failed read or write
+ */
+int get_file(char *path_in_image, int fd){
+
+    //Find the file
+    unsigned int parent_inode_num;
+    char file_name[EXT2_NAME_LEN + 1];
+    int result = resolve_path(path_in_image, &parent_inode_num, file_name);
+    if(result == EEXIST){
+        //The path is root
+        return EISDIR;
+    }
+    if(result != EXIT_SUCCESS){
+        return ENOENT;
+    }
+    unsigned int inode_num;
+    unsigned char file_type;
+    if(!lookup_entry(parent_inode_num, file_name, &inode_num, &file_type)){
+        return ENOENT;
+    }
+    struct ext2_inode *inode = get_inode(inode_num);
+    if(get_inode_type(inode) == 'd'){
+        return EISDIR;
+    }
+    uint64_t size = get_inode_size(inode);
+
+    struct get_output out;
+    out.fd = fd;
+    out.count = 0;
+    out.block_count = 0;
+    out.max_blocks = held_blocks_limit(IOV_MAX);
+
+    //Fast symbolic links keep the target path in i_block
+    if(get_inode_type(inode) == 'l' && inode->i_blocks == 0){
+        size_t len = size < sizeof(inode->i_block) ? size : sizeof(inode->i_block);
+        result = queue_output(&out, (unsigned char *) inode->i_block, len);
+        return result != EXIT_SUCCESS ? result : flush_output(&out);
+    }
+
+    uint64_t offset = 0;//Bytes of the file queued so far
+    struct block_iter iter;
+    block_iter_init(&iter, inode);
+    unsigned int block_num;
+    unsigned int logical;
+    int is_pointer;
+    while(offset < size && (block_num = block_iter_next(&iter, &logical, &is_pointer)) != 0){
+        if(is_pointer){
+            continue;
+        }
+        if(block_num >= sb->s_blocks_count){
+            return EIO;
+        }
+        uint64_t block_start = (uint64_t) logical * EXT2_BLOCK_SIZE;
+        if(block_start >= size){
+            break;
+        }
+
+        //The blocks skipped since the last one are a hole
+        result = queue_hole(&out, offset, block_start);
+        if(result != EXIT_SUCCESS){
+            return result;
+        }
+        size_t len = size - block_start < EXT2_BLOCK_SIZE ? size - block_start : EXT2_BLOCK_SIZE;
+        result = queue_block(&out, block_num, len);
+        if(result != EXIT_SUCCESS){
+            return result;
+        }
+        offset = block_start + len;
+    }
+
+    //The file may end with a hole
+    result = queue_hole(&out, offset, size);
+    if(result != EXIT_SUCCESS){
+        return result;
+    }
+    return flush_output(&out);
+}
+
+/*
+ * This program takes two or three command line arguments.
+ * The first is the name of an ext2 formatted virtual disk.
+ * The second is an absolute path to a file on the disk.
+ * The third, if given, is the host path the file is written to; otherwise (or with '-') it goes to stdout.
+ * The image is opened read-only.
+ */
+int main(int argc, char *argv[]) {
+
+    //Check if the number of arguments is correct
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s <image file name> <path to file> [host path]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    char *image_file_name = argv[1];
+    char *path_in_image = argv[2];
+    load_image(image_file_name, EXT2_MAP_READ_ONLY | EXT2_MAP_SEQUENTIAL);
+
+    int fd = STDOUT_FILENO;
+    if(argc == 4 && strcmp(argv[3], "-") != 0){
+        fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0){
+            perror("Error: cannot open host file");
+            exit(errno);
+        }
+    }
+
+    int result = get_file(path_in_image, fd);
+    if(result != EXIT_SUCCESS && result != ENOENT && result != EISDIR){
+        fprintf(stderr, "Error: cannot write %s: %s\n", path_in_image, strerror(result));
+    }
+    if(fd != STDOUT_FILENO && close(fd) != 0 && result == EXIT_SUCCESS){
+        result = errno;
+    }
+    return result;
+
+}
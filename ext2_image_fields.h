@@ -0,0 +1,15 @@
+#ifndef CSC369_EXT2_IMAGE_FIELDS_H
+#define CSC369_EXT2_IMAGE_FIELDS_H
+
+#include "ext2_utils.h"
+
+//Short names for the fields of the image bound to the calling thread, see ext2_use_image().
+//They are only meant for the tools and the helpers, which is why ext2_utils.h does not define them.
+#define disk (current_image->im_disk)
+#define disk_size (current_image->im_disk_size)
+#define sb (current_image->im_sb)
+#define gd (current_image->im_gd)
+#define groups_count (current_image->im_groups_count)
+#define inode_size (current_image->im_inode_size)
+
+#endif
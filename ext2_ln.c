@@ -3,25 +3,101 @@
 #include <string.h>
 #include <errno.h>
 #include "ext2_utils.h"
+#include "ext2_image_fields.h"
 
 //This function stores the absolute path (source_path) in a data block (regardless of length) of the file
 //Input: file_entry is the symbolic file that stores source_path
-void store_symbolic_link(struct ext2_dir_entry *file_entry, char *source_path){
+//It returns EXIT_SUCCESS if successful, or ENOMEM if there is no free block
+int store_symbolic_link(struct ext2_dir_entry *file_entry, char *source_path){
 
     //Get the inode of the file
-    struct ext2_inode *inode_table = get_inode_table();
-    struct ext2_inode *inode = &inode_table[file_entry->inode - 1];
+    struct ext2_inode *inode = get_inode(file_entry->inode);
 
     //Allocate a new block and store absolute path to link
     int block_num = allocate_block();
-    unsigned char* block = (unsigned char*)(disk + block_num * EXT2_BLOCK_SIZE);
+    if(block_num == 0){
+        return ENOMEM;
+    }
+    unsigned char* block = (unsigned char*)get_block(block_num);
 
     //Store the absolute path in the block
     memcpy(block, source_path, strlen(source_path));
+    mark_block_dirty(block_num);
    
     inode->i_block[0] = block_num; //The 1-st block pointer points to the newly created block
     inode->i_size = strlen(source_path);//The size of the inode is the length if the path
     inode->i_blocks = 2; //There are 2 sectors in the inode
+    mark_inode_dirty(inode);
+
+    return EXIT_SUCCESS;
+}
+
+//This function links dest_path to the existing source_path
+//file_type is EXT2_FT_REG_FILE for a hard link or EXT2_FT_SYMLINK for a symbolic link
+//It returns EXIT_SUCCESS if successful, ENOENT if the source or the parent of the destination doesn't exist,
+//EISDIR if a hard link refers to a directory, EEXIST if the destination already exists,
+//ENAMETOOLONG if the new name is too long, or ENOMEM if there is no free inode or block
+int link_file(char *source_path, char *dest_path, unsigned char file_type){
+
+    //Get the entry of the source file
+    unsigned int parent_inode_num;
+    char source_file_name[EXT2_NAME_LEN + 1];
+    int result = resolve_path(source_path, &parent_inode_num, source_file_name);
+    if(result != EXIT_SUCCESS){
+        return result == ENAMETOOLONG ? ENOENT : result;
+    }
+    struct ext2_inode *parent_inode = get_inode(parent_inode_num);
+    
+    struct ext2_dir_entry * source_entry = find_entry(parent_inode, source_file_name);
+
+    //Return ENOENT if the source file doesn't exist
+    if(source_entry == NULL){
+        //printf("Error: source file %s doesn't exist", source_path);
+        return ENOENT;
+    }
+
+    //Return EISDIR if a hardlink refers to a directory
+    if(source_entry->file_type == EXT2_FT_DIR && file_type == EXT2_FT_REG_FILE){
+        return EISDIR;
+    }
+
+    //Check the destination before creating anything
+    unsigned int dest_parent_inode_num;
+    char dest_file_name[EXT2_NAME_LEN + 1];
+    result = resolve_path(dest_path, &dest_parent_inode_num, dest_file_name);
+    if(result != EXIT_SUCCESS){
+        return result;
+    }
+    if(find_entry(get_inode(dest_parent_inode_num), dest_file_name) != NULL){
+        return EEXIST;
+    }
+
+    if(file_type == EXT2_FT_REG_FILE){
+        //Greate a hard link
+        //The newly created file shares the same inode number with the source file
+        struct ext2_dir_entry* new_entry;
+        result = create_file(dest_path, source_entry->inode, EXT2_FT_REG_FILE, &new_entry);
+        if(result != EXIT_SUCCESS){
+            return result;
+        }
+    }else{
+        //Greate a symbolic link
+        //The newly created file needs a new inode
+        struct ext2_dir_entry* new_entry;
+        result = create_file(dest_path, 0, EXT2_FT_SYMLINK, &new_entry);
+        if(result != EXIT_SUCCESS){
+            return result;
+        }
+
+        //Store the absolute path in the newly created file
+        if(store_symbolic_link(new_entry, source_path) == ENOMEM){
+            //Roll back by removing the new link
+            delete_file(dest_parent_inode_num, dest_file_name);
+            return ENOMEM;
+        }
+    }
+
+    return EXIT_SUCCESS;
 }
 
 /*
@@ -31,7 +107,7 @@ void store_symbolic_link(struct ext2_dir_entry *file_entry, char *source_path){
  * The third one is the file that is being created
  * The program works like ln, creating a link from the first specified file to the second specified path.
  */
-
+#ifndef EXT2_BATCH
 int main(int argc, char *argv[]) {
     
     //Check if the number of arguments is correct
@@ -52,7 +128,7 @@ int main(int argc, char *argv[]) {
         source_path = argv[2];
         dest_path = argv[3];
         file_type = EXT2_FT_REG_FILE;
-    }else if(argc == 5){//Create a symlink link
+    }else{//Create a symlink link
         char *flag = argv[2];
         if(strcmp(flag, "-s") != 0){//flag is not '-s'
             fprintf(stderr, "Error: flag %s is not '-s'", flag);
@@ -63,53 +139,9 @@ int main(int argc, char *argv[]) {
         file_type = EXT2_FT_SYMLINK;
     }
 
-    load_image(image_file_name);
-
-    //Get file name
-    //Create a copy of path_to_source so that path_to_source won't be changed
-    char path_to_source_copy[strlen(source_path) + 1];
-    strcpy(path_to_source_copy, source_path);
-    char * source_file_name = get_file_name(path_to_source_copy);
-    char const_file_name[EXT2_NAME_LEN + 1];//Make the name constont
-    int i;
-    for(i = 0; i < strlen(source_file_name); i++){
-        const_file_name[i] = source_file_name[i];
-    }
-    const_file_name[strlen(source_file_name)] = '\0';
-
-    //Get the entry of the source file
-    //Create a copy of path_to_source so that path_to_source won't be changed
-    char path_to_source_copy2[strlen(source_path) + 1];
-    strcpy(path_to_source_copy2, source_path);
-    int parent_inode_num = second_last_dir_inode(path_to_source_copy2);
-    struct ext2_inode *parent_inode = &get_inode_table()[parent_inode_num - 1];
-    
-    struct ext2_dir_entry * source_entry = find_entry(parent_inode, const_file_name);
-
-    //Return ENOENT if the source file doesn't exist
-    if(source_entry == NULL){
-        //printf("Error: source file %s doesn't exist", source_path);
-        return ENOENT;
-    }
-
-    //Return EISDIR if a hardlink refers to a directory
-    if(source_entry->file_type == EXT2_FT_DIR && file_type == EXT2_FT_REG_FILE){
-        return EISDIR;
-    }
-
-    if(file_type == EXT2_FT_REG_FILE){
-        //Greate a hard link
-        //The newly created file shares the same inode number with the source file
-        create_file(dest_path, source_entry->inode, EXT2_FT_REG_FILE);
-    }else{
-        //Greate a symbolic link
-        //The newly created file needs a new inode
-        struct ext2_dir_entry* new_entry = create_file(dest_path, 0, EXT2_FT_SYMLINK);
-
-        //Store the absolute path in the newly created file
-        store_symbolic_link(new_entry, source_path);
-    }
-
+    load_image(image_file_name, EXT2_MAP_RANDOM | EXT2_MAP_JOURNAL);
 
+    return link_file(source_path, dest_path, file_type);
 
 }
+#endif
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "ext2_utils.h"
+#include "ext2_image_fields.h"
+
+int long_format;  //-l: print the mode, links, owner, size and modification time of every entry
+int recursive;    //-R: list every directory under the path too
+
+//This function prints the symbolic link target of the inode after " -> "
+void print_link_target(struct ext2_inode *inode){
+    unsigned int len = inode->i_size;
+    char *target;
+    if(inode->i_blocks == 0){
+        //Fast symbolic links keep the target path in i_block
+        target = (char *) inode->i_block;
+        if(len > sizeof(inode->i_block)){
+            len = sizeof(inode->i_block);
+        }
+    }else{
+        if(inode->i_block[0] == 0 || inode->i_block[0] >= sb->s_blocks_count){
+            return;
+        }
+        target = (char *) get_block(inode->i_block[0]);
+        if(len > EXT2_BLOCK_SIZE){
+            len = EXT2_BLOCK_SIZE;
+        }
+    }
+    printf(" -> %.*s", len, target);
+}
+
+//This function prints one entry, with the details of its inode for -l
+void print_entry(unsigned int inode_num, char *name, int name_len){
+
+    if(!long_format){
+        printf("%.*s\n", name_len, name);
+        return;
+    }
+    if(inode_num == 0 || inode_num > sb->s_inodes_count){
+        printf("?????????? %.*s\n", name_len, name);
+        return;
+    }
+
+    struct ext2_inode *inode = get_inode(inode_num);
+    char type = get_inode_type(inode);
+    char mode[11];
+    mode[0] = type == 'f' ? '-' : type == 'o' ? '?' : type;
+    const char *rwx = "rwxrwxrwx";
+    int i;
+    for(i = 0; i < 9; i++){
+        mode[i + 1] = inode->i_mode & (0400 >> i) ? rwx[i] : '-';
+    }
+    mode[10] = '\0';
+
+    char mtime[32];
+    time_t modified = inode->i_mtime;
+    struct tm tm;
+    strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M", localtime_r(&modified, &tm));
+
+    printf("%s %3u %5u %5u %10llu %s %.*s", mode, inode->i_links_count, inode->i_uid, inode->i_gid,
+           (unsigned long long) get_inode_size(inode), mtime, name_len, name);
+    if(type == 'l'){
+        print_link_target(inode);
+    }
+    printf("\n");
+}
+
+//This function returns TRUE if the entry is '.' or '..'
+int is_dot_entry(struct ext2_dir_entry *entry){
+    return entry->name_len <= 2 && entry->name[0] == '.' && (entry->name_len == 1 || entry->name[1] == '.');
+}
+
+//This function returns TRUE if the entry is a directory that -R should go into
+int is_subdirectory(struct ext2_dir_entry *entry){
+    return !is_dot_entry(entry) && entry->inode <= sb->s_inodes_count
+           && get_inode_type(get_inode(entry->inode)) == 'd';
+}
+
+//This function prints up to max_entries entries of the directory from the cursor (all of them if max_entries is 0)
+//It returns TRUE if the directory has more entries after the cursor, which is left on the next one
+int list_dir(struct ext2_inode *dir, struct dir_cursor *cursor, unsigned long max_entries){
+
+    unsigned long printed = 0;
+    struct dir_cursor next = *cursor;
+    while(TRUE){
+        //The blocks of an entry are only kept while it is printed, so a large directory goes through a small cache
+        unsigned int scope = begin_block_scope();
+        struct ext2_dir_entry *entry = read_dir(dir, &next);
+        if(entry == NULL){
+            end_block_scope(scope);
+            break;
+        }
+        if(max_entries != 0 && printed == max_entries){
+            end_block_scope(scope);
+            return TRUE;
+        }
+        print_entry(entry->inode, entry->name, entry->name_len);
+        end_block_scope(scope);
+        printed++;
+        *cursor = next;
+    }
+    *cursor = next;
+    return FALSE;
+}
+
+//A directory whose subdirectories -R is going through
+struct ls_frame {
+    unsigned int inode_num;
+    struct dir_cursor cursor;  //The next entry to look at for a subdirectory
+    char *path;
+};
+
+/*
+ * This function lists the directory and then, depth first, every directory under it, like ls -R
+ * Each directory is listed with one read_dir() pass, then a second pass finds its subdirectories.
+ * Only one cursor per level of the tree is kept, never a whole directory.
+ */
+void list_tree(unsigned int dir_inode_num, char *dir_path){
+
+    unsigned int capacity = 64;
+    unsigned int depth = 0;
+    struct ls_frame *stack = malloc(capacity * sizeof(struct ls_frame));
+    unsigned char *visited = calloc(sb->s_inodes_count / 8 + 1, 1);
+    if(stack == NULL || visited == NULL){
+        perror("Error: list_tree() alloc fail");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned int inode_num = dir_inode_num;
+    char *path = strdup(dir_path);
+    while(path != NULL){
+        //List the directory and go through its subdirectories next
+        visited[inode_num / 8] |= 1 << (inode_num % 8);
+        struct dir_cursor cursor;
+        memset(&cursor, 0, sizeof(struct dir_cursor));
+        printf("%s%s:\n", depth == 0 ? "" : "\n", path);
+        unsigned int scope = begin_block_scope();
+        list_dir(get_inode(inode_num), &cursor, 0);
+        end_block_scope(scope);
+
+        if(depth == capacity){
+            capacity *= 2;
+            stack = realloc(stack, capacity * sizeof(struct ls_frame));
+            if(stack == NULL){
+                perror("Error: list_tree() realloc fail");
+                exit(EXIT_FAILURE);
+            }
+        }
+        stack[depth].inode_num = inode_num;
+        memset(&stack[depth].cursor, 0, sizeof(struct dir_cursor));
+        stack[depth++].path = path;
+        path = NULL;
+
+        //Find the next subdirectory that has not been listed, going back up when a directory has no more
+        while(path == NULL && depth > 0){
+            struct ls_frame *frame = &stack[depth - 1];
+            struct ext2_dir_entry *entry;
+            //Only the blocks of the subdirectory found stay pinned, until its path is built
+            scope = begin_block_scope();
+            while((entry = read_dir(get_inode(frame->inode_num), &frame->cursor)) != NULL){
+                if(is_subdirectory(entry) && !(visited[entry->inode / 8] & (1 << (entry->inode % 8)))){
+                    break;
+                }
+                end_block_scope(scope);
+                scope = begin_block_scope();
+            }
+            if(entry == NULL){
+                end_block_scope(scope);
+                free(frame->path);
+                depth--;
+                continue;
+            }
+            inode_num = entry->inode;
+            path = malloc(strlen(frame->path) + entry->name_len + 2);
+            if(path == NULL){
+                perror("Error: list_tree() alloc fail");
+                exit(EXIT_FAILURE);
+            }
+            sprintf(path, "%s%s%.*s", frame->path, strcmp(frame->path, "/") == 0 ? "" : "/", entry->name_len, entry->name);
+            end_block_scope(scope);
+        }
+    }
+
+    free(stack);
+    free(visited);
+}
+
+/*
+ * This program lists a directory of an ext2 formatted virtual disk, or a single file.
+ *     ext2_ls <image file name> [-l] [-R] <path>
+ *     ext2_ls <image file name> [-l] -n <count> [-c <cursor>] <path>
+ * Entries are printed in the order they are stored. With -n, at most count entries are printed,
+ * and if the directory has more, the cursor of the next one (<block>:<offset>) is printed on stderr as
+ * "next: <cursor>"; giving it back with -c prints the next page.
+ * It returns EXIT_SUCCESS if successful, ENOENT if the path doesn't exist, or EINVAL if the cursor is not valid
+ */
+int main(int argc, char *argv[]) {
+
+    unsigned long max_entries = 0;
+    struct dir_cursor cursor;
+    memset(&cursor, 0, sizeof(struct dir_cursor));
+    int paged = FALSE;
+    char *path = NULL;
+    int i;
+    for(i = 2; i < argc; i++){
+        if(strcmp(argv[i], "-l") == 0){
+            long_format = TRUE;
+        }else if(strcmp(argv[i], "-R") == 0){
+            recursive = TRUE;
+        }else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc){
+            char *end;
+            max_entries = strtoul(argv[++i], &end, 10);
+            if(*end != '\0' || max_entries == 0){
+                path = NULL;
+                break;
+            }
+            paged = TRUE;
+        }else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc){
+            if(sscanf(argv[++i], "%u:%u", &cursor.logical, &cursor.offset) != 2){
+                path = NULL;
+                break;
+            }
+            paged = TRUE;
+        }else if(path == NULL && argv[i][0] != '-'){
+            path = argv[i];
+        }else{
+            path = NULL;
+            break;
+        }
+    }
+    if(argc < 3 || path == NULL || (paged && recursive)){
+        fprintf(stderr, "Usage: %s <image file name> [-l] [-R] <path> or\n"
+                        "       %s <image file name> [-l] -n <count> [-c <cursor>] <path>\n", argv[0], argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    char *image_file_name = argv[1];
+    load_image(image_file_name, EXT2_MAP_READ_ONLY | EXT2_MAP_RANDOM);
+
+    //Find the path
+    unsigned int inode_num = EXT2_ROOT_INO;
+    char name[EXT2_NAME_LEN + 1] = "/";
+    unsigned char file_type = EXT2_FT_DIR;
+    unsigned int parent_inode_num;
+    int result = resolve_path(path, &parent_inode_num, name);
+    if(result != EXIT_SUCCESS && result != EEXIST){
+        return ENOENT;
+    }
+    if(result == EXIT_SUCCESS && !lookup_entry(parent_inode_num, name, &inode_num, &file_type)){
+        return ENOENT;
+    }
+    if(get_inode_type(get_inode(inode_num)) != 'd'){
+        //A file is listed by itself
+        print_entry(inode_num, name, strlen(name));
+        return EXIT_SUCCESS;
+    }
+
+    if(recursive){
+        list_tree(inode_num, path);
+        return EXIT_SUCCESS;
+    }
+
+    struct ext2_inode *dir = get_inode(inode_num);
+    if(!dir_cursor_valid(dir, &cursor)){
+        fprintf(stderr, "Error: cursor %u:%u is not an entry of %s\n", cursor.logical, cursor.offset, path);
+        return EINVAL;
+    }
+    if(list_dir(dir, &cursor, max_entries)){
+        fflush(stdout);
+        fprintf(stderr, "next: %u:%u\n", cursor.logical, cursor.offset);
+    }
+    return EXIT_SUCCESS;
+
+}
@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include "ext2_utils.h"
+#include "ext2_image_fields.h"
 
 
  // This function checks if all its data blocks are not in use.
@@ -10,55 +12,28 @@
  // Therefore, all the data blocks and the inode should be free when restoring the file
 int inode_and_all_data_blocks_free(unsigned int inode_num){
     
-    unsigned char *block_bitmap = get_block_bitmap();
-    unsigned char *inode_bitmap = get_inode_bitmap();
-    
     //First check this inode
-    if(check_resource_in_use(inode_bitmap, inode_num)){
+    if(check_inode_in_use(inode_num)){
         return FALSE;
     }
 
-    //The inode is not in use, check all its data blocks
-    struct ext2_inode *inode_table = get_inode_table();
-    struct ext2_inode *inode = &inode_table[inode_num - 1];
-    int i;
-
-    //Check 12 direct blocks
-    for (i = 0; i < EXT2_DIRECT_BLOCK_NUM; i++) {
-        int block_num = inode->i_block[i];
-        
-        if (block_num == 0) {//Reach the end of the block list and all the blocks before are not in use
-            return TRUE;
-        }else{
-            if (check_resource_in_use(block_bitmap, block_num)) {
-                return FALSE;
-            }
+    //The inode is not in use, check all its data blocks and pointer blocks
+    unsigned int scope = begin_block_scope();
+    struct ext2_inode *inode = get_inode(inode_num);
+    struct block_iter iter;
+    block_iter_init(&iter, inode);
+    unsigned int block_num;
+    int all_free = TRUE;
+    while ((block_num = block_iter_next(&iter, NULL, NULL)) != 0) {
+        if (check_block_in_use(block_num)) {
+            all_free = FALSE;
+            break;
         }
     }
+    end_block_scope(scope);
 
-    //Check the 13-th block (indirect block)
-    int indirect_block_num = inode->i_block[EXT2_DIRECT_BLOCK_NUM];
-    if(indirect_block_num == 0){
-        return TRUE;
-    }
-    unsigned int* indirect_block = (unsigned int*)(disk + EXT2_BLOCK_SIZE * indirect_block_num);
-    int max_indirect_blocks = EXT2_BLOCK_SIZE / sizeof(unsigned int);
-    
-    //Search inside the indirect block
-    int j;
-    for(j = 0; j < max_indirect_blocks; j++){
-        int direct_block_num = indirect_block[j];
-        if (direct_block_num == 0) {//Reach the end of the block list
-            return TRUE;
-        }else{
-            if (check_resource_in_use(block_bitmap, direct_block_num)) {
-                return FALSE;
-            }
-        }
-    }
-
-    //Have checked all the data blocks and none of them is in use
-    return TRUE;
+    //TRUE if all the data blocks have been checked and none of them is in use
+    return all_free;
 }
 
 //This function set the given inode and all its data blocks to be in use
@@ -73,47 +48,20 @@ int reset_inode_and_all_data_blocks_in_use(unsigned int inode_num){
         return ENOENT;
     }
 
-    struct ext2_inode *inode_table = get_inode_table();
-    struct ext2_inode *inode = &inode_table[inode_num - 1];
+    struct ext2_inode *inode = get_inode(inode_num);
 
     set_resource_in_use(inode_num, 1);//Set the inode in use
     inode->i_links_count = 1;//Update link count
     inode->i_dtime = 0;//Update deletion time
+    mark_inode_dirty(inode);
 
-    //Set all its data blocks in use
-    int i;
-    for (i = 0; i < EXT2_DIRECT_BLOCK_NUM; i++) {//For 12 direct blocks
-        int block_num = inode->i_block[i];
-        
-        if (block_num == 0) {//Reach the end of the block list
-            return EXIT_SUCCESS;
-        }
-        //Set the block in use
+    //Set all its data blocks and pointer blocks in use
+    struct block_iter iter;
+    block_iter_init(&iter, inode);
+    unsigned int block_num;
+    while ((block_num = block_iter_next(&iter, NULL, NULL)) != 0) {
         set_resource_in_use(block_num, 0);
     }
-
-
-    //For the 13-th block (indirect block)
-    int indirect_block_num = inode->i_block[EXT2_DIRECT_BLOCK_NUM];
-    if(indirect_block_num == 0){//The indirect block is not in use
-        return EXIT_SUCCESS;
-    }
-
-    //Set the indirect block in use
-    set_resource_in_use(indirect_block_num, 0);
-    unsigned int* indirect_block = (unsigned int*)(disk + EXT2_BLOCK_SIZE * indirect_block_num);
-    int max_indirect_blocks = EXT2_BLOCK_SIZE / sizeof(unsigned int);
-    
-    //Loop over the indirect block
-    int j;
-    for(j = 0; j < max_indirect_blocks; j++){
-        int direct_block_num = indirect_block[j];
-        if (direct_block_num == 0) {//Reach the end of the block list
-            return EXIT_SUCCESS;
-        }
-        //Set the direct block in use
-        set_resource_in_use(direct_block_num, 0);
-    }
     return EXIT_SUCCESS;
 }
 
@@ -124,11 +72,11 @@ int reset_inode_and_all_data_blocks_in_use(unsigned int inode_num){
 //It returns NULL if there is no such entry in this block.
 struct ext2_dir_entry *enhanced_entry_search(int block_num, char *file_name){
     
-    struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * block_num);
+    struct ext2_dir_entry *entry = (struct ext2_dir_entry *)get_block(block_num);
     
     int name_length = strlen(file_name);
     if(name_length > EXT2_NAME_LEN){
-        exit(EXIT_FAILURE);
+        ext2_abort(EXIT_FAILURE);
     }
     
     //The first entry in the block cannot be restored since we zeroed its inode number when removing it
@@ -142,7 +90,7 @@ struct ext2_dir_entry *enhanced_entry_search(int block_num, char *file_name){
     //Search the whole block
     while(len_count <= EXT2_BLOCK_SIZE && entry->inode != 0){
 
-        entry = (struct ext2_dir_entry *) (disk + EXT2_BLOCK_SIZE * block_num + len_count);
+        entry = (struct ext2_dir_entry *) (get_block(block_num) + len_count);
 
         if(strncmp(file_name, entry->name, name_length) == 0){//Find our hidden entry!
             return entry;
@@ -164,7 +112,7 @@ struct ext2_dir_entry *enhanced_entry_search(int block_num, char *file_name){
 //It returns NULL if the block is not used or the input is invalid
 struct ext2_dir_entry *get_prev_entry(int block_num, struct ext2_dir_entry *hidden_entry){
     
-    struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * block_num);
+    struct ext2_dir_entry *entry = (struct ext2_dir_entry *)get_block(block_num);
     
     if(entry->inode == 0 && entry->rec_len == 0){//The block is unused
         return NULL;
@@ -177,7 +125,7 @@ struct ext2_dir_entry *get_prev_entry(int block_num, struct ext2_dir_entry *hidd
     int curr_len = 0;
 
     while (curr_len < EXT2_BLOCK_SIZE) {
-        entry = (struct ext2_dir_entry *) (disk + EXT2_BLOCK_SIZE * block_num + curr_len);
+        entry = (struct ext2_dir_entry *) (get_block(block_num) + curr_len);
 
         //The distance between the given entry and the current entry
         int distance = (unsigned char *)hidden_entry - (unsigned char *)entry;
@@ -196,7 +144,7 @@ struct ext2_dir_entry *get_prev_entry(int block_num, struct ext2_dir_entry *hidd
 void uncover_entry(struct ext2_dir_entry *prev_entry, struct ext2_dir_entry *hidden_entry){
     
     if(prev_entry == NULL || hidden_entry == NULL){
-        exit(EXIT_FAILURE);
+        ext2_abort(EXIT_FAILURE);
     }
 
     int prev_entry_new_len = (unsigned char *)hidden_entry - (unsigned char *)prev_entry;
@@ -204,14 +152,84 @@ void uncover_entry(struct ext2_dir_entry *prev_entry, struct ext2_dir_entry *hid
    
     //Previous entry points to the hidden entry
     prev_entry->rec_len = prev_entry_new_len;
+    mark_dirty(prev_entry, prev_entry_new_len + sizeof(struct ext2_dir_entry));
 
 }
 
+//This function sets the removed directory and all its data blocks in use again, like
+//reset_inode_and_all_data_blocks_in_use() does for a file, and links it back into its parent:
+//'.' and the entry in the parent link to it, its '..' links to the parent and its group counts it again
+//It returns EXIT_SUCCESS if successful, or ENOENT if the inode doesn't hold that directory any more
+//or it cannot be fully restored
+int reset_directory_in_use(unsigned int dir_inode_num, unsigned int parent_inode_num){
+
+    //The inode may have been reused for a file and removed again
+    struct ext2_inode *dir = get_inode(dir_inode_num);
+    if((dir->i_mode & 0xF000) != EXT2_S_IFDIR || dir->i_block[0] == 0 || dir->i_block[0] >= sb->s_blocks_count){
+        return ENOENT;
+    }
+    struct ext2_dir_entry *dot = (struct ext2_dir_entry *) get_block(dir->i_block[0]);
+    if(dot->inode != dir_inode_num || dot->name_len != 1 || dot->name[0] != '.' || dot->rec_len >= EXT2_BLOCK_SIZE){
+        return ENOENT;
+    }
+    struct ext2_dir_entry *dot_dot = (struct ext2_dir_entry *) ((unsigned char *) dot + dot->rec_len);
+    if(dot_dot->name_len != 2 || strncmp(dot_dot->name, "..", 2) != 0){
+        return ENOENT;
+    }
+
+    if(reset_inode_and_all_data_blocks_in_use(dir_inode_num) != EXIT_SUCCESS){
+        return ENOENT;
+    }
+    dir->i_links_count = 2;//The entry in the parent and '.', each restored subdirectory adds its '..'
+    mark_inode_dirty(dir);
+    unsigned int group = group_of_inode(dir_inode_num);
+    gd[group].bg_used_dirs_count += 1;
+    mark_dirty(&gd[group], sizeof(struct ext2_group_desc));
+
+    //'..' links to the parent again
+    dot_dot->inode = parent_inode_num;
+    mark_dirty(dot_dot, sizeof(struct ext2_dir_entry));
+    struct ext2_inode *parent = get_inode(parent_inode_num);
+    parent->i_links_count += 1;
+    mark_inode_dirty(parent);
+    return EXIT_SUCCESS;
+}
+
+//This function restores the hidden entry found in the given block of the parent directory:
+//it sets the inode and all its data blocks in use again and uncovers the entry
+//A directory is linked back into the parent, but the entries removed from it are not restored
+//It returns EXIT_SUCCESS if successful, or ENOENT if the inode or its blocks are in use again
+//or the entry can no longer be put back where it is
+int restore_hidden_entry(struct ext2_inode *parent_inode, int block_num, struct ext2_dir_entry *hidden_entry){
+
+    //An indexed directory must still look the name up in this block
+    char name[EXT2_NAME_LEN + 1];
+    memcpy(name, hidden_entry->name, hidden_entry->name_len);
+    name[hidden_entry->name_len] = '\0';
+    if(!dir_block_covers_name(parent_inode, block_num, name)){
+        return ENOENT;
+    }
+
+    struct ext2_dir_entry *prev_entry = get_prev_entry(block_num, hidden_entry);
+    if(prev_entry == NULL){
+        return ENOENT;
+    }
+    int result = hidden_entry->file_type == EXT2_FT_DIR
+                 ? reset_directory_in_use(hidden_entry->inode, inode_num_of(parent_inode))
+                 : reset_inode_and_all_data_blocks_in_use(hidden_entry->inode);
+    if(result != EXIT_SUCCESS){
+        //Some of the blocks may be reused, the file can't be fully restored
+        return ENOENT;
+    }
+    uncover_entry(prev_entry, hidden_entry);
+    return EXIT_SUCCESS;
+}
+
 //This function restores the file in parent inode
 //It returns EXIT_SUCCESS(0) if the execution is sucessful
 //It returns EEXIST if the file exists in the parent directory
 //It returns ENOENT if the file cannot be restored
-//It returns EISDIR if the file is a directory
+//A directory is restored without the entries removed from it, see restore_path()
 int restore_file(struct ext2_inode *parent_inode, char*file_name){
     
     //Check whether the file exists in the parent directory
@@ -219,119 +237,335 @@ int restore_file(struct ext2_inode *parent_inode, char*file_name){
         return EEXIST;
     }
 
-    //Search within 12 direct blocks
-    int i ;
-    for(i = 0; i < EXT2_DIRECT_BLOCK_NUM; i++){
-        int block_num = parent_inode->i_block[i];
-        if(block_num != 0){
-            //Search within the block
-            struct ext2_dir_entry *hidden_entry = enhanced_entry_search(block_num, file_name); 
-            if(hidden_entry != NULL){//The hidden entry is in this block!
-                
-                //Check whether the hidden file is a directory
-                if(hidden_entry->file_type == EXT2_FT_DIR){
-                    
-                    return EISDIR;
-                }
+    //Search within every data block of the parent directory
+    struct block_iter iter;
+    block_iter_init(&iter, parent_inode);
+    unsigned int block_num;
+    int is_pointer;
+    while((block_num = block_iter_next(&iter, NULL, &is_pointer)) != 0){
+        if(is_pointer){
+            continue;
+        }
+        //Search within the block
+        struct ext2_dir_entry *hidden_entry = enhanced_entry_search(block_num, file_name); 
+        if(hidden_entry != NULL){//The hidden entry is in this block!
 
-                if(reset_inode_and_all_data_blocks_in_use(hidden_entry->inode) != ENOENT){//Reset its inode and all data blocks sucessfully. 
-                    //Uncover the hidden entry
-                    
-                    struct ext2_dir_entry *prev_entry = get_prev_entry(block_num, hidden_entry);
-                    if(prev_entry != NULL){
-                        
-                        
-                        int prev_entry_new_len = (unsigned char *)hidden_entry - (unsigned char *)prev_entry;
-
-                        hidden_entry->rec_len = prev_entry->rec_len - prev_entry_new_len;
-                        //Previous entry points to the hidden entry
-                        prev_entry->rec_len = prev_entry_new_len;
-                        
-                        return EXIT_SUCCESS;
-                    }
-                }else{
-                    //Reset fails. The file cannot be restored
-              
-                    return ENOENT;
+            //Reset its inode and all data blocks, then uncover the hidden entry
+            return restore_hidden_entry(parent_inode, block_num, hidden_entry);
+        }
+    }
+
+    //Reach here only when the file is not found in all data blocks
+    return ENOENT;
+
+}
+
+//This function restores the removed file at path_to_file
+//A removed directory is restored with everything that was removed under it, see restore_scan()
+//It returns EXIT_SUCCESS if successful, ENOENT if the file cannot be restored, or EEXIST if the file exists
+int restore_path(char *path_to_file){
+
+    //Get parent inode and file_name
+    unsigned int parent_inode_num;
+    char file_name[EXT2_NAME_LEN + 1];
+    int result = resolve_path(path_to_file, &parent_inode_num, file_name);
+    if(result != EXIT_SUCCESS){
+        return result == ENAMETOOLONG ? ENOENT : result;
+    }
+    struct ext2_inode *parent_inode = get_inode(parent_inode_num);
+    
+    //Restore file
+    result = restore_file(parent_inode, file_name);
+    if(result != EXIT_SUCCESS){
+        return result;
+    }
+
+    //Then what was removed under a directory, in one pass over the subtree
+    unsigned int inode_num;
+    unsigned char file_type;
+    if(lookup_entry(parent_inode_num, file_name, &inode_num, &file_type) && file_type == EXT2_FT_DIR){
+        //ENOENT only means nothing was removed under the directory
+        result = restore_scan(path_to_file);
+        if(result != EXIT_SUCCESS && result != ENOENT){
+            return result;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+//A hidden entry found by restore_scan() whose inode and data blocks are still free
+struct restore_candidate {
+    unsigned int dir_inode_num;
+    unsigned int block_num;
+    unsigned int entry_offset;   //Where the entry starts in the block, which is not held during the scan
+    unsigned int dtime;          //When the file was removed
+    unsigned int order;          //Position in the scan, to keep the ranking stable
+    unsigned int dir_path;       //Index of the path of the directory in the scan's directory list
+};
+
+//The state of one restore_scan()
+struct restore_scan_state {
+    struct restore_candidate *candidates;
+    unsigned int candidates_count;
+    char **dir_paths;            //Path of every directory walked
+    unsigned int dir_paths_count;
+};
+
+//This function appends the path of a directory to the scan and returns its index
+unsigned int add_dir_path(struct restore_scan_state *state, char *path){
+    state->dir_paths = realloc(state->dir_paths, (state->dir_paths_count + 1) * sizeof(char *));
+    if(state->dir_paths == NULL || (state->dir_paths[state->dir_paths_count] = strdup(path)) == NULL){
+        perror("Error: add_dir_path() alloc fail");
+        ext2_abort(EXIT_FAILURE);
+    }
+    return state->dir_paths_count++;
+}
+
+//This function records the hidden entries in the gaps of the block of the directory
+//that are regular files, symlinks or directories whose inode and data blocks are all free
+void collect_hidden_entries(struct restore_scan_state *state, unsigned int dir_inode_num, unsigned int block_num, unsigned int dir_path){
+
+    unsigned char *block = get_block(block_num);
+    int curr_len = 0;
+    while(curr_len < EXT2_BLOCK_SIZE){
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *) (block + curr_len);
+        if(entry->rec_len < 8 || curr_len + entry->rec_len > EXT2_BLOCK_SIZE){
+            //Corrupted block
+            return;
+        }
+
+        //Only the gap after a live entry is searched, like enhanced_entry_search() does
+        int gap_end = curr_len + entry->rec_len;
+        int pos = entry->inode != 0 ? curr_len + actual_entry_len(entry) : gap_end;
+        while(pos + 8 <= gap_end){
+            struct ext2_dir_entry *hidden_entry = (struct ext2_dir_entry *) (block + pos);
+            if(hidden_entry->name_len == 0 || pos + actual_entry_len(hidden_entry) > gap_end
+               || hidden_entry->inode <= EXT2_GOOD_OLD_FIRST_INO || hidden_entry->inode > sb->s_inodes_count){
+                //Not an entry, the rest of the gap is garbage
+                break;
+            }
+            int is_dot = hidden_entry->name_len <= 2 && hidden_entry->name[0] == '.'
+                         && (hidden_entry->name_len == 1 || hidden_entry->name[1] == '.');
+            if((hidden_entry->file_type == EXT2_FT_REG_FILE || hidden_entry->file_type == EXT2_FT_SYMLINK
+                || (hidden_entry->file_type == EXT2_FT_DIR && !is_dot))
+               && inode_and_all_data_blocks_free(hidden_entry->inode)){
+                state->candidates = realloc(state->candidates, (state->candidates_count + 1) * sizeof(struct restore_candidate));
+                if(state->candidates == NULL){
+                    perror("Error: collect_hidden_entries() realloc fail");
+                    ext2_abort(EXIT_FAILURE);
                 }
+                struct restore_candidate *candidate = &state->candidates[state->candidates_count];
+                candidate->dir_inode_num = dir_inode_num;
+                candidate->block_num = block_num;
+                candidate->entry_offset = pos;
+                candidate->dtime = get_inode(hidden_entry->inode)->i_dtime;
+                put_inode(hidden_entry->inode);
+                candidate->order = state->candidates_count;
+                candidate->dir_path = dir_path;
+                state->candidates_count++;
             }
-            
+            pos += actual_entry_len(hidden_entry);
         }
+        curr_len += entry->rec_len;
     }
+}
 
-    //For the 13-th block (indirect block)
-    int indirect_block_num = parent_inode->i_block[EXT2_DIRECT_BLOCK_NUM];
+//This function orders the candidates from the most recently removed to the oldest
+int compare_candidates(const void *a, const void *b){
+    const struct restore_candidate *first = a;
+    const struct restore_candidate *second = b;
+    if(first->dtime != second->dtime){
+        return first->dtime > second->dtime ? -1 : 1;
+    }
+    return first->order < second->order ? -1 : 1;
+}
 
-    //Reaching here only when the file is not hidden in the first 12 blocks
-    if(indirect_block_num == 0){//The indirect block is not in use,i.e. we cannot find the hidden file
-        return ENOENT;
+//This function walks the directory tree from the directory at dir_path, in one pass over the blocks
+//of every directory, and records every hidden entry that can still be restored
+void scan_tree(struct restore_scan_state *state, unsigned int dir_inode_num, char *dir_path){
+
+    //Directories left to walk, as indexes into dir_paths and their inode numbers
+    unsigned int capacity = 64;
+    unsigned int depth = 0;
+    unsigned int *stack_inodes = malloc(capacity * sizeof(unsigned int));
+    unsigned int *stack_paths = malloc(capacity * sizeof(unsigned int));
+    unsigned char *visited = calloc(sb->s_inodes_count / 8 + 1, 1);
+    if(stack_inodes == NULL || stack_paths == NULL || visited == NULL){
+        perror("Error: scan_tree() alloc fail");
+        ext2_abort(EXIT_FAILURE);
     }
+    stack_inodes[depth] = dir_inode_num;
+    stack_paths[depth++] = add_dir_path(state, dir_path);
+    visited[dir_inode_num / 8] |= 1 << (dir_inode_num % 8);
+
+    while(depth > 0){
+        depth--;
+        unsigned int inode_num = stack_inodes[depth];
+        unsigned int path_idx = stack_paths[depth];
+        struct ext2_inode *dir = get_inode(inode_num);
+        int indexed = (dir->i_flags & EXT2_INDEX_FL) != 0;
+
+        struct block_iter iter;
+        block_iter_init(&iter, dir);
+        unsigned int block_num;
+        unsigned int logical;
+        int is_pointer;
+        while((block_num = block_iter_next(&iter, &logical, &is_pointer)) != 0){
+            if(is_pointer){
+                continue;
+            }
+            unsigned int scope = begin_block_scope();
+            //The gap after ".." in block 0 of an indexed directory holds the index, not removed entries
+            if(!indexed || logical != 0){
+                collect_hidden_entries(state, inode_num, block_num, path_idx);
+            }
 
-    unsigned int* indirect_block = (unsigned int*)(disk + EXT2_BLOCK_SIZE * indirect_block_num);
-    int max_indirect_blocks = EXT2_BLOCK_SIZE / sizeof(unsigned int);
-    
-    //Loop over the indirect block
-    int j;
-    for(j = 0; j < max_indirect_blocks; j++){
-        int direct_block_num = indirect_block[j];
-        if (direct_block_num != 0) {
-            //Search within the block
-            struct ext2_dir_entry *hidden_entry = enhanced_entry_search(direct_block_num, file_name);
-            if(hidden_entry != NULL){//The hidden entry is in this block!
-                //Check whether the hidden file is a directory
-                if(hidden_entry->file_type == EXT2_FT_DIR){
-                    return EISDIR;
+            //Push the subdirectories
+            int curr_len = 0;
+            while(curr_len < EXT2_BLOCK_SIZE){
+                struct ext2_dir_entry *entry = (struct ext2_dir_entry *) (get_block(block_num) + curr_len);
+                if(entry->rec_len < 8){
+                    break;
                 }
-
-                if(reset_inode_and_all_data_blocks_in_use(hidden_entry->inode) != ENOENT){//Reset its inode and all data blocks sucessfully. 
-                    //Uncover the hidden entry
-                    struct ext2_dir_entry *prev_entry = get_prev_entry(direct_block_num, hidden_entry);
-                    uncover_entry(prev_entry, hidden_entry);
-                    return EXIT_SUCCESS;
-                }else{
-                    //Reset fails. The file cannot be restored
-                    return ENOENT;
+                int is_dot = entry->name_len <= 2 && entry->name[0] == '.' && (entry->name_len == 1 || entry->name[1] == '.');
+                if(entry->inode != 0 && entry->inode <= sb->s_inodes_count && entry->file_type == EXT2_FT_DIR && !is_dot
+                   && !(visited[entry->inode / 8] & (1 << (entry->inode % 8)))){
+                    visited[entry->inode / 8] |= 1 << (entry->inode % 8);
+                    char child_path[strlen(state->dir_paths[path_idx]) + entry->name_len + 2];
+                    sprintf(child_path, "%s%s%.*s", state->dir_paths[path_idx],
+                            strcmp(state->dir_paths[path_idx], "/") == 0 ? "" : "/", entry->name_len, entry->name);
+                    if(depth == capacity){
+                        capacity *= 2;
+                        stack_inodes = realloc(stack_inodes, capacity * sizeof(unsigned int));
+                        stack_paths = realloc(stack_paths, capacity * sizeof(unsigned int));
+                        if(stack_inodes == NULL || stack_paths == NULL){
+                            perror("Error: scan_tree() realloc fail");
+                            ext2_abort(EXIT_FAILURE);
+                        }
+                    }
+                    stack_inodes[depth] = entry->inode;
+                    stack_paths[depth++] = add_dir_path(state, child_path);
                 }
+                curr_len += entry->rec_len;
             }
+            end_block_scope(scope);
         }
+        put_inode(inode_num);
     }
 
-    //Reach here only when the file is not found in all data blocks
-    return ENOENT;
+    free(stack_inodes);
+    free(stack_paths);
+    free(visited);
+}
+
+/*
+ * This function restores every removed file under the directory at dir_path ("/" for the whole image)
+ * It makes a single pass over the blocks of every directory and collects the hidden entries
+ * whose inode and data blocks are all still free. They are restored from the most recently removed
+ * to the oldest, so if a name was removed more than once, its latest version comes back.
+ * When a directory comes back, its subtree is scanned the same way and what was removed under it
+ * is restored after the entries already found.
+ * Every file is reported on stdout as restored or skipped, with the reason.
+ * It returns EXIT_SUCCESS if at least one file is restored, ENOENT if none is
+ * or the directory doesn't exist, or ENOTDIR if dir_path is not a directory.
+ */
+int restore_scan(char *dir_path){
+
+    //Find the directory to scan
+    unsigned int dir_inode_num = EXT2_ROOT_INO;
+    char path_copy[strlen(dir_path) + 1];
+    strcpy(path_copy, dir_path);
+    if(strcmp(dir_path, "/") != 0){
+        unsigned int parent_inode_num;
+        char dir_name[EXT2_NAME_LEN + 1];
+        int result = resolve_path(path_copy, &parent_inode_num, dir_name);
+        if(result != EXIT_SUCCESS){
+            return ENOENT;
+        }
+        unsigned char file_type;
+        if(!lookup_entry(parent_inode_num, dir_name, &dir_inode_num, &file_type)){
+            return ENOENT;
+        }
+        if(file_type != EXT2_FT_DIR){
+            return ENOTDIR;
+        }
+        //Print the paths the same way whatever slashes were given
+        strcpy(path_copy, dir_path);
+        while(strlen(path_copy) > 1 && path_copy[strlen(path_copy) - 1] == '/'){
+            path_copy[strlen(path_copy) - 1] = '\0';
+        }
+    }
 
+    struct restore_scan_state state;
+    memset(&state, 0, sizeof(struct restore_scan_state));
+    scan_tree(&state, dir_inode_num, path_copy);
+    qsort(state.candidates, state.candidates_count, sizeof(struct restore_candidate), compare_candidates);
+
+    unsigned int restored_count = 0;
+    unsigned int i;
+    //Restoring a directory appends the candidates found under it
+    for(i = 0; i < state.candidates_count; i++){
+        struct restore_candidate *candidate = &state.candidates[i];
+        unsigned int scope = begin_block_scope();
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *) (get_block(candidate->block_num) + candidate->entry_offset);
+        struct ext2_inode *parent_inode = get_inode(candidate->dir_inode_num);
+        char *parent_path = state.dir_paths[candidate->dir_path];
+        char name[EXT2_NAME_LEN + 1];
+        memcpy(name, entry->name, entry->name_len);
+        name[entry->name_len] = '\0';
+
+        //A newer file with the same name may have been restored (or created) already
+        int result = EEXIST;
+        if(find_entry(parent_inode, name) == NULL){
+            result = restore_hidden_entry(parent_inode, candidate->block_num, entry);
+        }
+        const char *separator = strcmp(parent_path, "/") == 0 ? "" : "/";
+        if(result != EXIT_SUCCESS){
+            printf("Skipped: %s%s%s (inode [%d]): %s\n", parent_path, separator, name, entry->inode, strerror(result));
+            end_block_scope(scope);
+            continue;
+        }
+        printf("Restored: %s%s%s (inode [%d])\n", parent_path, separator, name, entry->inode);
+        restored_count++;
+
+        if(entry->file_type == EXT2_FT_DIR){
+            char child_path[strlen(parent_path) + entry->name_len + 2];
+            sprintf(child_path, "%s%s%s", parent_path, separator, name);
+            unsigned int first_new = state.candidates_count;
+            scan_tree(&state, entry->inode, child_path);
+            qsort(state.candidates + first_new, state.candidates_count - first_new,
+                  sizeof(struct restore_candidate), compare_candidates);
+        }
+        end_block_scope(scope);
+    }
+
+    for(i = 0; i < state.dir_paths_count; i++){
+        free(state.dir_paths[i]);
+    }
+    free(state.dir_paths);
+    free(state.candidates);
+    return restored_count > 0 ? EXIT_SUCCESS : ENOENT;
 }
 
+#ifndef EXT2_BATCH
 int main(int argc, char *argv[]) {
     
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <image file name> <path to file>\n", argv[0]);
+    if (argc != 3 && !(argc == 4 && strcmp(argv[2], "--scan") == 0)) {
+        fprintf(stderr, "Usage: %s <image file name> <path to file> or\n"
+                        "       %s <image file name> --scan [<path to directory>]\n", argv[0], argv[0]);
         exit(EXIT_FAILURE);
     }
 
     char *image_file_name = argv[1];
-    char *path_to_file = argv[2];
-    load_image(image_file_name);
-
-    //Get file_name
-    //Create a copy of path_to_file so that path_to_file won't be changed
-    char path_to_file_copy[strlen(path_to_file) + 1];
-    strcpy(path_to_file_copy, path_to_file);
-    char *file_name = get_file_name(path_to_file_copy);
-    char const_file_name[EXT2_NAME_LEN + 1];//Make the name constont
-    int i;
-    for(i = 0; i < strlen(file_name); i++){
-        const_file_name[i] = file_name[i];
+    load_image(image_file_name, EXT2_MAP_RANDOM | EXT2_MAP_JOURNAL);
+
+    //Restore every removed file of the image, or under the given directory
+    if (strcmp(argv[2], "--scan") == 0) {
+        return restore_scan(argc == 4 ? argv[3] : "/");
     }
-    const_file_name[strlen(file_name)] = '\0';
-
-    //Get parent inode
-    //Create a copy of path_to_file so that path_to_file won't be changed
-    char path_to_file_copy2[strlen(path_to_file) + 1];
-    strcpy(path_to_file_copy2, path_to_file);
-    int parent_inode_num = second_last_dir_inode(path_to_file_copy2);
-    struct ext2_inode *parent_inode = &get_inode_table()[parent_inode_num - 1];
-    
-    //Restore file
-    return restore_file(parent_inode, const_file_name);
+
+    char *path_to_file = argv[2];
+    return restore_path(path_to_file);
 
 }
+#endif
@@ -6,342 +6,3895 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <time.h>
+#include <stdint.h>
+#include <endian.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "ext2.h"
 #include "ext2_utils.h"
+#include "ext2_image_fields.h"
 
-unsigned char *disk;
-struct ext2_super_block *sb;
-struct ext2_group_desc *gd;
+//The image the helpers of this thread work on
+__thread struct ext2_image *current_image;
+
+//Next-fit allocation cursors: the group where the last allocation happened
+//and, for every group, the bitmap index where the next search starts.
+//Freeing a resource pulls the cursors back so that the image stays packed from the start.
+#define inode_group_cursor (current_image->im_inode_group_cursor)
+#define block_group_cursor (current_image->im_block_group_cursor)
+#define inode_cursor (current_image->im_inode_cursor)
+#define block_cursor (current_image->im_block_cursor)
+
+static int init_dentry_cache(struct ext2_image *image);
+static void clear_dentry_cache(struct ext2_image *image);
+static int init_dir_space_hints(struct ext2_image *image);
+static void clear_dir_space_hints(struct ext2_image *image);
+
+/*
+ * I/O backends. An image is read and changed through one of them, chosen when it is opened:
+ * the mmap backend maps the whole image file and hands out pointers into the mapping (the default),
+ * the pread backend (EXT2_MAP_PREAD) reads the blocks it is asked for into a bounded cache of buffers
+ * with pread() and writes the changed ones back with pwrite(), so the memory of the tool stays
+ * about the same whatever the size of the image.
+ * With both, the pointer get_block() returns stays valid until put_block(), release_block(), the end of
+ * its block scope (end_block_scope()) or the end of the operation (ext2_end_operation());
+ * the mapping keeps it for as long as the image is open.
+ * The super block and the group descriptor table are contiguous in memory and never move,
+ * so sb and gd can be used as plain pointers.
+ */
+struct ext2_io_backend {
+  //Sets up the access to the image file image->im_fd, which the backend closes if it doesn't need it.
+  //Returns EXIT_SUCCESS or an errno value, leaving the image as it was
+  int (*open)(struct ext2_image *image, int map_flags);
+  //Undoes open(), changes that were not written back are dropped
+  void (*close)(struct ext2_image *image);
+  //Sets data to the block, or returns the errno of the failing read
+  int (*get_block)(struct ext2_image *image, unsigned int block_num, unsigned char **data);
+  //Returns the number of the block holding the address, or 0 if it is not in a block of the image
+  unsigned int (*block_num_of)(struct ext2_image *image, const unsigned char *address);
+  void (*mark_dirty)(struct ext2_image *image, const unsigned char *address, size_t len);
+  //Replaces the block as the image sees it without writing the file (a read-only image with a journal)
+  int (*load_block)(struct ext2_image *image, unsigned int block_num, const unsigned char *data, size_t len);
+  //Gives the POSIX_FADV_* access pattern of a byte range of the image
+  void (*advise)(struct ext2_image *image, size_t offset, size_t length, int advice);
+  //Journaled images: lists the blocks that differ from the file, and forgets the changes once they are committed
+  int (*changed_blocks)(struct ext2_image *image, unsigned int **changed, unsigned int *count);
+  int (*committed)(struct ext2_image *image);
+  //Other images: writes the changes to the file, synced to the device if durable is TRUE
+  int (*write_back)(struct ext2_image *image, int durable);
+  //The caller is done with one use of the block get_block() returned, with all of them,
+  //or with any block once the operation has ended
+  void (*put_block)(struct ext2_image *image, unsigned int block_num);
+  void (*release_block)(struct ext2_image *image, unsigned int block_num);
+  void (*end_operation)(struct ext2_image *image);
+};
+
+//Start value of the journal checksum (FNV-1a offset basis)
+#define JOURNAL_CHECKSUM_SEED 14695981039346656037ull
+
+/**
+ *This function adds len bytes to the FNV-1a checksum of a journal
+ */
+static uint64_t journal_checksum(uint64_t hash, const unsigned char *data, size_t len) {
+  size_t i;
+  for(i = 0; i < len; i++) {
+    hash = (hash ^ data[i]) * 1099511628211ull;
+  }
+  return hash;
+}
 
 /**
- *This function reads the image from the input file path.
- *It initializes the disk, super block, group descihper if read is sucessful.
+ *This function returns the number of bytes of the block inside an image of image_size bytes
+ *(the last block of an image whose size is not a multiple of the block size is short)
  */
-void load_image(const char *image_path) {
-  int fd = open(image_path, O_RDWR);
+static size_t image_block_len(unsigned int block_num, size_t image_size) {
+  size_t offset = (size_t) block_num * EXT2_BLOCK_SIZE;
+  if(offset >= image_size) {
+    return 0;
+  }
+  return image_size - offset < EXT2_BLOCK_SIZE ? image_size - offset : EXT2_BLOCK_SIZE;
+}
 
-  disk = mmap(NULL, 128 * EXT2_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  sb = (struct ext2_super_block *)(disk + EXT2_BLOCK_SIZE);
-  gd = (struct ext2_group_desc *)(disk + EXT2_BLOCK_SIZE * 2);
+/**
+ *This function compares block numbers for qsort()
+ */
+static int compare_block_nums(const void *a, const void *b) {
+  unsigned int first = *(const unsigned int *) a;
+  unsigned int second = *(const unsigned int *) b;
+  return first < second ? -1 : first > second;
+}
 
-  if(disk == MAP_FAILED) {
-    perror("Error: load_image() mmap fail");
-    exit(EXIT_FAILURE);
+/**
+ *This function appends the block number to the array of count numbers, growing it when it is full.
+ *It returns EXIT_SUCCESS, or ENOMEM.
+ */
+static int append_block_num(unsigned int **block_nums, unsigned int *count, unsigned int *capacity, unsigned int block_num) {
+  if(*count == *capacity) {
+    unsigned int new_capacity = *capacity == 0 ? 64 : *capacity * 2;
+    unsigned int *grown = realloc(*block_nums, new_capacity * sizeof(unsigned int));
+    if(grown == NULL) {
+      return ENOMEM;
+    }
+    *block_nums = grown;
+    *capacity = new_capacity;
   }
+  (*block_nums)[(*count)++] = block_num;
+  return EXIT_SUCCESS;
 }
 
 /**
- *This function returns the pointer to the inode bitmap 
+ *This function replays the journal of the image at journal_path if it was committed.
+ *The blocks are written into the image file through fd, which is synced before the journal is removed.
+ *A journal that is incomplete (the tool died before its commit point) is removed: nothing of it reached the image.
+ *If image is not NULL the image is read-only: the journal is left in place and its blocks are loaded
+ *into the image in memory, so the image is seen as it will be once the journal is replayed.
+ *It returns EXIT_SUCCESS if there is no journal or it is replayed, or the errno of the failing call.
  */
-unsigned char *get_inode_bitmap() {
-    return (unsigned char*)(disk + EXT2_BLOCK_SIZE * gd->bg_inode_bitmap);
+static int replay_journal(const char *journal_path, int fd, struct ext2_image *image, size_t image_size) {
+  int journal_fd = open(journal_path, O_RDONLY);
+  if(journal_fd == -1) {
+    return errno == ENOENT ? EXIT_SUCCESS : errno;
+  }
+  struct stat journal_stat;
+  if(fstat(journal_fd, &journal_stat) == -1) {
+    int result = errno;
+    close(journal_fd);
+    return result;
+  }
+  unsigned char *journal = malloc(journal_stat.st_size > 0 ? (size_t) journal_stat.st_size : 1);
+  if(journal == NULL) {
+    close(journal_fd);
+    return ENOMEM;
+  }
+  ssize_t read_size = pread(journal_fd, journal, (size_t) journal_stat.st_size, 0);
+  close(journal_fd);
+
+  //Check that the journal is complete: its size, its block numbers and its checksum
+  struct ext2_journal_header *header = (struct ext2_journal_header *) journal;
+  unsigned int *block_nums = (unsigned int *)(journal + sizeof(struct ext2_journal_header));
+  int committed = read_size == journal_stat.st_size && (size_t) read_size >= sizeof(struct ext2_journal_header)
+                  && memcmp(header->magic, EXT2_JOURNAL_MAGIC, sizeof(header->magic)) == 0
+                  && (size_t) read_size == sizeof(struct ext2_journal_header)
+                     + (size_t) header->block_count * (sizeof(unsigned int) + EXT2_BLOCK_SIZE);
+  unsigned char *blocks = (unsigned char *)(block_nums + (committed ? header->block_count : 0));
+  uint32_t i;
+  for(i = 0; committed && i < header->block_count; i++) {
+    committed = (size_t) block_nums[i] * EXT2_BLOCK_SIZE < image_size;
+  }
+  if(committed) {
+    uint64_t checksum = journal_checksum(JOURNAL_CHECKSUM_SEED, (unsigned char *) block_nums,
+                                         (size_t) header->block_count * sizeof(unsigned int));
+    checksum = journal_checksum(checksum, blocks, (size_t) header->block_count * EXT2_BLOCK_SIZE);
+    committed = checksum == header->checksum;
+  }
+
+  int result = EXIT_SUCCESS;
+  if(committed && image != NULL) {
+    for(i = 0; i < header->block_count && result == EXIT_SUCCESS; i++) {
+      result = image->im_io->load_block(image, block_nums[i], blocks + (size_t) i * EXT2_BLOCK_SIZE,
+                                        image_block_len(block_nums[i], image_size));
+    }
+  }else if(committed) {
+    for(i = 0; i < header->block_count && result == EXIT_SUCCESS; i++) {
+      size_t len = image_block_len(block_nums[i], image_size);
+      if(pwrite(fd, blocks + (size_t) i * EXT2_BLOCK_SIZE, len, (off_t) block_nums[i] * EXT2_BLOCK_SIZE) != (ssize_t) len) {
+        result = errno != 0 ? errno : EIO;
+      }
+    }
+    if(result == EXIT_SUCCESS && fsync(fd) == -1) {
+      result = errno;
+    }
+  }
+  free(journal);
+
+  //The journal is done with once the image holds its blocks, or if it was never committed
+  if(image == NULL && result == EXIT_SUCCESS && unlink(journal_path) == -1) {
+    result = errno;
+  }
+  return result;
 }
 
 /**
- *This function returns the pointer to the block bitmap 
+ *This function checks that the journal can be created next to the image, by creating and removing it,
+ *so that a commit cannot fail at exit only because the directory of the image is not writable.
+ *It returns TRUE if it can, FALSE otherwise.
  */
-unsigned char *get_block_bitmap() {
-    
-    return (unsigned char*)(disk + EXT2_BLOCK_SIZE * gd->bg_block_bitmap);
+static int journal_can_be_created(const char *journal_path) {
+  int journal_fd = open(journal_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if(journal_fd == -1) {
+    return FALSE;
+  }
+  close(journal_fd);
+  unlink(journal_path);
+  return TRUE;
 }
 
 /**
- *This function returns the pointer to the inode table
+ *This function maps the image file.
+ *A read-only image is mapped privately: nothing is written and no page is ever dirtied.
+ *A journaled image is mapped privately too, its changes are found through the page table at commit time;
+ *without /proc/self/pagemap it is not journaled and its changes go straight to the file.
+ *The file is also mapped shared for a journaled image: the blocks that are free on disk (new data)
+ *are reached through it, so they go straight to the file like ordered mode allows, instead of being copied
+ *into anonymous memory and written again at commit time.
  */
-struct ext2_inode *get_inode_table() {
-    
-    return (struct ext2_inode *)(disk + EXT2_BLOCK_SIZE * gd->bg_inode_table);
+static int mmap_open(struct ext2_image *image, int map_flags) {
+  if(image->im_journal_path != NULL && access("/proc/self/pagemap", R_OK) != 0) {
+    free(image->im_journal_path);
+    image->im_journal_path = NULL;
+  }
+  int journaled = image->im_journal_path != NULL;
+
+  int mmap_flags = (map_flags & EXT2_MAP_READ_ONLY) || journaled ? MAP_PRIVATE : MAP_SHARED;
+  int mmap_prot = (map_flags & EXT2_MAP_READ_ONLY) ? PROT_READ : PROT_READ | PROT_WRITE;
+  if(map_flags & EXT2_MAP_POPULATE) {
+    //Pre-fault the whole image so that a full scan doesn't take one page fault per page
+    mmap_flags |= MAP_POPULATE;
+  }
+  unsigned char *map = mmap(NULL, image->im_disk_size, mmap_prot, mmap_flags, image->im_fd, 0);
+  if(map == MAP_FAILED) {
+    return errno;
+  }
+  if(journaled) {
+    image->im_shared = mmap(NULL, image->im_disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, image->im_fd, 0);
+    if(image->im_shared == MAP_FAILED) {
+      int result = errno;
+      image->im_shared = NULL;
+      munmap(map, image->im_disk_size);
+      return result;
+    }
+  }
+
+  if(image->im_sync_flags != 0 && !journaled) {
+    //Track the changed blocks so that a sync only flushes them
+    image->im_dirty = calloc((image->im_disk_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE / 8 + 1, 1);
+    if(image->im_dirty == NULL) {
+      munmap(map, image->im_disk_size);
+      return ENOMEM;
+    }
+  }
+  image->im_disk = map;
+
+#ifdef MADV_HUGEPAGE
+  //Back large images with transparent huge pages to cut TLB misses on full-image scans
+  if(image->im_disk_size >= EXT2_HUGEPAGE_THRESHOLD) {
+    madvise(map, image->im_disk_size, MADV_HUGEPAGE);
+  }
+#endif
+
+  //The mapping stays valid after the file descriptor is closed, a journaled image keeps it for commits
+  if(!journaled) {
+    close(image->im_fd);
+    image->im_fd = -1;
+  }
+  return EXIT_SUCCESS;
 }
 
 /**
- *This function returns a character ('l', 'f', 'd' or 'o') represent the type of the given inode.
+ *This function unmaps the image
  */
-char get_inode_type(struct ext2_inode *inode){
-    
-    unsigned short imode = inode->i_mode;
+static void mmap_close(struct ext2_image *image) {
+  munmap(image->im_disk, image->im_disk_size);
+  if(image->im_shared != NULL) {
+    munmap(image->im_shared, image->im_disk_size);
+  }
+  free(image->im_dirty);
+}
 
-    if((imode & EXT2_S_IFLNK) == EXT2_S_IFLNK){
-        return 'l'; //symbolic link
-    }else if((imode & EXT2_S_IFREG) == EXT2_S_IFREG){
-        return 'f'; //regular file
-    }else if((imode & EXT2_S_IFDIR) == EXT2_S_IFDIR){
-        return 'd'; //directory
-    }else{
-        return 'o'; //other types
+/**
+ *This function returns TRUE if the block of a journaled image is free in the block bitmap of the file,
+ *which the shared mapping shows as it is on disk: the block is reached through the shared mapping
+ */
+static int mmap_new_block(struct ext2_image *image, unsigned int block_num) {
+  if(image->im_shared == NULL || image->im_gd == NULL) {
+    //Not journaled, or the super block and group descriptors are being read
+    return FALSE;
+  }
+  struct ext2_super_block *super = image->im_sb;
+  if(block_num < super->s_first_data_block || block_num >= super->s_blocks_count) {
+    return FALSE;
+  }
+  unsigned int group = (block_num - super->s_first_data_block) / super->s_blocks_per_group;
+  unsigned int index = (block_num - super->s_first_data_block) % super->s_blocks_per_group;
+  size_t bitmap_offset = (size_t) image->im_gd[group].bg_block_bitmap * EXT2_BLOCK_SIZE;
+  if(bitmap_offset + EXT2_BLOCK_SIZE > image->im_disk_size) {
+    return FALSE;
+  }
+  return !(image->im_shared[bitmap_offset + index / 8] & (1 << (index % 8)));
+}
+
+/**
+ *This function returns the pointer to the block in the mapping, which cannot fail:
+ *a read error of the file only shows up as a fault when the block is used
+ */
+static int mmap_get_block(struct ext2_image *image, unsigned int block_num, unsigned char **data) {
+  unsigned char *map = mmap_new_block(image, block_num) ? image->im_shared : image->im_disk;
+  *data = map + (size_t) block_num * EXT2_BLOCK_SIZE;
+  return EXIT_SUCCESS;
+}
+
+/**
+ *This function returns the number of the block holding the address of the mappings, 0 if it is outside
+ */
+static unsigned int mmap_block_num_of(struct ext2_image *image, const unsigned char *address) {
+  if(image->im_shared != NULL && address >= image->im_shared && address < image->im_shared + image->im_disk_size) {
+    return (size_t)(address - image->im_shared) / EXT2_BLOCK_SIZE;
+  }
+  if(address < image->im_disk || address >= image->im_disk + image->im_disk_size) {
+    return 0;
+  }
+  return (size_t)(address - image->im_disk) / EXT2_BLOCK_SIZE;
+}
+
+/**
+ *This function sets the bits of the blocks holding the len bytes at address in the dirty block tracker
+ */
+static void mmap_mark_dirty(struct ext2_image *image, const unsigned char *address, size_t len) {
+  unsigned char *dirty = image->im_dirty;
+  if(dirty == NULL || len == 0 || address < image->im_disk || address >= image->im_disk + image->im_disk_size) {
+    return;
+  }
+  size_t block = (size_t)(address - image->im_disk) / EXT2_BLOCK_SIZE;
+  size_t last = (size_t)(address - image->im_disk + len - 1) / EXT2_BLOCK_SIZE;
+  for(; block <= last; block++) {
+    dirty[block / 8] |= 1 << (block % 8);
+  }
+}
+
+/**
+ *This function copies the block into the read-only private mapping, which is opened up for the copy
+ */
+static int mmap_load_block(struct ext2_image *image, unsigned int block_num, const unsigned char *data, size_t len) {
+  size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+  size_t offset = (size_t) block_num * EXT2_BLOCK_SIZE;
+  unsigned char *page = image->im_disk + offset / page_size * page_size;
+  if(mprotect(page, offset % page_size + EXT2_BLOCK_SIZE, PROT_READ | PROT_WRITE) == -1) {
+    return errno;
+  }
+  memcpy(image->im_disk + offset, data, len);
+  mprotect(page, offset % page_size + EXT2_BLOCK_SIZE, PROT_READ);
+  return EXIT_SUCCESS;
+}
+
+/**
+ *This function gives the kernel an access pattern hint for part of the mapped image.
+ *madvise() needs a page aligned address, so the range is widened to page boundaries.
+ *Hints are best effort: a failure only means the kernel ignores the advice.
+ */
+static void mmap_advise(struct ext2_image *image, size_t offset, size_t length, int advice) {
+  size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+  size_t page_offset = offset % page_size;
+  int madvice = advice == POSIX_FADV_SEQUENTIAL ? MADV_SEQUENTIAL : advice == POSIX_FADV_RANDOM ? MADV_RANDOM : MADV_WILLNEED;
+
+  madvise(image->im_disk + offset - page_offset, length + page_offset, madvice);
+  if(image->im_shared != NULL) {
+    madvise(image->im_shared + offset - page_offset, length + page_offset, madvice);
+  }
+}
+
+/**
+ *This function appends the numbers of the blocks of a journaled image that differ from the image file.
+ *Only the pages the process wrote to are compared: /proc/self/pagemap tells them apart, since writing
+ *to a private file mapping replaces the page with an anonymous copy. The new data blocks are skipped,
+ *they were written through the shared mapping and the private copy of their page is stale.
+ *It returns EXIT_SUCCESS, or the errno of the failing call.
+ */
+static int mmap_changed_blocks(struct ext2_image *image, unsigned int **changed, unsigned int *count) {
+  int pagemap = open("/proc/self/pagemap", O_RDONLY);
+  if(pagemap == -1) {
+    return errno;
+  }
+  size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+  size_t pages = (image->im_disk_size + page_size - 1) / page_size;
+  size_t first_page = (uintptr_t) image->im_disk / page_size;
+  unsigned char *original = malloc(page_size);
+  uint64_t entries[512];
+  unsigned int capacity = 0;
+  int result = original == NULL ? ENOMEM : EXIT_SUCCESS;
+
+  size_t page;
+  for(page = 0; page < pages && result == EXIT_SUCCESS; page += 512) {
+    size_t batch = pages - page < 512 ? pages - page : 512;
+    if(pread(pagemap, entries, batch * sizeof(uint64_t), (off_t)((first_page + page) * sizeof(uint64_t)))
+       != (ssize_t)(batch * sizeof(uint64_t))) {
+      result = errno != 0 ? errno : EIO;
+      break;
     }
+    size_t i;
+    for(i = 0; i < batch && result == EXIT_SUCCESS; i++) {
+      //Bit 63: present, bit 62: swapped (only anonymous pages are), bit 61: file page
+      int written = ((entries[i] >> 63) & 1 && !((entries[i] >> 61) & 1)) || (entries[i] >> 62) & 1;
+      if(!written) {
+        continue;
+      }
+      size_t offset = (page + i) * page_size;
+      size_t len = image->im_disk_size - offset < page_size ? image->im_disk_size - offset : page_size;
+      if(pread(image->im_fd, original, len, (off_t) offset) != (ssize_t) len) {
+        result = errno != 0 ? errno : EIO;
+        break;
+      }
+      size_t block_offset;
+      for(block_offset = 0; block_offset < len && result == EXIT_SUCCESS; block_offset += EXT2_BLOCK_SIZE) {
+        size_t block_len = len - block_offset < EXT2_BLOCK_SIZE ? len - block_offset : EXT2_BLOCK_SIZE;
+        unsigned int block_num = (offset + block_offset) / EXT2_BLOCK_SIZE;
+        if(!mmap_new_block(image, block_num) && memcmp(image->im_disk + offset + block_offset, original + block_offset, block_len) != 0) {
+          result = append_block_num(changed, count, &capacity, block_num);
+        }
+      }
+    }
+  }
+  free(original);
+  close(pagemap);
+  return result;
 }
 
 /**
- *This function returns the inode number of the given inode. (NUMBER = INDEX + 1)
+ *This function maps the file again over the private copies of a journaled image once they match it,
+ *so the next commit only compares new changes
  */
-int inode_num_of(struct ext2_inode *inode){
-    
-    struct ext2_inode *inode_table_start = (struct ext2_inode *)(disk + EXT2_BLOCK_SIZE * gd->bg_inode_table);
+static int mmap_committed(struct ext2_image *image) {
+  if(mmap(image->im_disk, image->im_disk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image->im_fd, 0) == MAP_FAILED) {
+    return errno;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ *This function flushes the changes of the shared mapping to the device.
+ *The pages holding the blocks marked as changed since the last sync are flushed with msync(),
+ *one call per run of pages, instead of the whole image; an image that does not track its changes is flushed whole.
+ *Without durable there is nothing to do: the changes are already in the page cache.
+ */
+static int mmap_write_back(struct ext2_image *image, int durable) {
+  if(!durable) {
+    return EXIT_SUCCESS;
+  }
+  if(image->im_dirty == NULL) {
+    return msync(image->im_disk, image->im_disk_size, MS_SYNC) == -1 ? errno : EXIT_SUCCESS;
+  }
+
+  size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+  size_t blocks_per_page = page_size / EXT2_BLOCK_SIZE;
+  size_t blocks = (image->im_disk_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+  size_t run_start = 0;
+  size_t run_end = 0;//Pages [run_start, run_end) are waiting to be flushed
+  int result = EXIT_SUCCESS;
+  size_t block = 0;
+  while(TRUE) {
+    //Find the next changed block, skipping unchanged ones a byte of the bitmap at a time
+    while(block < blocks && !(image->im_dirty[block / 8] & (1 << (block % 8)))) {
+      block = image->im_dirty[block / 8] == 0 ? (block / 8 + 1) * 8 : block + 1;
+    }
+    size_t page = block / blocks_per_page;
+    if(block < blocks && run_end != 0 && page <= run_end) {
+      //The page is in the run or right after it
+      run_end = page + 1;
+      block++;
+      continue;
+    }
 
-    return (inode - inode_table_start)/sizeof(struct ext2_inode);
+    //Flush the run and start a new one at this page
+    if(run_end != 0) {
+      size_t end = run_end * page_size < image->im_disk_size ? run_end * page_size : image->im_disk_size;
+      if(msync(image->im_disk + run_start * page_size, end - run_start * page_size, MS_SYNC) == -1 && result == EXIT_SUCCESS) {
+        result = errno;
+      }
+    }
+    if(block >= blocks) {
+      break;
+    }
+    run_start = page;
+    run_end = page + 1;
+    block++;
+  }
+  memset(image->im_dirty, 0, blocks / 8 + 1);
+  return result;
 }
 
+/**
+ *This function does nothing: the mapping has no buffers to release
+ */
+static void mmap_put_block(struct ext2_image *image, unsigned int block_num) {
+  (void) image;
+  (void) block_num;
+}
 
 /**
- * Check whether the file path starts with a '/'
+ *This function does nothing: the mapping has no buffers to release
  */
+static void mmap_release_block(struct ext2_image *image, unsigned int block_num) {
+  (void) image;
+  (void) block_num;
+}
 
-//static int is_absolute_path(const char *path) {
-//    return strncmp(path, "/", 1) == 0;
-//}
+/**
+ *This function does nothing: the mapping has no buffers to release
+ */
+static void mmap_end_operation(struct ext2_image *image) {
+  (void) image;
+}
+
+static const struct ext2_io_backend mmap_backend = {
+  mmap_open, mmap_close, mmap_get_block, mmap_block_num_of, mmap_mark_dirty, mmap_load_block,
+  mmap_advise, mmap_changed_blocks, mmap_committed, mmap_write_back, mmap_put_block, mmap_release_block,
+  mmap_end_operation
+};
+
+/**
+ *This function returns TRUE if the block is free in the block bitmap of the image file,
+ *which still holds the bitmap as it was before the changes being committed.
+ *bitmap caches the bitmap block of the group in bitmap_group.
+ */
+static int block_free_on_disk(struct ext2_image *image, unsigned int block_num, unsigned char *bitmap, unsigned int *bitmap_group) {
+  struct ext2_super_block *super = image->im_sb;
+  if(block_num < super->s_first_data_block || block_num >= super->s_blocks_count) {
+    return FALSE;
+  }
+  unsigned int group = (block_num - super->s_first_data_block) / super->s_blocks_per_group;
+  unsigned int index = (block_num - super->s_first_data_block) % super->s_blocks_per_group;
+  if(*bitmap_group != group) {
+    if(pread(image->im_fd, bitmap, EXT2_BLOCK_SIZE, (off_t) image->im_gd[group].bg_block_bitmap * EXT2_BLOCK_SIZE) != EXT2_BLOCK_SIZE) {
+      return FALSE;
+    }
+    *bitmap_group = group;
+  }
+  return !(bitmap[index / 8] & (1 << (index % 8)));
+}
+
+//Number of buffers the pread backend allocates at once
+#define BUFFER_CHUNK_BLOCKS 256
+//Number of buffers added at once when every buffer of a full cache is pinned
+#define BUFFER_OVERFLOW_BLOCKS 16
+//Number of buffers written back with one pwritev()
+#define WRITE_BACK_IOV 64
+
+//A block of an image read by the pread backend
+struct ext2_buffer {
+  unsigned int b_block_num;
+  unsigned char b_valid;       //The buffer holds b_block_num
+  unsigned char b_dirty;       //It was changed since it was read or last written back
+  unsigned int b_pinned;       //Uses of a pointer to it, from get_block() until put_block(), release_block() or the end of the operation
+  unsigned char b_permanent;   //Never reused: the super block, the group descriptors and blocks replayed from a journal
+  unsigned char b_held;        //Changed metadata of a journaled image, which stays until the commit
+  unsigned char b_referenced;  //CLOCK: used since the hand last passed it
+  unsigned char *b_data;
+  struct ext2_buffer *b_hash_next;
+  struct ext2_buffer *b_lru_prev;  //LRU: the buffers that can be reused, the least recently used first
+  struct ext2_buffer *b_lru_next;
+};
+
+//Buffers allocated together, whose data is one run of memory
+struct ext2_buffer_chunk {
+  unsigned char *data;
+  unsigned int count;
+  struct ext2_buffer *buffers;
+};
 
 /*
- * This function returns the file name form the path
- * Input: path to file 
- * e.g. If the path is '/home/level1/level2/file_name', it should return 'file_name'
+ * The buffers of an image opened with the pread backend: a cache of at most max_buffers blocks.
+ * A block read when the cache is full takes the buffer of a block that is not pinned, picked by
+ * the policy, and the buffer is written back first if it was changed. Buffers of a journaled image
+ * can only be written before the commit if their block is free in the file (new data), so its changed
+ * metadata is held until the commit. The cache only grows past its size while all its buffers are pinned.
+ * The -j workers of the checker read one image from several threads, so the buffers are found and read under lock.
  */
-char *get_file_name(char *path_to_file) {
+struct ext2_buffer_cache {
+  pthread_mutex_t lock;
+  struct ext2_buffer **hash;         //Buffers by block number
+  unsigned int hash_size;            //A power of two
+  unsigned int buffer_count;         //Buffers holding a block
+  struct ext2_buffer_chunk *chunks;  //Sorted by address, to find the buffer holding an address
+  unsigned int chunk_count;
+  unsigned int allocated;            //Buffers in all the chunks
+  unsigned int permanent_count;      //Buffers of the super block and group descriptors, not counted in max_buffers
+  struct ext2_buffer *free_buffers;  //The buffers of the last chunk that are not used yet
+  unsigned int free_count;
+  struct ext2_buffer *spare;         //A buffer left without a block by a failed read
+  unsigned int max_buffers;
+  int policy;                        //EXT2_CACHE_LRU or EXT2_CACHE_CLOCK
+  struct ext2_buffer *lru_head;
+  struct ext2_buffer *lru_tail;
+  unsigned int clock_chunk;          //The CLOCK hand
+  unsigned int clock_index;
+  int read_only;
+  int journaled;
+  int unsynced;                      //Evictions wrote buffers that are not synced yet
+  unsigned char disk_bitmap[EXT2_BLOCK_SIZE];  //Block bitmap of disk_bitmap_group as it is in the file
+  unsigned int disk_bitmap_group;
+  struct ext2_cache_stats stats;
+};
 
-    char path_copy[strlen(path_to_file) + 1];
-    strcpy(path_copy, path_to_file);
-    
-    char *token = strtok(path_copy, "/");
-    char *next_token = token;
-    
-    while (next_token != NULL) {
-        token = next_token;
-        next_token = strtok(NULL, "/");
+/**
+ *This function allocates count buffers whose data follows each other in memory
+ *It returns the first buffer, or NULL if the memory cannot be allocated
+ */
+static struct ext2_buffer *add_buffer_chunk(struct ext2_buffer_cache *cache, unsigned int count) {
+  struct ext2_buffer_chunk *chunks = realloc(cache->chunks, (cache->chunk_count + 1) * sizeof(struct ext2_buffer_chunk));
+  if(chunks == NULL) {
+    return NULL;
+  }
+  cache->chunks = chunks;
+  void *data;
+  struct ext2_buffer *buffers = calloc(count, sizeof(struct ext2_buffer));
+  if(buffers == NULL || posix_memalign(&data, EXT2_BLOCK_SIZE, (size_t) count * EXT2_BLOCK_SIZE) != 0) {
+    free(buffers);
+    return NULL;
+  }
+  unsigned int i;
+  for(i = 0; i < count; i++) {
+    buffers[i].b_data = (unsigned char *) data + (size_t) i * EXT2_BLOCK_SIZE;
+  }
+
+  //Keep the chunks sorted by address
+  i = cache->chunk_count++;
+  while(i > 0 && (uintptr_t) chunks[i - 1].data > (uintptr_t) data) {
+    chunks[i] = chunks[i - 1];
+    i--;
+  }
+  chunks[i].data = data;
+  chunks[i].count = count;
+  chunks[i].buffers = buffers;
+  cache->allocated += count;
+  cache->stats.buffers = cache->allocated - cache->permanent_count;
+  return buffers;
+}
+
+/**
+ *This function returns the buffer of the block, or NULL if the block is not in the cache
+ */
+static struct ext2_buffer *find_buffer(struct ext2_buffer_cache *cache, unsigned int block_num) {
+  struct ext2_buffer *buffer = cache->hash[block_num & (cache->hash_size - 1)];
+  while(buffer != NULL && buffer->b_block_num != block_num) {
+    buffer = buffer->b_hash_next;
+  }
+  return buffer;
+}
+
+/**
+ *This function adds the buffer to the hash table, which doubles when it has as many buffers as slots
+ *It returns EXIT_SUCCESS, or ENOMEM.
+ */
+static int hash_buffer(struct ext2_buffer_cache *cache, struct ext2_buffer *buffer) {
+  if(cache->buffer_count == cache->hash_size) {
+    unsigned int new_size = cache->hash_size * 2;
+    struct ext2_buffer **new_hash = calloc(new_size, sizeof(struct ext2_buffer *));
+    if(new_hash == NULL) {
+      return ENOMEM;
     }
+    unsigned int i;
+    for(i = 0; i < cache->hash_size; i++) {
+      while(cache->hash[i] != NULL) {
+        struct ext2_buffer *moved = cache->hash[i];
+        cache->hash[i] = moved->b_hash_next;
+        moved->b_hash_next = new_hash[moved->b_block_num & (new_size - 1)];
+        new_hash[moved->b_block_num & (new_size - 1)] = moved;
+      }
+    }
+    free(cache->hash);
+    cache->hash = new_hash;
+    cache->hash_size = new_size;
+  }
+  struct ext2_buffer **slot = &cache->hash[buffer->b_block_num & (cache->hash_size - 1)];
+  buffer->b_hash_next = *slot;
+  *slot = buffer;
+  buffer->b_valid = TRUE;
+  cache->buffer_count++;
+  return EXIT_SUCCESS;
+}
 
+/**
+ *This function removes the buffer from the hash table, it no longer holds a block
+ */
+static void unhash_buffer(struct ext2_buffer_cache *cache, struct ext2_buffer *buffer) {
+  struct ext2_buffer **slot = &cache->hash[buffer->b_block_num & (cache->hash_size - 1)];
+  while(*slot != buffer) {
+    slot = &(*slot)->b_hash_next;
+  }
+  *slot = buffer->b_hash_next;
+  buffer->b_hash_next = NULL;
+  buffer->b_valid = FALSE;
+  cache->buffer_count--;
+}
 
-    
-    return token;
+/**
+ *This function takes the buffer off the LRU list if it is on it
+ */
+static void lru_unlink(struct ext2_buffer_cache *cache, struct ext2_buffer *buffer) {
+  if(buffer->b_lru_prev == NULL && cache->lru_head != buffer) {
+    return;
+  }
+  if(buffer->b_lru_prev != NULL) {
+    buffer->b_lru_prev->b_lru_next = buffer->b_lru_next;
+  }else{
+    cache->lru_head = buffer->b_lru_next;
+  }
+  if(buffer->b_lru_next != NULL) {
+    buffer->b_lru_next->b_lru_prev = buffer->b_lru_prev;
+  }else{
+    cache->lru_tail = buffer->b_lru_prev;
+  }
+  buffer->b_lru_prev = NULL;
+  buffer->b_lru_next = NULL;
 }
 
-/*
- * This function checks whether the resource is in use
- * Input: bitmap of inodes or blocks; num: the resource number(index = number - 1)
- * It eturns 1 if the bit in the bitmap is 1, return 0 otherwise.
+/**
+ *This function puts the buffer at the most recently used end of the LRU list
  */
-int check_resource_in_use(unsigned char *bitmap, int num){
-    int index = num - 1;
-    int byte_idx = index / 8;
-    int bit = index % 8;//The offset in the byte
-    char byte = bitmap[byte_idx];//The byte in the bitmap
-    return (byte) & (1 << bit);
+static void lru_append(struct ext2_buffer_cache *cache, struct ext2_buffer *buffer) {
+  lru_unlink(cache, buffer);
+  buffer->b_lru_prev = cache->lru_tail;
+  if(cache->lru_tail != NULL) {
+    cache->lru_tail->b_lru_next = buffer;
+  }else{
+    cache->lru_head = buffer;
+  }
+  cache->lru_tail = buffer;
 }
 
 /**
- * This function finds the first unused resource(inode or block) in the given bitmap and set it to 1.
- * Input: bitmap and num_bytes (the number of bytes in the bitmap, i.e. number of inodes or blocks / 8)
- * It returns the coresponding inode or block number (Number = Index + 1).
+ *This function pins the buffer for one more use: it cannot be reused until every use is put or it is unpinned
  */
-int allocate_resource(unsigned char *bitmap, int num_bytes){
-    int i;
-    for(i = 0; i < num_bytes; i++){
-        unsigned char byte = bitmap[i];
+static void pin_buffer(struct ext2_buffer_cache *cache, struct ext2_buffer *buffer) {
+  if(!buffer->b_permanent) {
+    buffer->b_pinned++;
+  }
+  buffer->b_referenced = TRUE;
+  if(cache->policy == EXT2_CACHE_LRU) {
+    lru_unlink(cache, buffer);
+  }
+}
+
+/**
+ *This function unpins the buffer, it can be reused from now on unless it is held until the commit
+ */
+static void unpin_buffer(struct ext2_buffer_cache *cache, struct ext2_buffer *buffer) {
+  if(buffer->b_permanent) {
+    return;
+  }
+  buffer->b_pinned = FALSE;
+  if(cache->policy == EXT2_CACHE_LRU && !buffer->b_held) {
+    lru_append(cache, buffer);
+  }
+}
+
+/**
+ *This function drops one use of the buffer, it is unpinned with the last one
+ */
+static void put_buffer(struct ext2_buffer_cache *cache, struct ext2_buffer *buffer) {
+  if(buffer->b_permanent || buffer->b_pinned == 0) {
+    return;
+  }
+  if(--buffer->b_pinned == 0) {
+    unpin_buffer(cache, buffer);
+  }
+}
+
+/**
+ *This function reads count blocks from block_num on into data, the part past the end of the image reads as zeros
+ *It returns EXIT_SUCCESS, or the errno of the failing read.
+ */
+static int read_blocks(struct ext2_image *image, unsigned int block_num, unsigned int count, unsigned char *data) {
+  size_t offset = (size_t) block_num * EXT2_BLOCK_SIZE;
+  size_t len = (size_t) count * EXT2_BLOCK_SIZE;
+  size_t total = 0;
+  while(total < len && offset + total < image->im_disk_size) {
+    ssize_t bytes_num = pread(image->im_fd, data + total, len - total, (off_t)(offset + total));
+    if(bytes_num < 0 && errno == EINTR) {
+      continue;
+    }
+    if(bytes_num < 0) {
+      return errno;
+    }
+    if(bytes_num == 0) {
+      break;
+    }
+    total += bytes_num;
+  }
+  memset(data + total, 0, len - total);
+  return EXIT_SUCCESS;
+}
+
+/**
+ *This function returns TRUE if the changed buffer of a journaled image has to stay until the commit:
+ *only a block that is free in the image file (new data) may be written before it
+ */
+static int held_until_commit(struct ext2_image *image, struct ext2_buffer *buffer) {
+  struct ext2_buffer_cache *cache = image->im_cache;
+  return cache->journaled && buffer->b_dirty
+         && !block_free_on_disk(image, buffer->b_block_num, cache->disk_bitmap, &cache->disk_bitmap_group);
+}
+
+/**
+ *This function picks a buffer to reuse with the policy of the cache, writes it back if it was changed
+ *and takes it out of the cache. It sets victim to NULL if every buffer is pinned or held.
+ *It returns EXIT_SUCCESS, or the errno of the failing write.
+ */
+static int evict_buffer(struct ext2_image *image, struct ext2_buffer **victim) {
+  struct ext2_buffer_cache *cache = image->im_cache;
+  struct ext2_buffer *buffer = NULL;
+  if(cache->policy == EXT2_CACHE_LRU) {
+    //The list only has buffers that are not pinned: take the least recently used one
+    while((buffer = cache->lru_head) != NULL) {
+      lru_unlink(cache, buffer);
+      if(!held_until_commit(image, buffer)) {
+        break;
+      }
+      buffer->b_held = TRUE;
+    }
+  }else{
+    //Two turns of the hand: the first may only clear the reference bits
+    //A chunk added since the last eviction may have moved the chunk under the hand, which only skips some buffers
+    unsigned long steps;
+    for(steps = 0; steps < 2 * ((unsigned long) cache->allocated + cache->chunk_count) && buffer == NULL; steps++) {
+      if(cache->clock_chunk >= cache->chunk_count) {
+        cache->clock_chunk = 0;
+        cache->clock_index = 0;
+      }
+      struct ext2_buffer_chunk *chunk = &cache->chunks[cache->clock_chunk];
+      if(cache->clock_index >= chunk->count) {
+        cache->clock_chunk++;
+        cache->clock_index = 0;
+        continue;
+      }
+      struct ext2_buffer *candidate = &chunk->buffers[cache->clock_index++];
+      if(!candidate->b_valid || candidate->b_pinned || candidate->b_held) {
+        continue;
+      }
+      if(candidate->b_referenced) {
+        candidate->b_referenced = FALSE;
+        continue;
+      }
+      if(held_until_commit(image, candidate)) {
+        candidate->b_held = TRUE;
+        continue;
+      }
+      buffer = candidate;
+    }
+  }
+  *victim = buffer;
+  if(buffer == NULL) {
+    return EXIT_SUCCESS;
+  }
+
+  if(buffer->b_dirty) {
+    size_t len = image_block_len(buffer->b_block_num, image->im_disk_size);
+    if(pwrite(image->im_fd, buffer->b_data, len, (off_t) buffer->b_block_num * EXT2_BLOCK_SIZE) != (ssize_t) len) {
+      *victim = NULL;
+      return errno != 0 ? errno : EIO;
+    }
+    buffer->b_dirty = FALSE;
+    cache->unsynced = TRUE;
+    cache->stats.write_backs++;
+  }
+  unhash_buffer(cache, buffer);
+  cache->stats.evictions++;
+  return EXIT_SUCCESS;
+}
+
+/**
+ *This function returns an unused buffer: the one left by a failed read, a new one while the cache is not full,
+ *then the buffer of an evicted block, or a new one past the size of the cache if every buffer is pinned
+ *It returns EXIT_SUCCESS, or ENOMEM or the errno of the failing write back.
+ */
+static int take_buffer(struct ext2_image *image, struct ext2_buffer **buffer) {
+  struct ext2_buffer_cache *cache = image->im_cache;
+  unsigned int cached = cache->allocated - cache->permanent_count;
+  if(cache->spare != NULL) {
+    *buffer = cache->spare;
+    cache->spare = NULL;
+    return EXIT_SUCCESS;
+  }
+  if(cache->free_count == 0 && cached >= cache->max_buffers) {
+    int result = evict_buffer(image, buffer);
+    if(result != EXIT_SUCCESS || *buffer != NULL) {
+      return result;
+    }
+  }
+  if(cache->free_count == 0) {
+    unsigned int count = cached < cache->max_buffers ? cache->max_buffers - cached : BUFFER_OVERFLOW_BLOCKS;
+    if(count > BUFFER_CHUNK_BLOCKS) {
+      count = BUFFER_CHUNK_BLOCKS;
+    }
+    cache->free_buffers = add_buffer_chunk(cache, count);
+    if(cache->free_buffers == NULL) {
+      return ENOMEM;
+    }
+    cache->free_count = count;
+  }
+  *buffer = cache->free_buffers++;
+  cache->free_count--;
+  return EXIT_SUCCESS;
+}
+
+/**
+ *This function returns the chunk whose data holds the address, or NULL if it is not in a buffer
+ */
+static struct ext2_buffer_chunk *chunk_of(struct ext2_buffer_cache *cache, const unsigned char *address) {
+  unsigned int low = 0;
+  unsigned int high = cache->chunk_count;
+  while(low < high) {
+    unsigned int middle = low + (high - low) / 2;
+    if((uintptr_t) cache->chunks[middle].data <= (uintptr_t) address) {
+      low = middle + 1;
+    }else{
+      high = middle;
+    }
+  }
+  if(low == 0) {
+    return NULL;
+  }
+  struct ext2_buffer_chunk *chunk = &cache->chunks[low - 1];
+  if((uintptr_t) address - (uintptr_t) chunk->data >= (size_t) chunk->count * EXT2_BLOCK_SIZE) {
+    return NULL;
+  }
+  return chunk;
+}
+
+/**
+ *This function sets up the buffer cache of the image with the default size and policy.
+ *The super block and the group descriptor table are read into one chunk that is never reused, so gd is one array.
+ */
+static int pread_open(struct ext2_image *image, int map_flags) {
+  struct ext2_super_block super;
+  if(pread(image->im_fd, &super, sizeof(super), EXT2_BLOCK_SIZE) != sizeof(super)) {
+    return errno != 0 ? errno : EIO;
+  }
+  struct ext2_buffer_cache *cache = calloc(1, sizeof(struct ext2_buffer_cache));
+  if(cache == NULL) {
+    return ENOMEM;
+  }
+  cache->read_only = (map_flags & EXT2_MAP_READ_ONLY) != 0;
+  cache->journaled = image->im_journal_path != NULL;
+  cache->disk_bitmap_group = (unsigned int) -1;
+  cache->policy = EXT2_CACHE_LRU;
+  pthread_mutex_init(&cache->lock, NULL);
+  cache->hash_size = 1024;
+  cache->hash = calloc(cache->hash_size, sizeof(struct ext2_buffer *));
+  image->im_cache = cache;
+
+  unsigned int groups = (super.s_blocks_count - super.s_first_data_block + super.s_blocks_per_group - 1) / super.s_blocks_per_group;
+  unsigned int gd_blocks = (groups * sizeof(struct ext2_group_desc) + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+  unsigned int first_block = EXT2_BLOCK_SIZE / EXT2_BLOCK_SIZE;//The block of the super block
+  unsigned int count = super.s_first_data_block + 1 + gd_blocks - first_block;
+  struct ext2_buffer *buffers = cache->hash == NULL ? NULL : add_buffer_chunk(cache, count);
+  int result = buffers == NULL ? ENOMEM : read_blocks(image, first_block, count, buffers[0].b_data);
+  unsigned int i;
+  for(i = 0; i < count && result == EXIT_SUCCESS; i++) {
+    buffers[i].b_block_num = first_block + i;
+    buffers[i].b_pinned = TRUE;
+    buffers[i].b_permanent = TRUE;
+    result = hash_buffer(cache, &buffers[i]);
+  }
+  if(result != EXIT_SUCCESS) {
+    image->im_io->close(image);
+    return result;
+  }
+  cache->permanent_count = count;
+  cache->stats.buffers = 0;
+  cache->max_buffers = EXT2_CACHE_DEFAULT_BLOCKS;
+  cache->stats.max_buffers = cache->max_buffers;
+
+  if(map_flags & EXT2_MAP_POPULATE) {
+    //Start reading the whole image before it is scanned
+    posix_fadvise(image->im_fd, 0, 0, POSIX_FADV_WILLNEED);
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ *This function frees the buffers of the image
+ */
+static void pread_close(struct ext2_image *image) {
+  struct ext2_buffer_cache *cache = image->im_cache;
+  unsigned int i;
+  for(i = 0; i < cache->chunk_count; i++) {
+    free(cache->chunks[i].data);
+    free(cache->chunks[i].buffers);
+  }
+  free(cache->chunks);
+  free(cache->hash);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache);
+  image->im_cache = NULL;
+}
+
+/**
+ *This function sets data to the buffer of the block, reading the block into the cache if it is not there.
+ *The buffer is pinned for one more use, until put_block(), release_block() or the end of the operation.
+ *It returns EXIT_SUCCESS, or the errno of the failing read (or of the write back of the buffer it reused).
+ */
+static int pread_get_block(struct ext2_image *image, unsigned int block_num, unsigned char **data) {
+  struct ext2_buffer_cache *cache = image->im_cache;
+  pthread_mutex_lock(&cache->lock);
+  struct ext2_buffer *buffer = find_buffer(cache, block_num);
+  int result = EXIT_SUCCESS;
+  if(buffer != NULL) {
+    cache->stats.hits++;
+  }else{
+    cache->stats.misses++;
+    result = take_buffer(image, &buffer);
+    if(result == EXIT_SUCCESS) {
+      buffer->b_block_num = block_num;
+      result = read_blocks(image, block_num, 1, buffer->b_data);
+    }
+    if(result == EXIT_SUCCESS) {
+      result = hash_buffer(cache, buffer);
+    }
+  }
+  if(result != EXIT_SUCCESS) {
+    if(buffer != NULL) {
+      //The buffer holds no block, keep it for the next read
+      cache->spare = buffer;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return result;
+  }
+  pin_buffer(cache, buffer);
+  pthread_mutex_unlock(&cache->lock);
+  *data = buffer->b_data;
+  return EXIT_SUCCESS;
+}
+
+/**
+ *This function returns the number of the block whose buffer holds the address, 0 if it is in none
+ */
+static unsigned int pread_block_num_of(struct ext2_image *image, const unsigned char *address) {
+  unsigned int block_num = 0;
+  pthread_mutex_lock(&image->im_cache->lock);
+  struct ext2_buffer_chunk *chunk = chunk_of(image->im_cache, address);
+  if(chunk != NULL) {
+    struct ext2_buffer *buffer = &chunk->buffers[((uintptr_t) address - (uintptr_t) chunk->data) / EXT2_BLOCK_SIZE];
+    block_num = buffer->b_valid ? buffer->b_block_num : 0;
+  }
+  pthread_mutex_unlock(&image->im_cache->lock);
+  return block_num;
+}
+
+/**
+ *This function marks the buffers holding the len bytes at address as changed
+ *A range only goes past its block inside a chunk, where the next buffer is the next block (the group descriptors)
+ */
+static void pread_mark_dirty(struct ext2_image *image, const unsigned char *address, size_t len) {
+  if(image->im_cache->read_only || len == 0) {
+    return;
+  }
+  pthread_mutex_lock(&image->im_cache->lock);
+  struct ext2_buffer_chunk *chunk = chunk_of(image->im_cache, address);
+  if(chunk != NULL) {
+    size_t offset = (uintptr_t) address - (uintptr_t) chunk->data;
+    size_t last = (offset + len - 1) / EXT2_BLOCK_SIZE;
+    size_t i;
+    for(i = offset / EXT2_BLOCK_SIZE; i <= last && i < chunk->count; i++) {
+      chunk->buffers[i].b_dirty = chunk->buffers[i].b_valid;
+    }
+  }
+  pthread_mutex_unlock(&image->im_cache->lock);
+}
+
+/**
+ *This function copies the block into its buffer without marking it as changed.
+ *The buffer is never reused: the file does not hold what it was replaced with.
+ */
+static int pread_load_block(struct ext2_image *image, unsigned int block_num, const unsigned char *data, size_t len) {
+  unsigned char *block;
+  int result = pread_get_block(image, block_num, &block);
+  if(result != EXIT_SUCCESS) {
+    return result;
+  }
+  memcpy(block, data, len);
+  pthread_mutex_lock(&image->im_cache->lock);
+  find_buffer(image->im_cache, block_num)->b_permanent = TRUE;
+  pthread_mutex_unlock(&image->im_cache->lock);
+  return EXIT_SUCCESS;
+}
+
+/**
+ *This function passes the access pattern hint on to the kernel's read-ahead of the image file
+ */
+static void pread_advise(struct ext2_image *image, size_t offset, size_t length, int advice) {
+  posix_fadvise(image->im_fd, (off_t) offset, (off_t) length, advice);
+}
+
+/**
+ *This function appends the numbers of the changed buffers that differ from the image file, in block order.
+ *The new data that evictions wrote in place since the last commit is synced first, like the data blocks of the commit.
+ *It returns EXIT_SUCCESS, or the errno of the failing call.
+ */
+static int pread_changed_blocks(struct ext2_image *image, unsigned int **changed, unsigned int *count) {
+  struct ext2_buffer_cache *cache = image->im_cache;
+  if(cache->unsynced && fdatasync(image->im_fd) == -1) {
+    return errno;
+  }
+  cache->unsynced = FALSE;
+
+  unsigned int capacity = 0;
+  unsigned char original[EXT2_BLOCK_SIZE];
+  int result = EXIT_SUCCESS;
+  unsigned int i;
+  for(i = 0; i < cache->chunk_count && result == EXIT_SUCCESS; i++) {
+    unsigned int j;
+    for(j = 0; j < cache->chunks[i].count && result == EXIT_SUCCESS; j++) {
+      struct ext2_buffer *buffer = &cache->chunks[i].buffers[j];
+      if(!buffer->b_dirty) {
+        continue;
+      }
+      result = read_blocks(image, buffer->b_block_num, 1, original);
+      if(result == EXIT_SUCCESS && memcmp(buffer->b_data, original, EXT2_BLOCK_SIZE) != 0) {
+        result = append_block_num(changed, count, &capacity, buffer->b_block_num);
+      }
+    }
+  }
+  if(*count > 1) {
+    qsort(*changed, *count, sizeof(unsigned int), compare_block_nums);
+  }
+  return result;
+}
+
+/**
+ *This function clears the changed marks of the buffers once the file holds them,
+ *the buffers held until the commit can be reused again
+ */
+static int pread_committed(struct ext2_image *image) {
+  struct ext2_buffer_cache *cache = image->im_cache;
+  unsigned int i;
+  for(i = 0; i < cache->chunk_count; i++) {
+    unsigned int j;
+    for(j = 0; j < cache->chunks[i].count; j++) {
+      struct ext2_buffer *buffer = &cache->chunks[i].buffers[j];
+      buffer->b_dirty = FALSE;
+      if(buffer->b_held) {
+        buffer->b_held = FALSE;
+        if(!buffer->b_pinned) {
+          unpin_buffer(cache, buffer);
+        }
+      }
+    }
+  }
+  //The bitmaps in the file have changed
+  cache->disk_bitmap_group = (unsigned int) -1;
+  return EXIT_SUCCESS;
+}
+
+/**
+ *This function writes the changed buffers to the image file in block order,
+ *one pwritev() per run of consecutive blocks, and syncs the file if durable is TRUE
+ *It returns EXIT_SUCCESS, or the errno of the failing call.
+ */
+static int pread_write_back(struct ext2_image *image, int durable) {
+  struct ext2_buffer_cache *cache = image->im_cache;
+  if(cache->read_only) {
+    return EXIT_SUCCESS;
+  }
+  unsigned int *dirty = NULL;
+  unsigned int count = 0;
+  unsigned int capacity = 0;
+  int result = EXIT_SUCCESS;
+  unsigned int i;
+  for(i = 0; i < cache->chunk_count && result == EXIT_SUCCESS; i++) {
+    unsigned int j;
+    for(j = 0; j < cache->chunks[i].count && result == EXIT_SUCCESS; j++) {
+      if(cache->chunks[i].buffers[j].b_dirty) {
+        result = append_block_num(&dirty, &count, &capacity, cache->chunks[i].buffers[j].b_block_num);
+      }
+    }
+  }
+  if(count > 1) {
+    qsort(dirty, count, sizeof(unsigned int), compare_block_nums);
+  }
+
+  struct iovec iov[WRITE_BACK_IOV];
+  i = 0;
+  while(i < count && result == EXIT_SUCCESS) {
+    //Gather the run of consecutive blocks from dirty[i]
+    unsigned int run = 0;
+    size_t run_len = 0;
+    while(i + run < count && run < WRITE_BACK_IOV && dirty[i + run] == dirty[i] + run) {
+      iov[run].iov_base = find_buffer(cache, dirty[i + run])->b_data;
+      iov[run].iov_len = image_block_len(dirty[i + run], image->im_disk_size);
+      run_len += iov[run].iov_len;
+      run++;
+    }
+    if(pwritev(image->im_fd, iov, run, (off_t) dirty[i] * EXT2_BLOCK_SIZE) != (ssize_t) run_len) {
+      result = errno != 0 ? errno : EIO;
+    }
+    i += run;
+  }
+  free(dirty);
+
+  if(result == EXIT_SUCCESS) {
+    pread_committed(image);
+  }
+  if(result == EXIT_SUCCESS && durable && (count > 0 || cache->unsynced)) {
+    result = fdatasync(image->im_fd) == -1 ? errno : EXIT_SUCCESS;
+    cache->unsynced = result != EXIT_SUCCESS;
+  }
+  return result;
+}
+
+/**
+ *This function drops one use of the buffer of the block
+ */
+static void pread_put_block(struct ext2_image *image, unsigned int block_num) {
+  pthread_mutex_lock(&image->im_cache->lock);
+  struct ext2_buffer *buffer = find_buffer(image->im_cache, block_num);
+  if(buffer != NULL) {
+    put_buffer(image->im_cache, buffer);
+  }
+  pthread_mutex_unlock(&image->im_cache->lock);
+}
+
+/**
+ *This function unpins the buffer of the block, the caller no longer uses any pointer get_block() returned to it
+ */
+static void pread_release_block(struct ext2_image *image, unsigned int block_num) {
+  pthread_mutex_lock(&image->im_cache->lock);
+  struct ext2_buffer *buffer = find_buffer(image->im_cache, block_num);
+  if(buffer != NULL) {
+    unpin_buffer(image->im_cache, buffer);
+  }
+  pthread_mutex_unlock(&image->im_cache->lock);
+}
+
+/**
+ *This function unpins every buffer: no pointer taken during the operation is used after it
+ */
+static void pread_end_operation(struct ext2_image *image) {
+  struct ext2_buffer_cache *cache = image->im_cache;
+  pthread_mutex_lock(&cache->lock);
+  unsigned int i;
+  for(i = 0; i < cache->chunk_count; i++) {
+    unsigned int j;
+    for(j = 0; j < cache->chunks[i].count; j++) {
+      if(cache->chunks[i].buffers[j].b_pinned) {
+        unpin_buffer(cache, &cache->chunks[i].buffers[j]);
+      }
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+static const struct ext2_io_backend pread_backend = {
+  pread_open, pread_close, pread_get_block, pread_block_num_of, pread_mark_dirty, pread_load_block,
+  pread_advise, pread_changed_blocks, pread_committed, pread_write_back, pread_put_block, pread_release_block,
+  pread_end_operation
+};
+
+/**
+ *This function sets the size of the buffer cache of an image opened with the pread backend, in blocks,
+ *and its policy (EXT2_CACHE_LRU or EXT2_CACHE_CLOCK). The super block and group descriptors are not counted.
+ *A smaller size takes effect as blocks are read: the buffers already allocated are kept.
+ *It does nothing for a mapped image.
+ *It returns EXIT_SUCCESS, or EINVAL if the size is 0 or the policy is not known.
+ */
+int ext2_configure_cache(struct ext2_image *image, unsigned int max_blocks, int policy) {
+  struct ext2_buffer_cache *cache = image->im_cache;
+  if(max_blocks == 0 || (policy != EXT2_CACHE_LRU && policy != EXT2_CACHE_CLOCK)) {
+    return EINVAL;
+  }
+  if(cache == NULL) {
+    return EXIT_SUCCESS;
+  }
+  pthread_mutex_lock(&cache->lock);
+  cache->max_buffers = max_blocks;
+  cache->stats.max_buffers = max_blocks;
+  if(policy != cache->policy) {
+    //Only LRU keeps a list of the buffers that can be reused
+    while(cache->lru_head != NULL) {
+      lru_unlink(cache, cache->lru_head);
+    }
+    cache->policy = policy;
+    unsigned int i;
+    for(i = 0; i < cache->chunk_count; i++) {
+      unsigned int j;
+      for(j = 0; j < cache->chunks[i].count; j++) {
+        struct ext2_buffer *buffer = &cache->chunks[i].buffers[j];
+        if(buffer->b_valid && !buffer->b_pinned) {
+          unpin_buffer(cache, buffer);
+        }
+      }
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return EXIT_SUCCESS;
+}
+
+/**
+ *This function copies the counters of the buffer cache of the image, they are all 0 for a mapped image
+ */
+void ext2_get_cache_stats(struct ext2_image *image, struct ext2_cache_stats *stats) {
+  memset(stats, 0, sizeof(struct ext2_cache_stats));
+  if(image->im_cache != NULL) {
+    pthread_mutex_lock(&image->im_cache->lock);
+    *stats = image->im_cache->stats;
+    pthread_mutex_unlock(&image->im_cache->lock);
+  }
+}
+
+/**
+ *This function opens the image at the input file path and binds it to the calling thread.
+ *It initializes the disk, super block, group descihper table and the geometry of the image
+ *(number of block groups and on-disk inode size) if read is sucessful.
+ *map_flags is a combination of the EXT2_MAP_* hints that describes how the program is going to access the image,
+ *EXT2_MAP_PREAD chooses the pread backend instead of mapping the image.
+ *It returns EXIT_SUCCESS and sets image, or the errno of the failing call,
+ *EINVAL if the file is not an ext2 image, or ENOMEM if the caches cannot be allocated.
+ */
+int ext2_open_image(const char *image_path, int map_flags, struct ext2_image **image) {
+  int fd = open(image_path, (map_flags & EXT2_MAP_READ_ONLY) ? O_RDONLY : O_RDWR);
+  if(fd == -1) {
+    return errno;
+  }
+  char journal_path[strlen(image_path) + sizeof(EXT2_JOURNAL_SUFFIX)];
+  sprintf(journal_path, "%s%s", image_path, EXT2_JOURNAL_SUFFIX);
+
+  struct stat image_stat;
+  if(fstat(fd, &image_stat) == -1) {
+    int result = errno;
+    close(fd);
+    return result;
+  }
+  if(image_stat.st_size < 2 * EXT2_BLOCK_SIZE) {
+    close(fd);
+    return EINVAL;
+  }
+
+  //Finish the last commit of a tool that died before it was done
+  int result;
+  if(!(map_flags & EXT2_MAP_READ_ONLY) && (result = replay_journal(journal_path, fd, NULL, (size_t) image_stat.st_size)) != EXIT_SUCCESS) {
+    close(fd);
+    return result;
+  }
+
+  //Without a journal, the changes are synced when the tool exits instead
+  if((map_flags & EXT2_MAP_JOURNAL) && !(map_flags & EXT2_MAP_READ_ONLY) && !journal_can_be_created(journal_path)) {
+    map_flags = (map_flags & ~EXT2_MAP_JOURNAL) | EXT2_MAP_SYNC_AT_EXIT;
+  }
+
+  struct ext2_super_block super;
+  if(pread(fd, &super, sizeof(super), EXT2_BLOCK_SIZE) != sizeof(super)
+     || super.s_magic != EXT2_SUPER_MAGIC || super.s_blocks_per_group == 0
+     || (size_t) super.s_blocks_count * EXT2_BLOCK_SIZE > (size_t) image_stat.st_size) {
+    close(fd);
+    return EINVAL;
+  }
+
+  struct ext2_image *new_image = calloc(1, sizeof(struct ext2_image));
+  if(new_image == NULL || ((map_flags & EXT2_MAP_JOURNAL) && !(map_flags & EXT2_MAP_READ_ONLY)
+                           && (new_image->im_journal_path = strdup(journal_path)) == NULL)) {
+    free(new_image);
+    close(fd);
+    return ENOMEM;
+  }
+  new_image->im_fd = fd;
+  new_image->im_disk_size = (size_t) image_stat.st_size;
+  new_image->im_io = (map_flags & EXT2_MAP_PREAD) ? &pread_backend : &mmap_backend;
+  if(!(map_flags & EXT2_MAP_READ_ONLY)) {
+    new_image->im_sync_flags = map_flags & (EXT2_MAP_SYNC_AT_EXIT | EXT2_MAP_SYNC_PER_OP);
+  }
+  result = new_image->im_io->open(new_image, map_flags);
+  if(result != EXIT_SUCCESS) {
+    if(new_image->im_fd != -1) {
+      close(new_image->im_fd);
+    }
+    free(new_image->im_journal_path);
+    free(new_image);
+    return result;
+  }
+  //See the blocks of a committed journal that has not been replayed yet
+  if(map_flags & EXT2_MAP_READ_ONLY && (result = replay_journal(journal_path, -1, new_image, new_image->im_disk_size)) != EXIT_SUCCESS) {
+    new_image->im_io->close(new_image);
+    if(new_image->im_fd != -1) {
+      close(new_image->im_fd);
+    }
+    free(new_image->im_journal_path);
+    free(new_image);
+    return result;
+  }
+
+  //The super block is at byte 1024, the group descipher table starts at the block after it
+  //Both backends have them in memory already, so these cannot fail
+  unsigned char *block;
+  new_image->im_io->get_block(new_image, EXT2_BLOCK_SIZE / EXT2_BLOCK_SIZE, &block);
+  new_image->im_sb = (struct ext2_super_block *) block;
+  new_image->im_io->get_block(new_image, super.s_first_data_block + 1, &block);
+  new_image->im_gd = (struct ext2_group_desc *) block;
+
+  //Number of groups = ceil(data blocks / blocks per group)
+  new_image->im_groups_count = (super.s_blocks_count - super.s_first_data_block + super.s_blocks_per_group - 1) / super.s_blocks_per_group;
+
+  //Revision 0 images always use 128-byte inodes
+  new_image->im_inode_size = super.s_rev_level == 0 ? sizeof(struct ext2_inode) : super.s_inode_size;
+
+  new_image->im_inode_cursor = calloc(new_image->im_groups_count, sizeof(unsigned int));
+  new_image->im_block_cursor = calloc(new_image->im_groups_count, sizeof(unsigned int));
+  if(new_image->im_inode_cursor == NULL || new_image->im_block_cursor == NULL
+     || init_dir_space_hints(new_image) != EXIT_SUCCESS || init_dentry_cache(new_image) != EXIT_SUCCESS) {
+    ext2_close_image(new_image);
+    return ENOMEM;
+  }
+
+  ext2_use_image(new_image);
+
+  //Access pattern hints
+  if(map_flags & EXT2_MAP_SEQUENTIAL) {
+    new_image->im_io->advise(new_image, 0, disk_size, POSIX_FADV_SEQUENTIAL);
+  }else if(map_flags & EXT2_MAP_RANDOM) {
+    new_image->im_io->advise(new_image, 0, disk_size, POSIX_FADV_RANDOM);
+  }
+
+  if(map_flags & EXT2_MAP_PREFETCH_METADATA) {
+    //Start reading the bitmaps and inode tables of every group before they are scanned
+    unsigned int group;
+    for(group = 0; group < groups_count; group++) {
+      new_image->im_io->advise(new_image, (size_t) gd[group].bg_block_bitmap * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE, POSIX_FADV_WILLNEED);
+      new_image->im_io->advise(new_image, (size_t) gd[group].bg_inode_bitmap * EXT2_BLOCK_SIZE, EXT2_BLOCK_SIZE, POSIX_FADV_WILLNEED);
+      new_image->im_io->advise(new_image, (size_t) gd[group].bg_inode_table * EXT2_BLOCK_SIZE,
+                               (size_t) sb->s_inodes_per_group * inode_size, POSIX_FADV_WILLNEED);
+    }
+  }
+
+  *image = new_image;
+  return EXIT_SUCCESS;
+}
+
+/**
+ *This function binds the image to the calling thread: the helpers called by this thread work on it
+ */
+void ext2_use_image(struct ext2_image *image) {
+  current_image = image;
+}
+
+/**
+ *This function closes the image and frees its caches.
+ *The changes to a journaled image that have not been committed are dropped,
+ *an image opened with a sync policy is synced first, the others write their changes back.
+ *The image is unbound from the calling thread if it was bound to it.
+ */
+void ext2_close_image(struct ext2_image *image) {
+  if(image->im_journal_path == NULL && image->im_sync_flags != 0) {
+    ext2_sync_image(image);
+  }else{
+    ext2_flush_image(image);
+  }
+  if(image->im_dentry_cache != NULL) {
+    clear_dentry_cache(image);
+  }
+  if(image->im_dir_hints != NULL) {
+    clear_dir_space_hints(image);
+  }
+  free(image->im_dentry_cache);
+  free(image->im_dir_hints);
+  free(image->im_reserved);
+  free(image->im_inode_cursor);
+  free(image->im_block_cursor);
+  image->im_io->close(image);
+  if(image->im_fd != -1) {
+    close(image->im_fd);
+  }
+  free(image->im_journal_path);
+  if(current_image == image) {
+    current_image = NULL;
+  }
+  free(image);
+}
+
+/**
+ *This function writes the blocks of the image to fd, or to the journal at journal_offset if it is not 0.
+ *It returns EXIT_SUCCESS, or the errno of the failing write.
+ */
+static int write_blocks(struct ext2_image *image, int fd, unsigned int *block_nums, unsigned int count, off_t journal_offset) {
+  unsigned int i;
+  for(i = 0; i < count; i++) {
+    size_t len = image_block_len(block_nums[i], image->im_disk_size);
+    off_t offset = journal_offset != 0 ? journal_offset + (off_t) i * EXT2_BLOCK_SIZE : (off_t) block_nums[i] * EXT2_BLOCK_SIZE;
+    unsigned char block[EXT2_BLOCK_SIZE] = {0};
+    unsigned char *data;
+    int result = image->im_io->get_block(image, block_nums[i], &data);
+    if(result != EXIT_SUCCESS) {
+      return result;
+    }
+    memcpy(block, data, len);
+    if(pwrite(fd, block, journal_offset != 0 ? EXT2_BLOCK_SIZE : len, offset) == -1) {
+      return errno;
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ *This function syncs the directory holding the journal, so that creating or removing the journal
+ *is on disk before the image is written in place.
+ *It returns EXIT_SUCCESS, or the errno of the failing call.
+ */
+static int sync_journal_dir(const char *journal_path) {
+  char dir_path[strlen(journal_path) + 2];
+  strcpy(dir_path, journal_path);
+  char *slash = strrchr(dir_path, '/');
+  if(slash == NULL) {
+    strcpy(dir_path, ".");
+  }else{
+    slash[slash == dir_path ? 1 : 0] = '\0';
+  }
+  int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+  if(dir_fd == -1) {
+    return errno;
+  }
+  int result = fsync(dir_fd) == -1 ? errno : EXIT_SUCCESS;
+  close(dir_fd);
+  return result;
+}
+
+/**
+ *This function makes the changes to a journaled image durable as one atomic update.
+ *The new data blocks (free in the bitmap on disk) are written in place and synced first; they are
+ *not reachable until the metadata lands. The other changed blocks are logged in the journal, which is
+ *synced with its directory entry: from then on a crash is repaired by replaying the journal. They are then
+ *written into the image, the image is synced and the journal removed, which is synced too so that
+ *a later commit cannot be overwritten by replaying this one.
+ *It does nothing for an image that is not journaled.
+ *It returns EXIT_SUCCESS, or the errno of the failing call (the image file is unchanged, or the journal replays).
+ */
+int ext2_commit_image(struct ext2_image *image) {
+  if(image->im_journal_path == NULL) {
+    return EXIT_SUCCESS;
+  }
+
+  unsigned int *changed = NULL;
+  unsigned int count = 0;
+  int result = image->im_io->changed_blocks(image, &changed, &count);
+  if(result != EXIT_SUCCESS || count == 0) {
+    free(changed);
+    return result;
+  }
+
+  //Split the blocks: new data first, then what goes through the journal
+  unsigned char bitmap[EXT2_BLOCK_SIZE];
+  unsigned int bitmap_group = (unsigned int) -1;
+  unsigned int data_count = 0;
+  unsigned int i;
+  for(i = 0; i < count; i++) {
+    if(block_free_on_disk(image, changed[i], bitmap, &bitmap_group)) {
+      unsigned int block_num = changed[i];
+      changed[i] = changed[data_count];
+      changed[data_count++] = block_num;
+    }
+  }
+  unsigned int *logged = changed + data_count;
+  unsigned int logged_count = count - data_count;
+
+  //A mapped image wrote its new data through its shared mapping already, it is synced here too
+  result = write_blocks(image, image->im_fd, changed, data_count, 0);
+  if(result == EXIT_SUCCESS && fdatasync(image->im_fd) == -1) {
+    result = errno;
+  }
+
+  //Log the metadata blocks, the journal is committed once its checksum is on disk
+  if(result == EXIT_SUCCESS && logged_count > 0) {
+    int journal_fd = open(image->im_journal_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(journal_fd == -1) {
+      result = errno;
+    }else{
+      struct ext2_journal_header header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, EXT2_JOURNAL_MAGIC, sizeof(header.magic));
+      header.block_count = logged_count;
+      off_t blocks_offset = (off_t)(sizeof(header) + logged_count * sizeof(unsigned int));
+      header.checksum = journal_checksum(JOURNAL_CHECKSUM_SEED, (unsigned char *) logged, logged_count * sizeof(unsigned int));
+      for(i = 0; i < logged_count && result == EXIT_SUCCESS; i++) {
+        unsigned char block[EXT2_BLOCK_SIZE] = {0};
+        unsigned char *data;
+        result = image->im_io->get_block(image, logged[i], &data);
+        if(result == EXIT_SUCCESS) {
+          memcpy(block, data, image_block_len(logged[i], image->im_disk_size));
+          header.checksum = journal_checksum(header.checksum, block, EXT2_BLOCK_SIZE);
+        }
+      }
+      //A block that cannot be read leaves the journal without a header, so it is not committed
+      if(result == EXIT_SUCCESS && (pwrite(journal_fd, logged, logged_count * sizeof(unsigned int), sizeof(header)) == -1
+         || (result = write_blocks(image, journal_fd, logged, logged_count, blocks_offset)) != EXIT_SUCCESS
+         || pwrite(journal_fd, &header, sizeof(header), 0) == -1 || fsync(journal_fd) == -1)) {
+        result = result != EXIT_SUCCESS ? result : errno;
+      }
+      close(journal_fd);
+    }
+    //The journal may have just been created: its entry must survive a crash during the checkpoint
+    if(result == EXIT_SUCCESS) {
+      result = sync_journal_dir(image->im_journal_path);
+    }
+
+    //Checkpoint: copy the logged blocks into the image
+    if(result == EXIT_SUCCESS) {
+      result = write_blocks(image, image->im_fd, logged, logged_count, 0);
+    }
+    if(result == EXIT_SUCCESS && fsync(image->im_fd) == -1) {
+      result = errno;
+    }
+    if(result == EXIT_SUCCESS && unlink(image->im_journal_path) == -1) {
+      result = errno;
+    }
+    if(result == EXIT_SUCCESS) {
+      result = sync_journal_dir(image->im_journal_path);
+    }
+  }
+  free(changed);
+
+  //The file now holds the changes
+  if(result == EXIT_SUCCESS) {
+    result = image->im_io->committed(image);
+  }
+  return result;
+}
+
+/**
+ *This function marks the blocks of the image holding the len bytes at address as changed, so that the
+ *next sync flushes them. The pread backend writes back only the blocks marked here; the mmap backend only
+ *tracks them with EXT2_MAP_SYNC_* without a journal.
+ */
+void mark_dirty(const void *address, size_t len) {
+  current_image->im_io->mark_dirty(current_image, address, len);
+}
+
+/**
+ *This function marks the whole block as changed, see mark_dirty()
+ */
+void mark_block_dirty(unsigned int block_num) {
+  mark_dirty(get_block(block_num), EXT2_BLOCK_SIZE);
+}
+
+/**
+ *This function writes the changes to the image back to the file without waiting for the device.
+ *Only the pread backend has anything to write: a mapped image shares its pages with the file,
+ *and the changes to a journaled image only go through ext2_commit_image().
+ *It returns EXIT_SUCCESS, or the errno of the failing call.
+ */
+int ext2_flush_image(struct ext2_image *image) {
+  if(image->im_journal_path != NULL) {
+    return EXIT_SUCCESS;
+  }
+  return image->im_io->write_back(image, FALSE);
+}
+
+/**
+ *This function makes the changes to the image durable.
+ *A journaled image is committed. Otherwise the changed blocks are written back and synced:
+ *only the blocks marked as changed since the last sync when the image tracks them, the whole image if not.
+ *It returns EXIT_SUCCESS, or the errno of the failing call.
+ */
+int ext2_sync_image(struct ext2_image *image) {
+  if(image->im_journal_path != NULL) {
+    return ext2_commit_image(image);
+  }
+  return image->im_io->write_back(image, TRUE);
+}
+
+/**
+ *This function tells the image that one operation (one command of a tool) is done.
+ *With EXT2_MAP_SYNC_PER_OP its changes are made durable now, see ext2_sync_image().
+ *The pointers get_block() returned during the operation must not be used after it.
+ *It returns EXIT_SUCCESS, or the errno of the failing sync.
+ */
+int ext2_end_operation(struct ext2_image *image) {
+  int result = EXIT_SUCCESS;
+  if(image->im_sync_flags & EXT2_MAP_SYNC_PER_OP) {
+    result = ext2_sync_image(image);
+  }
+  image->im_io->end_operation(image);
+  return result;
+}
+
+//The image of the tool, which load_image() syncs when the tool exits
+static struct ext2_image *exit_image;
+//Set when the tool exits in the middle of an operation, see ext2_abort()
+static int exit_aborted;
+
+/**
+ *This function exits the tool in the middle of an operation that cannot go on.
+ *The changes since the last commit of a journaled image are dropped instead of being committed
+ *half done; other images are written back as they are, like a mapped image already is.
+ */
+void ext2_abort(int status) {
+  exit_aborted = TRUE;
+  exit(status);
+}
+
+/**
+ *This function commits, syncs or writes back the image of the tool when it exits,
+ *unless the tool was aborted with a journaled image
+ */
+static void sync_at_exit(void) {
+  int result;
+  if(exit_aborted && exit_image->im_journal_path != NULL) {
+    fprintf(stderr, "Error: the operation failed, the changes since the last commit are dropped\n");
+    return;
+  }
+  if(exit_image->im_journal_path != NULL || exit_image->im_sync_flags != 0) {
+    result = ext2_sync_image(exit_image);
+  }else{
+    result = ext2_flush_image(exit_image);
+  }
+  if(result != EXIT_SUCCESS) {
+    fprintf(stderr, "Error: cannot commit the changes to the image: %s\n", strerror(result));
+    _exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ *This function prints the counters of the buffer cache of the image of the tool when it exits
+ */
+static void print_cache_stats(void) {
+  struct ext2_cache_stats stats;
+  ext2_get_cache_stats(exit_image, &stats);
+  fprintf(stderr, "cache: %llu hits, %llu misses, %llu evictions, %llu write backs, %u of %u buffers\n",
+          (unsigned long long) stats.hits, (unsigned long long) stats.misses, (unsigned long long) stats.evictions,
+          (unsigned long long) stats.write_backs, stats.buffers, stats.max_buffers);
+}
+
+/**
+ *This function reads the image from the input file path for a tool that works on a single image.
+ *The EXT2_SYNC environment variable replaces the tool's durability flags (see EXT2_SYNC_ENV),
+ *EXT2_IO chooses the I/O backend (see EXT2_IO_ENV), and EXT2_CACHE_BLOCKS, EXT2_CACHE_POLICY
+ *and EXT2_CACHE_STATS set up and report its buffer cache (see EXT2_CACHE_BLOCKS_ENV).
+ *The changes to the image are committed, synced or written back when the tool exits,
+ *whether it returns from main() or calls exit(), but a journaled image is not committed if it aborts (ext2_abort()).
+ *It exits with ENOENT if the image cannot be opened, or EXIT_FAILURE if it cannot be loaded.
+ */
+void load_image(const char *image_path, int map_flags) {
+  const char *policy = getenv(EXT2_SYNC_ENV);
+  if(policy != NULL && !(map_flags & EXT2_MAP_READ_ONLY)) {
+    map_flags &= ~(EXT2_MAP_JOURNAL | EXT2_MAP_SYNC_AT_EXIT | EXT2_MAP_SYNC_PER_OP);
+    if(strcmp(policy, "journal") == 0) {
+      map_flags |= EXT2_MAP_JOURNAL;
+    }else if(strcmp(policy, "exit") == 0) {
+      map_flags |= EXT2_MAP_SYNC_AT_EXIT;
+    }else if(strcmp(policy, "op") == 0) {
+      map_flags |= EXT2_MAP_SYNC_PER_OP;
+    }else if(strcmp(policy, "none") != 0) {
+      fprintf(stderr, "Error: %s must be journal, none, exit or op\n", EXT2_SYNC_ENV);
+      exit(EXIT_FAILURE);
+    }
+  }
+  const char *backend = getenv(EXT2_IO_ENV);
+  if(backend != NULL) {
+    if(strcmp(backend, "pread") == 0) {
+      map_flags |= EXT2_MAP_PREAD;
+    }else if(strcmp(backend, "mmap") == 0) {
+      map_flags &= ~EXT2_MAP_PREAD;
+    }else{
+      fprintf(stderr, "Error: %s must be mmap or pread\n", EXT2_IO_ENV);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  const char *cache_blocks = getenv(EXT2_CACHE_BLOCKS_ENV);
+  const char *cache_policy = getenv(EXT2_CACHE_POLICY_ENV);
+  unsigned long max_blocks = EXT2_CACHE_DEFAULT_BLOCKS;
+  int replacement = EXT2_CACHE_LRU;
+  if(cache_blocks != NULL) {
+    char *end;
+    errno = 0;
+    max_blocks = strtoul(cache_blocks, &end, 10);
+    if(*cache_blocks == '\0' || *end != '\0' || errno != 0 || max_blocks == 0 || max_blocks > UINT32_MAX) {
+      fprintf(stderr, "Error: %s must be a number of blocks greater than 0\n", EXT2_CACHE_BLOCKS_ENV);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if(cache_policy != NULL) {
+    if(strcmp(cache_policy, "clock") == 0) {
+      replacement = EXT2_CACHE_CLOCK;
+    }else if(strcmp(cache_policy, "lru") != 0) {
+      fprintf(stderr, "Error: %s must be lru or clock\n", EXT2_CACHE_POLICY_ENV);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  struct ext2_image *image;
+  int result = ext2_open_image(image_path, map_flags, &image);
+  if(result != EXIT_SUCCESS) {
+    fprintf(stderr, "Error: load_image() cannot load %s: %s\n", image_path, strerror(result));
+    exit(result == EINVAL || result == ENOMEM ? EXIT_FAILURE : ENOENT);
+  }
+  ext2_configure_cache(image, (unsigned int) max_blocks, replacement);
+  exit_image = image;
+  //Registered first, so the counters are printed after the changes are written back
+  if(getenv(EXT2_CACHE_STATS_ENV) != NULL) {
+    atexit(print_cache_stats);
+  }
+  if(!(map_flags & EXT2_MAP_READ_ONLY)) {
+    atexit(sync_at_exit);
+  }
+}
+
+//Blocks read on this thread inside a block scope, put back when their scope ends, see begin_block_scope()
+//The first ones need no allocation, the rest only lives while a long walk goes on
+#define SCOPE_FIRST_BLOCKS 64
+static __thread unsigned int scope_first_blocks[SCOPE_FIRST_BLOCKS];
+static __thread unsigned int *scope_more_blocks;
+static __thread unsigned int scope_more_capacity;
+static __thread unsigned int scope_count;
+static __thread unsigned int scope_depth;
+
+/**
+ *This function records the block in the block scope of this thread.
+ *Without memory to record it, the block stays pinned until the end of the operation.
+ */
+static void record_scope_block(unsigned int block_num) {
+    if(scope_count < SCOPE_FIRST_BLOCKS){
+        scope_first_blocks[scope_count++] = block_num;
+        return;
+    }
+    if(scope_count - SCOPE_FIRST_BLOCKS == scope_more_capacity){
+        unsigned int capacity = scope_more_capacity == 0 ? SCOPE_FIRST_BLOCKS : scope_more_capacity * 2;
+        unsigned int *blocks = realloc(scope_more_blocks, capacity * sizeof(unsigned int));
+        if(blocks == NULL){
+            return;
+        }
+        scope_more_blocks = blocks;
+        scope_more_capacity = capacity;
+    }
+    scope_more_blocks[scope_count++ - SCOPE_FIRST_BLOCKS] = block_num;
+}
+
+/**
+ *This function returns the slot of the i-th block recorded in the block scope of this thread
+ */
+static unsigned int *scope_block_slot(unsigned int i) {
+    return i < SCOPE_FIRST_BLOCKS ? &scope_first_blocks[i] : &scope_more_blocks[i - SCOPE_FIRST_BLOCKS];
+}
+
+/**
+ *This function forgets the last record of the block in the block scope of this thread, it was put already
+ *It returns TRUE if the block was recorded, FALSE otherwise
+ */
+static int forget_scope_block(unsigned int block_num) {
+    unsigned int i = scope_count;
+    while(i > 0){
+        i--;
+        if(*scope_block_slot(i) == block_num){
+            *scope_block_slot(i) = *scope_block_slot(scope_count - 1);
+            scope_count--;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ *This function sets data to the pointer to the block given its block number.
+ *It stays valid until put_block(), release_block(), the end of the block scope it was read in
+ *or the end of the operation, see ext2_end_operation()
+ *It returns EXIT_SUCCESS, or the errno of the failing read of the image (pread backend only).
+ */
+int read_block(unsigned int block_num, unsigned char **data) {
+    int result = current_image->im_io->get_block(current_image, block_num, data);
+    if(result == EXIT_SUCCESS && scope_depth > 0){
+        record_scope_block(block_num);
+    }
+    return result;
+}
+
+/**
+ *This function returns the pointer to the block given its block number, like read_block().
+ *A read error cannot be returned through it: the operation is aborted, see ext2_abort()
+ */
+unsigned char *get_block(unsigned int block_num) {
+    unsigned char *data;
+    int result = read_block(block_num, &data);
+    if(result != EXIT_SUCCESS) {
+        fprintf(stderr, "Error: cannot read block %u of the image: %s\n", block_num, strerror(result));
+        ext2_abort(EXIT_FAILURE);
+    }
+    return data;
+}
+
+/**
+ *This function tells the image that the caller is done with one pointer it got from get_block() for the block.
+ *The buffer cache of the pread backend can reuse the buffer once every such pointer is put.
+ */
+void put_block(unsigned int block_num) {
+    current_image->im_io->put_block(current_image, block_num);
+    if(scope_depth > 0){
+        forget_scope_block(block_num);
+    }
+}
+
+/**
+ *This function tells the image that the caller is done with the block it got from get_block(),
+ *so that the buffer cache of the pread backend can reuse its buffer. The block must not be in use
+ *through another pointer: the pointers to a block are all released at once.
+ */
+void release_block(unsigned int block_num) {
+    current_image->im_io->release_block(current_image, block_num);
+    //None of its pointers is left for the scopes to put back
+    while(scope_depth > 0 && forget_scope_block(block_num)){
+        continue;
+    }
+}
+
+/**
+ *This function returns how many blocks from get_block() a caller may hold at once: wanted,
+ *or half of the buffer cache of the pread backend if that is less, so that the rest of the operation still fits.
+ */
+unsigned int held_blocks_limit(unsigned int wanted) {
+    struct ext2_cache_stats stats;
+    ext2_get_cache_stats(current_image, &stats);
+    if(stats.max_buffers == 0 || stats.max_buffers / 2 >= wanted){
+        return wanted;
+    }
+    return stats.max_buffers / 2 > 0 ? stats.max_buffers / 2 : 1;
+}
+
+/**
+ *This function starts a block scope on this thread: every block get_block() returns from now on
+ *is put back by end_block_scope(), so a walk over many blocks only keeps the ones it is still using.
+ *Scopes nest. It returns the scope to give to end_block_scope().
+ */
+unsigned int begin_block_scope(void) {
+    scope_depth++;
+    return scope_count;
+}
+
+/**
+ *This function ends the block scope: the pointers get_block() returned inside it must not be used any more,
+ *unless the block was also taken before the scope began
+ */
+void end_block_scope(unsigned int scope) {
+    while(scope_count > scope){
+        scope_count--;
+        current_image->im_io->put_block(current_image, *scope_block_slot(scope_count));
+    }
+    if(--scope_depth == 0){
+        free(scope_more_blocks);
+        scope_more_blocks = NULL;
+        scope_more_capacity = 0;
+    }
+}
+
+/**
+ *This function returns the number of the block that holds the given address of the image,
+ *or 0 if the address is not inside a block of the image
+ */
+unsigned int block_num_of(const void *address) {
+    return current_image->im_io->block_num_of(current_image, address);
+}
+
+/**
+ *This function returns the group number that the given inode belongs to
+ */
+unsigned int group_of_inode(unsigned int inode_num) {
+    return (inode_num - 1) / sb->s_inodes_per_group;
+}
+
+/**
+ *This function returns the group number that the given block belongs to
+ */
+unsigned int group_of_block(unsigned int block_num) {
+    return (block_num - sb->s_first_data_block) / sb->s_blocks_per_group;
+}
+
+/**
+ *This function returns the number of blocks in the given group
+ *The last group may be smaller than s_blocks_per_group
+ */
+unsigned int blocks_in_group(unsigned int group) {
+    unsigned int first_block = sb->s_first_data_block + group * sb->s_blocks_per_group;
+    unsigned int remaining = sb->s_blocks_count - first_block;
+    return remaining < sb->s_blocks_per_group ? remaining : sb->s_blocks_per_group;
+}
+
+/**
+ *This function returns the pointer to the inode bitmap of the given group
+ */
+unsigned char *get_inode_bitmap(unsigned int group) {
+    return get_block(gd[group].bg_inode_bitmap);
+}
+
+/**
+ *This function returns the pointer to the block bitmap of the given group
+ */
+unsigned char *get_block_bitmap(unsigned int group) {
+    
+    return get_block(gd[group].bg_block_bitmap);
+}
+
+/**
+ *This function returns the pointer to the inode table of the given group
+ *Notice: use get_inode() to index into the table since the on-disk inode size may be larger than struct ext2_inode,
+ *and only the first block of the table is in memory with it when the image is read with the pread backend
+ */
+struct ext2_inode *get_inode_table(unsigned int group) {
+    
+    return (struct ext2_inode *)get_block(gd[group].bg_inode_table);
+}
+
+/**
+ *This function returns the pointer to the inode given its number (NUMBER = INDEX + 1)
+ *Callers that change the inode through this pointer mark it with mark_inode_dirty()
+ */
+struct ext2_inode *get_inode(unsigned int inode_num) {
+
+    unsigned int group = group_of_inode(inode_num);
+    unsigned int index = (inode_num - 1) % sb->s_inodes_per_group;//Index inside the group
+
+    //Inodes never cross a block, so only the block holding this one is needed
+    size_t offset = (size_t) index * inode_size;
+    unsigned char *block = get_block(gd[group].bg_inode_table + offset / EXT2_BLOCK_SIZE);
+    return (struct ext2_inode *)(block + offset % EXT2_BLOCK_SIZE);
+}
+
+/**
+ *This function puts back the block of the inode taken by get_inode(), see put_block()
+ */
+void put_inode(unsigned int inode_num) {
+
+    unsigned int group = group_of_inode(inode_num);
+    unsigned int index = (inode_num - 1) % sb->s_inodes_per_group;
+    put_block(gd[group].bg_inode_table + (size_t) index * inode_size / EXT2_BLOCK_SIZE);
+}
+
+/**
+ *This function marks the inode as changed for the next sync, see mark_dirty()
+ */
+void mark_inode_dirty(struct ext2_inode *inode) {
+    mark_dirty(inode, inode_size);
+}
+
+/**
+ *This function returns a character ('l', 'f', 'd' or 'o') represent the type of the given inode.
+ */
+char get_inode_type(struct ext2_inode *inode){
+    
+    unsigned short imode = inode->i_mode;
+
+    if((imode & EXT2_S_IFLNK) == EXT2_S_IFLNK){
+        return 'l'; //symbolic link
+    }else if((imode & EXT2_S_IFREG) == EXT2_S_IFREG){
+        return 'f'; //regular file
+    }else if((imode & EXT2_S_IFDIR) == EXT2_S_IFDIR){
+        return 'd'; //directory
+    }else{
+        return 'o'; //other types
+    }
+}
+
+/**
+ *This function returns the inode number of the given inode. (NUMBER = INDEX + 1)
+ *It returns 0 if the inode is not inside any inode table
+ */
+int inode_num_of(struct ext2_inode *inode){
+    
+    unsigned int block_num = block_num_of(inode);
+    if(block_num == 0){
+        return 0;
+    }
+    size_t offset_in_block = (unsigned char *)inode - get_block(block_num);
+    put_block(block_num);
+    unsigned int table_blocks = ((size_t) sb->s_inodes_per_group * inode_size + EXT2_BLOCK_SIZE - 1) / EXT2_BLOCK_SIZE;
+
+    unsigned int group;
+    for(group = 0; group < groups_count; group++){
+        unsigned int table_start = gd[group].bg_inode_table;
+
+        if(block_num >= table_start && block_num < table_start + table_blocks){
+            size_t offset = (size_t)(block_num - table_start) * EXT2_BLOCK_SIZE + offset_in_block;
+            return group * sb->s_inodes_per_group + offset / inode_size + 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ *This function returns the number of data blocks a block pointer at the given level covers
+ *Level 0 points to data, level 1 to an indirect block, level 2 to a double indirect block...
+ */
+static unsigned int span_of_level(int level){
+    unsigned int span = 1;
+    while(level-- > 0){
+        span *= EXT2_ADDR_PER_BLOCK;
+    }
+    return span;
+}
+
+/**
+ *This function returns the i_block slot or the pointer block entry that holds the physical block number
+ *of the logical block (index inside the file) of the inode.
+ *Missing pointer blocks on the way are allocated with alloc_block when it is not NULL, zeroed and counted in i_blocks.
+ *It returns NULL if a pointer block is missing (a hole), if the allocation fails or if the index is too large.
+ */
+static unsigned int *find_block_slot(struct ext2_inode *inode, unsigned int logical, int (*alloc_block)()){
+
+    //Find which i_block slot covers the logical block and how many levels of pointer blocks are below it
+    unsigned int *slot;
+    int level;
+    if(logical < EXT2_DIRECT_BLOCK_NUM){
+        slot = &inode->i_block[logical];
+        level = 0;
+    }else{
+        logical -= EXT2_DIRECT_BLOCK_NUM;
+        level = 1;
+        while(level <= 3 && logical >= span_of_level(level)){
+            logical -= span_of_level(level);
+            level++;
+        }
+        if(level > 3){
+            //Beyond the triple indirect block
+            return NULL;
+        }
+        slot = &inode->i_block[EXT2_IND_BLOCK + level - 1];
+    }
+
+    //Walk down the pointer blocks
+    while(level > 0){
+        if(*slot == 0){
+            if(alloc_block == NULL){
+                return NULL;
+            }
+            int block_num = alloc_block();
+            if(block_num == 0){
+                return NULL;
+            }
+            //A new pointer block must not point anywhere yet
+            memset(get_block(block_num), 0, EXT2_BLOCK_SIZE);
+            mark_block_dirty(block_num);
+            *slot = block_num;
+            mark_dirty(slot, sizeof(unsigned int));
+            inode->i_blocks += EXT2_BLOCK_SIZE / EXT2_SECTOR_SIZE;
+            mark_inode_dirty(inode);
+        }
+
+        level--;
+        unsigned int *pointers = (unsigned int *)get_block(*slot);
+        slot = &pointers[(logical / span_of_level(level)) % EXT2_ADDR_PER_BLOCK];
+    }
+    return slot;
+}
+
+/**
+ *This function returns the physical block number of the logical block (index inside the file) of the inode.
+ *If the block (or any pointer block on the way to it) is not allocated and alloc_block is not NULL,
+ *it is allocated with alloc_block, linked into the inode and counted in i_blocks.
+ *Pointer blocks are allocated before the data they point to, so a file written in order is laid out sequentially.
+ *It returns 0 if the block is not mapped (a hole), if the allocation fails or if the index is too large.
+ */
+unsigned int map_block(struct ext2_inode *inode, unsigned int logical, int (*alloc_block)()){
+
+    //The pointer blocks on the way are only used here
+    unsigned int scope = begin_block_scope();
+    unsigned int *slot = find_block_slot(inode, logical, alloc_block);
+    unsigned int block_num = slot == NULL ? 0 : *slot;
+    if(slot != NULL && block_num == 0 && alloc_block != NULL){
+        block_num = alloc_block();
+        if(block_num != 0){
+            *slot = block_num;
+            mark_dirty(slot, sizeof(unsigned int));
+            inode->i_blocks += EXT2_BLOCK_SIZE / EXT2_SECTOR_SIZE;
+            mark_inode_dirty(inode);
+        }
+    }
+    end_block_scope(scope);
+    return block_num;
+}
+
+/**
+ *This function points the logical block of the inode at block_num, which may be 0 to punch a hole.
+ *i_blocks is updated, but no bitmap is touched: the caller owns both the old and the new block.
+ *The pointer blocks leading to the logical block must already exist.
+ *It returns the block the logical block used to be mapped to (0 if it was a hole).
+ */
+unsigned int remap_block(struct ext2_inode *inode, unsigned int logical, unsigned int block_num){
+
+    unsigned int scope = begin_block_scope();
+    unsigned int *slot = find_block_slot(inode, logical, NULL);
+    if(slot == NULL){
+        end_block_scope(scope);
+        return 0;
+    }
+    unsigned int old_block = *slot;
+    *slot = block_num;
+    mark_dirty(slot, sizeof(unsigned int));
+    end_block_scope(scope);
+    if(old_block == 0 && block_num != 0){
+        inode->i_blocks += EXT2_BLOCK_SIZE / EXT2_SECTOR_SIZE;
+    }else if(old_block != 0 && block_num == 0){
+        inode->i_blocks -= EXT2_BLOCK_SIZE / EXT2_SECTOR_SIZE;
+    }
+    mark_inode_dirty(inode);
+    return old_block;
+}
+
+/**
+ *This function returns the number of blocks a file with data_blocks data blocks uses,
+ *including the indirect, double indirect and triple indirect pointer blocks.
+ */
+unsigned int blocks_with_pointers(unsigned int data_blocks){
+    unsigned int total = data_blocks;
+    if(data_blocks <= EXT2_DIRECT_BLOCK_NUM){
+        return total;
+    }
+    unsigned int remaining = data_blocks - EXT2_DIRECT_BLOCK_NUM;
+
+    int level;
+    for(level = 1; level <= 3 && remaining > 0; level++){
+        unsigned int covered = remaining < span_of_level(level) ? remaining : span_of_level(level);
+
+        //One pointer block at every level between the i_block slot and the data
+        int sub_level;
+        for(sub_level = 1; sub_level <= level; sub_level++){
+            total += (covered + span_of_level(sub_level) - 1) / span_of_level(sub_level);
+        }
+        remaining -= covered;
+    }
+    return total;
+}
+
+/**
+ *This function starts a walk over all the blocks of the inode.
+ *Use block_iter_next() to get the blocks one by one.
+ */
+void block_iter_init(struct block_iter *iter, struct ext2_inode *inode){
+    iter->inode = inode;
+    iter->slot = 0;
+    iter->depth = 0;
+
+    //Fast symbolic links keep the target path in i_block instead of block numbers
+    if(get_inode_type(inode) == 'l' && inode->i_blocks == 0){
+        iter->slot = EXT2_N_BLOCKS;
+    }
+}
+
+/**
+ *This function returns the next allocated block of the inode in logical order, or 0 when the walk is done.
+ *Pointer blocks are returned before the blocks they point to, and pointer blocks that are 0 are skipped
+ *together with everything below them, so only populated parts of the block map are read.
+ *If logical is not NULL, it is set to the logical index of a data block.
+ *If is_pointer is not NULL, it is set to TRUE for indirect, double and triple indirect blocks.
+ */
+unsigned int block_iter_next(struct block_iter *iter, unsigned int *logical, int *is_pointer){
+
+    while(TRUE){
+        unsigned int block_num;
+        unsigned int block_logical;
+        int level;//Level of the block we are looking at (0 for data)
+
+        if(iter->depth == 0){
+            //Take the next slot in the inode
+            if(iter->slot >= EXT2_N_BLOCKS){
+                return 0;
+            }
+            int slot = iter->slot++;
+            block_num = iter->inode->i_block[slot];
+            if(slot < EXT2_DIRECT_BLOCK_NUM){
+                level = 0;
+                block_logical = slot;
+            }else{
+                level = slot - EXT2_IND_BLOCK + 1;
+                block_logical = EXT2_DIRECT_BLOCK_NUM;
+                int i;
+                for(i = 1; i < level; i++){
+                    block_logical += span_of_level(i);
+                }
+            }
+        }else{
+            //Take the next pointer in the innermost pointer block
+            struct block_iter_frame *frame = &iter->frames[iter->depth - 1];
+            if(frame->index >= EXT2_ADDR_PER_BLOCK){
+                //Done with the pointer block
+                put_block(frame->block_num);
+                iter->depth--;
+                continue;
+            }
+            int index = frame->index++;
+            level = frame->level - 1;
+            block_num = frame->pointers[index];
+            block_logical = frame->first_logical + index * span_of_level(level);
+        }
+
+        //Skip holes and pointers outside of the image
+        if(block_num == 0 || block_num >= sb->s_blocks_count){
+            continue;
+        }
+
+        if(level > 0){
+            //Walk into the pointer block after returning it
+            struct block_iter_frame *frame = &iter->frames[iter->depth++];
+            frame->pointers = (unsigned int *)get_block(block_num);
+            frame->block_num = block_num;
+            frame->index = 0;
+            frame->level = level;
+            frame->first_logical = block_logical;
+        }
+
+        if(logical != NULL){
+            *logical = block_logical;
+        }
+        if(is_pointer != NULL){
+            *is_pointer = level > 0;
+        }
+        return block_num;
+    }
+}
+
+/**
+ *This function returns the size of the file in bytes
+ *Regular files on revision 1 images keep the upper 32 bits of the size in i_dir_acl
+ */
+uint64_t get_inode_size(struct ext2_inode *inode){
+    uint64_t size = inode->i_size;
+    if(sb->s_rev_level > 0 && get_inode_type(inode) == 'f'){
+        size |= (uint64_t) inode->i_dir_acl << 32;
+    }
+    return size;
+}
+
+/**
+ *This function sets the size of the file in bytes
+ *Sizes of 4GB or more need the large file feature on the image
+ */
+void set_inode_size(struct ext2_inode *inode, uint64_t size){
+    inode->i_size = (unsigned int) size;
+    if(sb->s_rev_level > 0 && get_inode_type(inode) == 'f'){
+        inode->i_dir_acl = (unsigned int)(size >> 32);
+        if(size >> 32){
+            sb->s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+            mark_dirty(sb, sizeof(struct ext2_super_block));
+        }
+    }
+    mark_inode_dirty(inode);
+}
+
+
+/**
+ * Check whether the file path starts with a '/'
+ */
+
+//static int is_absolute_path(const char *path) {
+//    return strncmp(path, "/", 1) == 0;
+//}
+
+/*
+ * This function returns the file name form the path
+ * Input: path to file 
+ * e.g. If the path is '/home/level1/level2/file_name', it should return 'file_name'
+ */
+char *get_file_name(char *path_to_file) {
+
+    //Split the caller's copy of the path, the name must outlive this function
+    //strtok_r() keeps its position in save_ptr, so threads on other images can split paths at the same time
+    char *save_ptr;
+    char *token = strtok_r(path_to_file, "/", &save_ptr);
+    char *next_token = token;
+    
+    while (next_token != NULL) {
+        token = next_token;
+        next_token = strtok_r(NULL, "/", &save_ptr);
+    }
+
+    return token;
+}
+
+/*
+ * This function checks whether the resource is in use
+ * Input: bitmap of inodes or blocks; num: the resource number inside the bitmap(index = num - 1)
+ * It eturns 1 if the bit in the bitmap is 1, return 0 otherwise.
+ */
+int check_resource_in_use(unsigned char *bitmap, int num){
+    int index = num - 1;
+    int byte_idx = index / 8;
+    int bit = index % 8;//The offset in the byte
+    char byte = bitmap[byte_idx];//The byte in the bitmap
+    return (byte) & (1 << bit);
+}
+
+/*
+ * This function checks whether the inode is marked as in use in its group's inode bitmap
+ */
+int check_inode_in_use(unsigned int inode_num){
+    unsigned int group = group_of_inode(inode_num);
+    int in_use = check_resource_in_use(get_inode_bitmap(group), inode_num - group * sb->s_inodes_per_group);
+    put_block(gd[group].bg_inode_bitmap);
+    return in_use;
+}
+
+/*
+ * This function checks whether the block is marked as in use in its group's block bitmap
+ */
+int check_block_in_use(unsigned int block_num){
+    unsigned int group = group_of_block(block_num);
+    unsigned int first_block = sb->s_first_data_block + group * sb->s_blocks_per_group;
+    int in_use = check_resource_in_use(get_block_bitmap(group), block_num - first_block + 1);
+    put_block(gd[group].bg_block_bitmap);
+    return in_use;
+}
+
+/**
+ * This function returns the index of the first bit equal to value (0 or 1) in the range [from, to) of the bitmap.
+ * The bitmap is scanned one 64-bit word at a time so that uniform regions are skipped quickly.
+ * It returns -1 if there is no such bit in the range.
+ */
+static int find_bit(unsigned char *bitmap, unsigned int from, unsigned int to, int value){
+    unsigned int i = from;
+    //After the xor, the bits we are looking for become 1
+    uint64_t flip = value ? 0 : UINT64_MAX;
+
+    //Bits before the first word boundary
+    while(i < to && i % 64 != 0){
+        if(((bitmap[i / 8] >> (i % 8)) & 1) == value){
+            return i;
+        }
+        i++;
+    }
+
+    //Whole words. Bitmaps are little endian, so bit i of the word is bit i of the bitmap
+    while(i + 64 <= to){
+        uint64_t word;
+        memcpy(&word, bitmap + i / 8, sizeof(uint64_t));
+        word = le64toh(word) ^ flip;
+        if(word != 0){
+            return i + __builtin_ctzll(word);
+        }
+        i += 64;
+    }
+
+    //Bits after the last whole word
+    while(i < to){
+        if(((bitmap[i / 8] >> (i % 8)) & 1) == value){
+            return i;
+        }
+        i++;
+    }
+
+    return -1;
+}
+
+//Popcount kernels for count_set_bits(). Each counts the bits set in the given number of 64-bit words.
+//The fastest one the CPU supports is picked at run time, the first time count_set_bits() runs.
+static uint64_t popcount_scalar(const unsigned char *bytes, size_t words_count){
+    uint64_t count = 0;
+    size_t i;
+    for(i = 0; i < words_count; i++){
+        uint64_t word;
+        memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(uint64_t));
+        count += __builtin_popcountll(word);
+    }
+    return count;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+//The same loop, where __builtin_popcountll() becomes one POPCNT instruction
+__attribute__((target("popcnt")))
+static uint64_t popcount_popcnt(const unsigned char *bytes, size_t words_count){
+    uint64_t count = 0;
+    size_t i;
+    for(i = 0; i < words_count; i++){
+        uint64_t word;
+        memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(uint64_t));
+        count += __builtin_popcountll(word);
+    }
+    return count;
+}
+
+//32 bytes at a time: every nibble is looked up in a table of bit counts with VPSHUFB,
+//and the byte counts are summed into 64-bit lanes with VPSADBW
+__attribute__((target("avx2,popcnt")))
+static uint64_t popcount_avx2(const unsigned char *bytes, size_t words_count){
+    const __m256i nibble_counts = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                   0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    size_t i;
+    for(i = 0; i + 4 <= words_count; i += 4){
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bytes + i * sizeof(uint64_t)));
+        __m256i low = _mm256_shuffle_epi8(nibble_counts, _mm256_and_si256(v, low_mask));
+        __m256i high = _mm256_shuffle_epi8(nibble_counts, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(low, high), _mm256_setzero_si256()));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, total);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + popcount_popcnt(bytes + i * sizeof(uint64_t), words_count - i);
+}
+
+//64 bytes at a time with VPOPCNTQ
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static uint64_t popcount_avx512(const unsigned char *bytes, size_t words_count){
+    __m512i total = _mm512_setzero_si512();
+    size_t i;
+    for(i = 0; i + 8 <= words_count; i += 8){
+        __m512i v = _mm512_loadu_si512((const void *)(bytes + i * sizeof(uint64_t)));
+        total = _mm512_add_epi64(total, _mm512_popcnt_epi64(v));
+    }
+    return _mm512_reduce_add_epi64(total) + popcount_popcnt(bytes + i * sizeof(uint64_t), words_count - i);
+}
+#endif
+
+static uint64_t (*popcount_kernel)(const unsigned char *bytes, size_t words_count);
+
+//This function picks the popcount kernel for the CPU
+static void select_popcount_kernel(){
+    popcount_kernel = popcount_scalar;
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512vpopcntdq")){
+        popcount_kernel = popcount_avx512;
+    }else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")){
+        popcount_kernel = popcount_avx2;
+    }else if(__builtin_cpu_supports("popcnt")){
+        popcount_kernel = popcount_popcnt;
+    }
+#endif
+}
+
+/**
+ * This function returns the number of bits set among the first num_bits bits of the bitmap.
+ * Whole 64-bit words are counted by the popcount kernel selected for the CPU, the bits after them one at a time.
+ */
+uint64_t count_set_bits(const unsigned char *bitmap, uint64_t num_bits){
+    if(popcount_kernel == NULL){
+        select_popcount_kernel();
+    }
+    uint64_t words_count = num_bits / 64;
+    uint64_t count = popcount_kernel(bitmap, words_count);
+    uint64_t i;
+    for(i = words_count * 64; i < num_bits; i++){
+        count += (bitmap[i / 8] >> (i % 8)) & 1;
+    }
+    return count;
+}
+
+/**
+ * This function marks the free counters of the group and of the super block as changed
+ */
+static void mark_counters_dirty(unsigned int group){
+    mark_dirty(&gd[group], sizeof(struct ext2_group_desc));
+    mark_dirty(sb, sizeof(struct ext2_super_block));
+}
+
+/**
+ * This function finds an unused resource(inode or block) in the given bitmap and set it to 1.
+ * Input: bitmap, num_bits (the number of inodes or blocks the bitmap covers)
+ *        and cursor (the index where the search starts, NULL to search from the beginning)
+ * The search starts at the cursor and wraps around, and the cursor is moved past the allocated resource (next-fit).
+ * It returns the coresponding resource number inside the bitmap (Number = Index + 1).
+ * It returns 0 if there is no empty resource.
+ */
+int allocate_resource(unsigned char *bitmap, int num_bits, unsigned int *cursor){
+    unsigned int start = 0;
+    if(cursor != NULL && *cursor < (unsigned int) num_bits){
+        start = *cursor;
+    }
+
+    int index = find_bit(bitmap, start, num_bits, 0);
+    if(index == -1){
+        //Wrap around
+        index = find_bit(bitmap, 0, start, 0);
+    }
+    if(index == -1){
+        //No empty resources
+        return 0;
+    }
+
+    //Set that bit to be 1
+    bitmap[index / 8] |= 1 << (index % 8);
+    mark_dirty(&bitmap[index / 8], 1);
+
+    if(cursor != NULL){
+        *cursor = index + 1;
+    }
+
+    //Return the corresponding inode or block number
+    //Number = Index + 1
+    return index + 1;
+}
+
+/**
+ * This function finds an empty inode and allocates it to the file
+ * Input: the file type(EXT2_FT_UNKNOWN, EXT2_FT_REG_FILE, EXT2_FT_DIR, EXT2_FT_SYMLINK)
+ * It returns the inode number, or 0 if there is no free inode
+ */
+int allocate_inode(unsigned char file_type){
+
+    //Find a group that still has free inodes, starting from the group of the last allocation
+    unsigned int i;
+    unsigned int group = 0;
+    int local_num = 0;
+    for(i = 0; i < groups_count && local_num == 0; i++){
+        group = (inode_group_cursor + i) % groups_count;
+        if(gd[group].bg_free_inodes_count > 0){
+            //One bit in the bitmap represents one inode in this group
+            local_num = allocate_resource(get_inode_bitmap(group), sb->s_inodes_per_group, &inode_cursor[group]);
+            put_block(gd[group].bg_inode_bitmap);
+        }
+    }
+    if(local_num == 0){
+        //No free inodes in any group
+        return 0;
+    }
+    inode_group_cursor = group;
+
+    int inode_num = group * sb->s_inodes_per_group + local_num;
+
+    //Get the corresponding imode
+    unsigned short imode;
+    if(file_type == EXT2_FT_DIR){
+        imode = EXT2_S_IFDIR;
+    }else if(file_type == EXT2_FT_REG_FILE){
+        imode = EXT2_S_IFREG;
+    }else{
+        imode = EXT2_S_IFLNK;
+    }
+    
+    unsigned int current_time = (unsigned int) time(NULL);
+
+    // First clean the allocated inode
+    struct ext2_inode *allocated_inode = get_inode(inode_num);
+    memset(allocated_inode, 0, inode_size);
+
+    //Update inode information
+    allocated_inode->i_mode  |= imode;
+    allocated_inode->i_ctime = current_time;
+    allocated_inode->i_atime = current_time;
+    allocated_inode->i_mtime = current_time;
+    mark_inode_dirty(allocated_inode);
+    put_inode(inode_num);
+
+    //Update infomation in group descipher and super block
+    gd[group].bg_free_inodes_count--;
+    sb->s_free_inodes_count--;
+    mark_counters_dirty(group);
+
+    return inode_num;
+}
+
+/**
+ * This function finds an empty block and returns its number
+ * It returns 0 if there is no free block
+ */
+int allocate_block(){
+
+    //Find a group that still has free blocks, starting from the group of the last allocation
+    unsigned int i;
+    unsigned int group = 0;
+    int local_num = 0;
+    for(i = 0; i < groups_count && local_num == 0; i++){
+        group = (block_group_cursor + i) % groups_count;
+        if(gd[group].bg_free_blocks_count > 0){
+            // One bit in the bitmap represents one block in this group
+            local_num = allocate_resource(get_block_bitmap(group), blocks_in_group(group), &block_cursor[group]);
+            put_block(gd[group].bg_block_bitmap);
+        }
+    }
+    if(local_num == 0){
+        //No free blocks in any group
+        return 0;
+    }
+    block_group_cursor = group;
+
+    int block_num = sb->s_first_data_block + group * sb->s_blocks_per_group + local_num - 1;
+
+    // Clean the allocated block
+    unsigned char *new_block = get_block(block_num);
+    memset(new_block, 0, EXT2_BLOCK_SIZE);
+    mark_block_dirty(block_num);
+    put_block(block_num);
+
+    //Update sb and gd information
+    gd[group].bg_free_blocks_count--;
+    sb->s_free_blocks_count--;
+    mark_counters_dirty(group);
+
+    return block_num;
+
+}
+
+/**
+ * This function allocates a run of contiguous blocks for data that is written in block order.
+ * Input: count, the number of blocks wanted; allocated, where the length of the run is stored
+ * It takes the first free run that can hold all count blocks, searching from the allocation cursors.
+ * If there is no such run, it takes the longest free run on the image so that the caller
+ * can ask again for the rest.
+ * Unlike allocate_block(), the blocks are not cleaned since the caller is going to overwrite them.
+ * It returns the first block number of the run, or 0 if there is no free block.
+ */
+int allocate_blocks(unsigned int count, unsigned int *allocated){
+
+    unsigned int best_group = 0;
+    unsigned int best_start = 0;
+    unsigned int best_len = 0;
+    int best_is_at_cursor = FALSE;//Whether the run is the first free run after the group's cursor
+
+    unsigned int i;
+    for(i = 0; i < groups_count && best_len < count; i++){
+        unsigned int group = (block_group_cursor + i) % groups_count;
+        if(gd[group].bg_free_blocks_count == 0){
+            continue;
+        }
+
+        unsigned char *bitmap = get_block_bitmap(group);
+        unsigned int num_bits = blocks_in_group(group);
+        int is_at_cursor = TRUE;
+
+        //Walk the free runs of this group: [run_start, run_end)
+        int run_start = find_bit(bitmap, block_cursor[group], num_bits, 0);
+        while(run_start != -1){
+            int run_end = find_bit(bitmap, run_start, num_bits, 1);
+            if(run_end == -1){
+                run_end = num_bits;
+            }
+
+            unsigned int run_len = run_end - run_start;
+            if(run_len > best_len){
+                best_group = group;
+                best_start = run_start;
+                best_len = run_len;
+                best_is_at_cursor = is_at_cursor;
+            }
+            if(best_len >= count){
+                break;
+            }
+
+            is_at_cursor = FALSE;
+            run_start = find_bit(bitmap, run_end, num_bits, 0);
+        }
+        put_block(gd[group].bg_block_bitmap);
+    }
+
+    if(best_len == 0){
+        //No free blocks in any group
+        *allocated = 0;
+        return 0;
+    }
+    if(best_len > count){
+        best_len = count;
+    }
+
+    //Mark the run as in use
+    unsigned char *bitmap = get_block_bitmap(best_group);
+    unsigned int index;
+    for(index = best_start; index < best_start + best_len; index++){
+        bitmap[index / 8] |= 1 << (index % 8);
+    }
+    mark_dirty(&bitmap[best_start / 8], (best_start + best_len - 1) / 8 - best_start / 8 + 1);
+    put_block(gd[best_group].bg_block_bitmap);
+
+    //Only move the cursor if no free block was skipped, so that the image stays packed from the start
+    if(best_is_at_cursor){
+        block_cursor[best_group] = best_start + best_len;
+    }
+
+    int block_num = sb->s_first_data_block + best_group * sb->s_blocks_per_group + best_start;
+
+    //Update sb and gd information
+    gd[best_group].bg_free_blocks_count -= best_len;
+    sb->s_free_blocks_count -= best_len;
+    mark_counters_dirty(best_group);
+
+    *allocated = best_len;
+    return block_num;
+}
+
+//Path resolution (dentry) cache: maps a name inside a directory to the inode and file type of its entry
+//so that resolving the same path prefixes again does not search the directories again.
+//It is direct mapped: a new name replaces whatever was in its slot.
+//insert_dir_entry() and remove_dir_entry() drop the entry of the name they change
+#define DENTRY_CACHE_SLOTS 4096
+struct dentry_cache_entry {
+    unsigned int parent_inode_num;  //The directory, 0 if the slot is empty
+    unsigned int inode_num;
+    unsigned char file_type;
+    unsigned char name_len;
+    char *name;
+};
+#define dentry_cache (current_image->im_dentry_cache)
+
+//This function allocates the empty dentry cache of the image
+//It returns EXIT_SUCCESS, or ENOMEM if it cannot be allocated
+static int init_dentry_cache(struct ext2_image *image){
+    image->im_dentry_cache = calloc(DENTRY_CACHE_SLOTS, sizeof(struct dentry_cache_entry));
+    return image->im_dentry_cache == NULL ? ENOMEM : EXIT_SUCCESS;
+}
+
+//This function frees the names held by the dentry cache of the image
+static void clear_dentry_cache(struct ext2_image *image){
+    int i;
+    for(i = 0; i < DENTRY_CACHE_SLOTS; i++){
+        free(image->im_dentry_cache[i].name);
+    }
+}
+
+//This function returns the slot of the dentry cache for the name inside the directory
+static struct dentry_cache_entry *dentry_slot(unsigned int parent_inode_num, const char *name, int name_len){
+    //FNV-1a over the directory and the name
+    uint32_t hash = 2166136261u ^ parent_inode_num;
+    int i;
+    for(i = 0; i < name_len; i++){
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    }
+    return &dentry_cache[hash % DENTRY_CACHE_SLOTS];
+}
+
+//This function drops the cached entry of the name inside the directory, if there is one
+static void dentry_cache_drop(unsigned int parent_inode_num, const char *name){
+    int name_len = strlen(name);
+    struct dentry_cache_entry *slot = dentry_slot(parent_inode_num, name, name_len);
+    if(slot->parent_inode_num == parent_inode_num && slot->name_len == name_len && memcmp(slot->name, name, name_len) == 0){
+        slot->parent_inode_num = 0;
+    }
+}
+
+/*
+ * This function looks the name up inside the directory, through the dentry cache
+ * It sets inode_num and file_type from the entry and returns TRUE if the name exists, FALSE otherwise
+ */
+int lookup_entry(unsigned int parent_inode_num, char *name, unsigned int *inode_num, unsigned char *file_type){
+    int name_len = strlen(name);
+    struct dentry_cache_entry *slot = dentry_slot(parent_inode_num, name, name_len);
+    if(slot->parent_inode_num == parent_inode_num && slot->name_len == name_len && memcmp(slot->name, name, name_len) == 0){
+        *inode_num = slot->inode_num;
+        *file_type = slot->file_type;
+        return TRUE;
+    }
+
+    //Only the numbers are kept, so the blocks of the directory are put back right away
+    unsigned int scope = begin_block_scope();
+    struct ext2_dir_entry *entry = find_entry(get_inode(parent_inode_num), name);
+    int found = entry != NULL && entry->inode != 0;
+    if(found){
+        *inode_num = entry->inode;
+        *file_type = entry->file_type;
+    }
+    end_block_scope(scope);
+    if(!found){
+        return FALSE;
+    }
+
+    //Remember the entry
+    char *slot_name = realloc(slot->name, name_len);
+    if(slot_name == NULL){
+        return TRUE;
+    }
+    memcpy(slot_name, name, name_len);
+    slot->name = slot_name;
+    slot->name_len = name_len;
+    slot->parent_inode_num = parent_inode_num;
+    slot->inode_num = *inode_num;
+    slot->file_type = *file_type;
+    return TRUE;
+}
+
+/**
+ * This function finds the second last directory in the path without exiting on errors
+ * It sets parent_inode_num to its inode number and returns EXIT_SUCCESS if successful
+ * Return ENOENT if the path is invalid and EEXIST if the path is root
+ * e.g. If the path is 'home/level1/file1', it finds the inode number of 'level1'
+ * Notice: the path is split in place
+ */
+int find_parent_dir(char *path, unsigned int *parent_inode_num){
+
+    //Check whether the path  is an absolute path
+    if(strncmp(path, "/", 1) != 0){
+        //It is not an absolute path
+        return ENOENT;
+    }
+
+    //Split the target path and store each directory in dir_name
+    char *dir_name;
+    char *save_ptr;
+    dir_name = strtok_r(path, "/", &save_ptr);
+
+    //Check whether the path is root
+    if (dir_name == NULL) {
+       //Path is root
+        return EEXIST;
+    }
+
+    unsigned int inode_num = EXT2_ROOT_INO;//In root
+
+    //After the loop, inode_num would be the inode of the destination directory
+    char *next_dir = strtok_r(NULL, "/", &save_ptr);
+    while(next_dir != NULL){
+
+        // Haven't reach the bottom of the path, the current name must be a directory
+        unsigned int child_inode_num;
+        unsigned char file_type;
+        if(!lookup_entry(inode_num, dir_name, &child_inode_num, &file_type) || file_type != EXT2_FT_DIR){
+            //Invalid path
+            return ENOENT;
+        }
+
+        //Go to next directory along the target path
+        inode_num = child_inode_num;
+        dir_name = next_dir;
+        next_dir = strtok_r(NULL, "/", &save_ptr);
+    }
+
+    *parent_inode_num = inode_num;
+    return EXIT_SUCCESS;
+
+}
+
+/*
+ * This function splits an absolute path into the inode of its parent directory and the file name
+ * file_name must have room for EXT2_NAME_LEN + 1 bytes
+ * It returns EXIT_SUCCESS if successful, ENOENT if the parent directory doesn't exist,
+ * EEXIST if the path is root, or ENAMETOOLONG if the file name is too long
+ */
+int resolve_path(char *path, unsigned int *parent_inode_num, char *file_name){
+
+    //Create a copy of path so that path won't be changed
+    char path_copy[strlen(path) + 1];
+    strcpy(path_copy, path);
+    int result = find_parent_dir(path_copy, parent_inode_num);
+    if(result != EXIT_SUCCESS){
+        return result;
+    }
+
+    strcpy(path_copy, path);
+    char *name = get_file_name(path_copy);
+    if(strlen(name) > EXT2_NAME_LEN){
+        return ENAMETOOLONG;
+    }
+    strcpy(file_name, name);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * This function finds the second last directory in the path
+ * It returns its inode number if successful, or 0 if the path is invalid or is root
+ * e.g. If the path is 'home/level1/file1', it tries to find the inode number of 'level1'
+ */
+int second_last_dir_inode(char *path){
+
+    unsigned int inode_num;
+    if(find_parent_dir(path, &inode_num) != EXIT_SUCCESS){
+        return 0;
+    }
+    return inode_num;
+
+}
+
+
+
+/**
+ * This function initiate a directory entry at the location given by the input 'entry'
+ *
+ */
+void init_dir_entry(struct ext2_dir_entry *entry, unsigned int inode_num, unsigned short rec_len, int name_len, char *name, unsigned char file_type){
+    
+    // Increment inode link count
+    struct ext2_inode *inode = get_inode(inode_num);
+    inode->i_links_count += 1;
+    mark_inode_dirty(inode);
+    //Initialize entry
+    entry->inode = inode_num;
+    entry->rec_len = rec_len;
+    entry->name_len = name_len;
+    entry->file_type = file_type;
+    memcpy(entry->name, name, name_len);//No terminator, it could run into the next entry
+    mark_dirty(entry, actual_entry_len(entry));
+
+
+}
+
+//This function returns the free space at the end of the directory block (the slack after its last entry)
+//and sets largest_gap to the size of its largest free slot: the slack after an entry in use, or the whole of an unused entry
+static unsigned short block_gaps(unsigned int block_num, unsigned short *largest_gap){
+    unsigned char *block = get_block(block_num);
+    int largest = 0;
+    int gap = 0;
+    int curr_len = 0;
+    while(curr_len < EXT2_BLOCK_SIZE){
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *) (block + curr_len);
+        if(entry->rec_len == 0){
+            break;
+        }
+        gap = entry->inode == 0 ? entry->rec_len : entry->rec_len - actual_entry_len(entry);
+        if(gap > largest){
+            largest = gap;
+        }
+        curr_len += entry->rec_len;
+    }
+    put_block(block_num);
+    *largest_gap = largest;
+    return gap;
+}
+
+//Free space summary of a linear directory, so an insert goes straight to a block with room
+//It is built the first time an entry is inserted into the directory, then kept up to date
+//by insert_dir_entry() and remove_dir_entry()
+#define DIR_HINT_SLOTS 64
+struct dir_space_hint {
+    unsigned int inode_num;       //The directory, 0 if the slot is empty
+    unsigned int count;           //Number of blocks described
+    unsigned int *block_nums;     //Physical block of every logical block, 0 for a hole
+    unsigned short *tail_gap;     //Free space after the last entry of every logical block, in bytes
+    unsigned short *largest_gap;  //Largest free slot of every logical block, in bytes
+};
+#define dir_hints (current_image->im_dir_hints)
+
+//This function allocates the empty free space summaries of the image
+//It returns EXIT_SUCCESS, or ENOMEM if they cannot be allocated
+static int init_dir_space_hints(struct ext2_image *image){
+    image->im_dir_hints = calloc(DIR_HINT_SLOTS, sizeof(struct dir_space_hint));
+    return image->im_dir_hints == NULL ? ENOMEM : EXIT_SUCCESS;
+}
+
+//This function frees the free space summaries of the image
+static void clear_dir_space_hints(struct ext2_image *image){
+    int i;
+    for(i = 0; i < DIR_HINT_SLOTS; i++){
+        free(image->im_dir_hints[i].block_nums);
+        free(image->im_dir_hints[i].tail_gap);
+        free(image->im_dir_hints[i].largest_gap);
+    }
+}
+
+//This function forgets the free space summary of the directory
+static void drop_dir_space_hint(unsigned int inode_num){
+    struct dir_space_hint *hint = &dir_hints[inode_num % DIR_HINT_SLOTS];
+    if(hint->inode_num == inode_num){
+        hint->inode_num = 0;
+        hint->count = 0;
+    }
+}
+
+//This function records the block at the logical index of the directory and its largest free slot
+//It returns EXIT_SUCCESS, or ENOMEM if the summary cannot grow: it is dropped then, to be built again
+static int set_dir_space_hint(struct dir_space_hint *hint, unsigned int logical, unsigned int block_num){
+    if(logical >= hint->count){
+        unsigned int *block_nums = realloc(hint->block_nums, (logical + 1) * sizeof(unsigned int));
+        if(block_nums != NULL){
+            hint->block_nums = block_nums;
+        }
+        unsigned short *tail_gap = realloc(hint->tail_gap, (logical + 1) * sizeof(unsigned short));
+        if(tail_gap != NULL){
+            hint->tail_gap = tail_gap;
+        }
+        unsigned short *largest_gap = realloc(hint->largest_gap, (logical + 1) * sizeof(unsigned short));
+        if(largest_gap != NULL){
+            hint->largest_gap = largest_gap;
+        }
+        if(block_nums == NULL || tail_gap == NULL || largest_gap == NULL){
+            drop_dir_space_hint(hint->inode_num);
+            return ENOMEM;
+        }
+        while(hint->count <= logical){
+            hint->block_nums[hint->count] = 0;
+            hint->tail_gap[hint->count] = 0;
+            hint->largest_gap[hint->count] = 0;
+            hint->count++;
+        }
+    }
+    hint->block_nums[logical] = block_num;
+    hint->tail_gap[logical] = 0;
+    hint->largest_gap[logical] = 0;
+    if(block_num != 0){
+        hint->tail_gap[logical] = block_gaps(block_num, &hint->largest_gap[logical]);
+    }
+    return EXIT_SUCCESS;
+}
+
+//This function returns the free space summary of the directory, building it with one pass over its blocks if needed
+//It returns NULL if there is no memory for it
+static struct dir_space_hint *get_dir_space_hint(struct ext2_inode *dir){
+    unsigned int inode_num = inode_num_of(dir);
+    struct dir_space_hint *hint = &dir_hints[inode_num % DIR_HINT_SLOTS];
+    if(hint->inode_num == inode_num){
+        return hint;
+    }
+
+    hint->inode_num = inode_num;
+    hint->count = 0;
+    //Size the arrays for the whole directory once
+    if(dir->i_size >= EXT2_BLOCK_SIZE && set_dir_space_hint(hint, dir->i_size / EXT2_BLOCK_SIZE - 1, 0) != EXIT_SUCCESS){
+        return NULL;
+    }
+    struct block_iter iter;
+    block_iter_init(&iter, dir);
+    unsigned int block_num;
+    unsigned int logical;
+    int is_pointer;
+    while((block_num = block_iter_next(&iter, &logical, &is_pointer)) != 0){
+        if(!is_pointer && logical < hint->count){
+            set_dir_space_hint(hint, logical, block_num);
+        }
+    }
+    return hint;
+}
+
+//This function updates the free space summary of the directory after one of its blocks changed
+static void refresh_dir_space_hint(struct ext2_inode *dir, unsigned int block_num){
+    unsigned int inode_num = inode_num_of(dir);
+    struct dir_space_hint *hint = &dir_hints[inode_num % DIR_HINT_SLOTS];
+    if(hint->inode_num != inode_num){
+        return;
+    }
+    unsigned int i;
+    for(i = 0; i < hint->count; i++){
+        if(hint->block_nums[i] == block_num){
+            set_dir_space_hint(hint, i, block_num);
+            return;
+        }
+    }
+}
+
+//This function puts a new entry in the directory block
+//The slack after the last entry is used first, so that removed entries can still be restored.
+//If it is too small and use_holes is TRUE, the first large enough hole is used:
+//an unused entry, or the slack after an entry in use (left by removed entries)
+//It returns the new entry, or NULL if the block does not have enough room
+static struct ext2_dir_entry *add_entry_to_block(unsigned int block_num, unsigned int finode, char *fname,
+                                                 int name_len, int rec_len, unsigned char ftype, int use_holes){
+
+    unsigned char *block = get_block(block_num);
+    struct ext2_dir_entry *slot = NULL;//The first hole that fits
+    struct ext2_dir_entry *entry = NULL;
+    int curr_len = 0;
+    while(curr_len < EXT2_BLOCK_SIZE){
+        entry = (struct ext2_dir_entry *) (block + curr_len);
+        if(entry->rec_len == 0){
+            return NULL;
+        }
+        int gap = entry->inode == 0 ? entry->rec_len : entry->rec_len - actual_entry_len(entry);
+        if(slot == NULL && gap >= rec_len){
+            slot = entry;
+        }
+        curr_len += entry->rec_len;
+    }
+
+    //entry is the last entry of the block now
+    int last_gap = entry->inode == 0 ? entry->rec_len : entry->rec_len - actual_entry_len(entry);
+    if(last_gap >= rec_len){
+        slot = entry;
+    }else if(!use_holes){
+        return NULL;
+    }
+    if(slot == NULL){
+        return NULL;
+    }
+
+    //Reuse an unused entry in place
+    if(slot->inode == 0){
+        init_dir_entry(slot, finode, slot->rec_len, name_len, fname, ftype);
+        return slot;
+    }
+
+    //Split the slack after an entry in use
+    int actual_len = actual_entry_len(slot);
+    struct ext2_dir_entry *new_entry = (struct ext2_dir_entry *) ((unsigned char *) slot + actual_len);
+    init_dir_entry(new_entry, finode, slot->rec_len - actual_len, name_len, fname, ftype);
+    slot->rec_len = actual_len;
+    mark_dirty(slot, actual_len);
+    return new_entry;
+}
+
+/*
+ * Hashed directory index (htree)
+ *
+ * An indexed directory is still a valid linear directory: every block holds directory entries,
+ * so code that walks the blocks one by one sees every name. Block 0 keeps "." and "..", and ".."
+ * spans the rest of the block to hide the dx_root_info and the index entries behind it.
+ * Index nodes look like one empty entry that covers the whole block.
+ * Every leaf holds the names whose hash falls in its range, so a lookup or an insert
+ * only reads the index and one leaf instead of the whole directory.
+ */
+
+#define DX_ROOT_ENTRIES_OFFSET 24 //"." (12 bytes) and the header of ".." (12 bytes), dx_root_info follows
+#define DX_NODE_ENTRIES_OFFSET 8  //The header of the empty entry covering an index node
+#define DX_ROOT_LIMIT ((EXT2_BLOCK_SIZE - DX_ROOT_ENTRIES_OFFSET - sizeof(struct dx_root_info)) / sizeof(struct dx_entry))
+#define DX_NODE_LIMIT ((EXT2_BLOCK_SIZE - DX_NODE_ENTRIES_OFFSET) / sizeof(struct dx_entry))
+#define DX_MAX_LEVELS 2 //The root and one level of index nodes
+#define DX_HASH_EOF 0x7fffffffU
+
+//One index block on the path from the root to a leaf
+struct dx_frame {
+    struct dx_entry *entries;
+    struct dx_entry *at; //The entry whose range covers the hash
+};
+
+//One entry of a leaf that is being split
+struct dx_map_entry {
+    unsigned int hash;
+    unsigned short offset;
+    unsigned short size;
+};
+
+#define TEA_DELTA 0x9E3779B9
+
+//This function mixes one 16 byte chunk of the name into the hash with the TEA cipher
+static void tea_transform(uint32_t buf[4], const uint32_t in[4]){
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+    int n = 16;
+
+    do{
+        sum += TEA_DELTA;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }while(--n);
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = (a << (s)) | (a >> (32 - (s))))
+#define MD4_K1 0
+#define MD4_K2 013240474631UL
+#define MD4_K3 015666365641UL
+
+//This function mixes one 32 byte chunk of the name into the hash with the reduced MD4 rounds used by ext2
+static void half_md4_transform(uint32_t buf[4], const uint32_t in[8]){
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    MD4_ROUND(MD4_F, a, b, c, d, in[0] + MD4_K1, 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[1] + MD4_K1, 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[2] + MD4_K1, 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[3] + MD4_K1, 19);
+    MD4_ROUND(MD4_F, a, b, c, d, in[4] + MD4_K1, 3);
+    MD4_ROUND(MD4_F, d, a, b, c, in[5] + MD4_K1, 7);
+    MD4_ROUND(MD4_F, c, d, a, b, in[6] + MD4_K1, 11);
+    MD4_ROUND(MD4_F, b, c, d, a, in[7] + MD4_K1, 19);
+
+    MD4_ROUND(MD4_G, a, b, c, d, in[1] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[3] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[5] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+    MD4_ROUND(MD4_G, a, b, c, d, in[0] + MD4_K2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, in[2] + MD4_K2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, in[4] + MD4_K2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+
+    MD4_ROUND(MD4_H, a, b, c, d, in[3] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[7] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+    MD4_ROUND(MD4_H, a, b, c, d, in[1] + MD4_K3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, in[5] + MD4_K3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+//This function is the original ext2 directory hash
+static uint32_t legacy_hash(const char *name, int len, int is_unsigned){
+    uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    int i;
+
+    for(i = 0; i < len; i++){
+        int c = is_unsigned ? (int) (unsigned char) name[i] : (int) (signed char) name[i];
+        hash = hash1 + (hash0 ^ (c * 7152373));
+        if(hash & 0x80000000){
+            hash -= 0x7fffffff;
+        }
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+//This function packs up to num words of the name into buf, padding with the name length
+static void name_to_hash_buf(const char *name, int len, uint32_t *buf, int num, int is_unsigned){
+    uint32_t pad = (uint32_t) len | ((uint32_t) len << 8);
+    pad |= pad << 16;
+
+    uint32_t val = pad;
+    if(len > num * 4){
+        len = num * 4;
+    }
+    int i;
+    for(i = 0; i < len; i++){
+        int c = is_unsigned ? (int) (unsigned char) name[i] : (int) (signed char) name[i];
+        val = c + (val << 8);
+        if(i % 4 == 3){
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if(--num >= 0){
+        *buf++ = val;
+    }
+    while(--num >= 0){
+        *buf++ = pad;
+    }
+}
+
+//This function returns the hash of the name with the given hash version and the seed in the superblock
+//The lowest bit is cleared, index entries use it to mark a hash that continues from the previous leaf
+static unsigned int dx_hash(int version, const char *name, int len){
+
+    //Use the default seed when the superblock has none
+    uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    if(sb->s_hash_seed[0] || sb->s_hash_seed[1] || sb->s_hash_seed[2] || sb->s_hash_seed[3]){
+        memcpy(buf, sb->s_hash_seed, sizeof(buf));
+    }
+
+    int is_unsigned = version >= EXT2_HASH_UNSIGNED;
+    uint32_t in[8];
+    uint32_t hash;
+    switch(version % EXT2_HASH_UNSIGNED){
+        case EXT2_HASH_LEGACY:
+            hash = legacy_hash(name, len, is_unsigned);
+            break;
+        case EXT2_HASH_HALF_MD4:
+            while(len > 0){
+                name_to_hash_buf(name, len, in, 8, is_unsigned);
+                half_md4_transform(buf, in);
+                len -= 32;
+                name += 32;
+            }
+            hash = buf[1];
+            break;
+        default:
+            while(len > 0){
+                name_to_hash_buf(name, len, in, 4, is_unsigned);
+                tea_transform(buf, in);
+                len -= 16;
+                name += 16;
+            }
+            hash = buf[0];
+            break;
+    }
+
+    hash &= ~1;
+    if(hash == (DX_HASH_EOF << 1)){
+        hash = (DX_HASH_EOF - 1) << 1;
+    }
+    return hash;
+}
+
+//This function returns the hash of the name in the indexed directory described by info
+static unsigned int dx_hash_name(struct dx_root_info *info, const char *name, int len){
+    int version = info->hash_version;
+    if(EXT2_SB_FLAGS(sb) & EXT2_FLAGS_UNSIGNED_HASH){
+        version += EXT2_HASH_UNSIGNED;
+    }
+    return dx_hash(version, name, len);
+}
+
+//This function returns the index header of the directory
+//It returns NULL if the directory has no index, or an index this code does not understand,
+//in which case the directory is used as a linear one
+static struct dx_root_info *dx_root_of(struct ext2_inode *dir){
+
+    if(!(dir->i_flags & EXT2_INDEX_FL) || !(sb->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)){
+        return NULL;
+    }
+    unsigned int root_block = map_block(dir, 0, NULL);
+    if(root_block == 0){
+        return NULL;
+    }
+    struct dx_root_info *info = (struct dx_root_info *) (get_block(root_block) + DX_ROOT_ENTRIES_OFFSET);
+    if(info->reserved_zero != 0 || info->info_length != sizeof(struct dx_root_info)
+        || info->indirect_levels >= DX_MAX_LEVELS || info->hash_version > EXT2_HASH_TEA){
+        return NULL;
+    }
+    return info;
+}
+
+//This function walks the index from the root down to the leaf whose range covers the hash
+//frames[0] is the root and frames[levels] the index block that points to the leaf
+//It returns the number of index levels below the root, or -1 if the index is damaged
+static int dx_probe(struct ext2_inode *dir, struct dx_root_info *info, unsigned int hash, struct dx_frame *frames){
+
+    struct dx_entry *entries = (struct dx_entry *) ((unsigned char *) info + info->info_length);
+    int level;
+    for(level = 0; ; level++){
+        struct dx_countlimit *countlimit = (struct dx_countlimit *) entries;
+        if(countlimit->count == 0 || countlimit->count > countlimit->limit){
+            return -1;
+        }
+
+        //Binary search for the last entry whose hash is not above the hash (entry 0 covers everything below)
+        struct dx_entry *low = entries + 1;
+        struct dx_entry *high = entries + countlimit->count - 1;
+        while(low <= high){
+            struct dx_entry *mid = low + (high - low) / 2;
+            if(mid->hash > hash){
+                high = mid - 1;
+            }else{
+                low = mid + 1;
+            }
+        }
+        frames[level].entries = entries;
+        frames[level].at = low - 1;
+
+        if(level == info->indirect_levels){
+            return level;
+        }
+        unsigned int node = map_block(dir, frames[level].at->block, NULL);
+        if(node == 0){
+            return -1;
+        }
+        entries = (struct dx_entry *) (get_block(node) + DX_NODE_ENTRIES_OFFSET);
+    }
+}
 
-        int j;
-        for(j = 0; j < 8; j++){
-            int bit = byte & (1<<j) ? 1 : 0;
+//This function moves the frames to the next leaf if the names with the hash continue there
+//(a leaf split between equal hashes marks the next range with the lowest bit of its hash)
+//It returns TRUE if the frames now point at that leaf, FALSE otherwise
+static int dx_next_leaf(struct ext2_inode *dir, struct dx_frame *frames, int levels, unsigned int hash){
 
-            //Find an unused resource
-            if(bit == 0){
-                //Set that bit to be 1
-                bitmap[i] |= 1 << j;
+    //Find the lowest index block that is not at its last entry
+    int level = levels;
+    while(frames[level].at + 1 >= frames[level].entries + ((struct dx_countlimit *) frames[level].entries)->count){
+        if(level == 0){
+            return FALSE;
+        }
+        level--;
+    }
+    frames[level].at++;
+    if((frames[level].at->hash & ~1) != hash){
+        return FALSE;
+    }
 
-                //Return the corresponding inode or block number
-                //Number = Index + 1
-                return (i * 8 + j + 1);
-            }
+    //Go down to the first entry of the index nodes below
+    while(level < levels){
+        unsigned int node = map_block(dir, frames[level].at->block, NULL);
+        if(node == 0){
+            return FALSE;
         }
+        level++;
+        frames[level].entries = (struct dx_entry *) (get_block(node) + DX_NODE_ENTRIES_OFFSET);
+        frames[level].at = frames[level].entries;
     }
-    //No empty resources
-    exit(ENOMEM);
+    return TRUE;
 }
 
-/**
- * This function finds an empty inode and allocates it to the file
- * Input: the file type(EXT2_FT_UNKNOWN, EXT2_FT_REG_FILE, EXT2_FT_DIR, EXT2_FT_SYMLINK)
- * It returns the inode number
- */
-int allocate_inode(unsigned char file_type){
+//This function adds an index entry for the block at logical index 'block' right after frame->at
+//The caller makes sure the index block has room
+static void dx_insert_index(struct dx_frame *frame, unsigned int hash, unsigned int block){
+    struct dx_countlimit *countlimit = (struct dx_countlimit *) frame->entries;
+    struct dx_entry *new_entry = frame->at + 1;
 
-    unsigned char *inode_bitmap = get_inode_bitmap();
-    int inodes_count = sb->s_inodes_count;
-    
-    //The number of byte in the bitmap == inodes_count / 8 
-    //One byte represents 8 inodes
-    int inode_num = allocate_resource(inode_bitmap, inodes_count/8);
+    memmove(new_entry + 1, new_entry, (frame->entries + countlimit->count - new_entry) * sizeof(struct dx_entry));
+    new_entry->hash = hash;
+    new_entry->block = block;
+    countlimit->count++;
+    mark_dirty(frame->entries, countlimit->count * sizeof(struct dx_entry));
+}
 
-    //Get the corresponding imode
-    unsigned short imode;
-    if(file_type == EXT2_FT_DIR){
-        imode = EXT2_S_IFDIR;
-    }else if(file_type == EXT2_FT_REG_FILE){
-        imode = EXT2_S_IFREG;
-    }else{
-        imode = EXT2_S_IFLNK;
+//This function appends a new block to the directory
+//It returns the block number and sets logical to its index inside the directory, or returns 0 if there is no free block
+static unsigned int dx_append_block(struct ext2_inode *dir, unsigned int *logical){
+    *logical = dir->i_size / EXT2_BLOCK_SIZE;
+    unsigned int block_num = map_block(dir, *logical, allocate_block);
+    if(block_num != 0){
+        dir->i_size += EXT2_BLOCK_SIZE;
+        mark_inode_dirty(dir);
     }
-    
-    unsigned int current_time = (unsigned int) time(NULL);
-
-    // First clean the allocated inode
-    struct ext2_inode *allocated_inode = get_inode_table() + inode_num - 1;
-    memset(allocated_inode, 0, sizeof(struct ext2_inode));
+    return block_num;
+}
 
-    //Update inode information
-    allocated_inode->i_mode  |= imode;
-    allocated_inode->i_ctime = current_time;
-    allocated_inode->i_atime = current_time;
-    allocated_inode->i_mtime = current_time;
+//This function writes the given entries (copied from 'from') one after another into the block 'to'
+//The last entry covers the rest of the block. With no entry, the block holds one empty entry
+static void dx_pack_entries(unsigned char *to, unsigned char *from, struct dx_map_entry *map, int count){
+    mark_dirty(to, EXT2_BLOCK_SIZE);
+    struct ext2_dir_entry *entry = (struct ext2_dir_entry *) to;
+    int offset = 0;
+    int i;
 
-    //Update infomation in group descipher and super block
-    gd->bg_free_inodes_count--;
-    sb->s_free_inodes_count--;
+    if(count == 0){
+        memset(entry, 0, sizeof(struct ext2_dir_entry));
+        entry->rec_len = EXT2_BLOCK_SIZE;
+        return;
+    }
+    for(i = 0; i < count; i++){
+        entry = (struct ext2_dir_entry *) (to + offset);
+        memcpy(entry, from + map[i].offset, map[i].size);
+        entry->rec_len = map[i].size;
+        offset += map[i].size;
+    }
+    entry->rec_len += EXT2_BLOCK_SIZE - offset;
+}
 
-    return inode_num;
+//This function collects the entries in use in the block from offset start, with their hash when info is not NULL
+//It returns the number of entries
+static int dx_map_block(unsigned char *block, int start, struct dx_root_info *info, struct dx_map_entry *map){
+    int count = 0;
+    int curr_len = start;
+    while(curr_len < EXT2_BLOCK_SIZE){
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *) (block + curr_len);
+        if(entry->rec_len == 0){
+            break;
+        }
+        if(entry->inode != 0){
+            map[count].hash = info != NULL ? dx_hash_name(info, entry->name, entry->name_len) : 0;
+            map[count].offset = curr_len;
+            map[count].size = actual_entry_len(entry);
+            count++;
+        }
+        curr_len += entry->rec_len;
+    }
+    return count;
 }
 
-/**
- * This function finds an empty block and returns its number
- */
-int allocate_block(){
-    
-    unsigned char *block_bitmap = get_block_bitmap();
-    int blocks_count = sb->s_blocks_count;
+static int dx_compare_hash(const void *a, const void *b){
+    unsigned int hash_a = ((const struct dx_map_entry *) a)->hash;
+    unsigned int hash_b = ((const struct dx_map_entry *) b)->hash;
+    return hash_a < hash_b ? -1 : hash_a > hash_b;
+}
 
-    // Number of bytes of the bitmap is blocks_count/8
-    int block_num = allocate_resource(block_bitmap, blocks_count/8);
+//This function splits a full leaf: its entries are sorted by hash and the upper half (by size) moves to a new leaf
+//frame is the index block pointing to the leaf, it must have room for one more entry
+//It returns EXIT_SUCCESS, ENOMEM if there is no free block, or ENOSPC if the leaf cannot be split
+static int dx_split_leaf(struct ext2_inode *dir, struct dx_root_info *info, struct dx_frame *frame, unsigned int leaf_block){
 
-    // Clean the allocated block
-    unsigned char *new_block = disk + (block_num * EXT2_BLOCK_SIZE);
-    memset(new_block, 0, EXT2_BLOCK_SIZE);
+    unsigned char leaf_copy[EXT2_BLOCK_SIZE];
+    struct dx_map_entry map[EXT2_BLOCK_SIZE / sizeof(struct ext2_dir_entry)];
+    memcpy(leaf_copy, get_block(leaf_block), EXT2_BLOCK_SIZE);
 
-    //Update sb and gd information
-    gd->bg_free_blocks_count--;
-    sb->s_free_blocks_count--;
+    int count = dx_map_block(leaf_copy, 0, info, map);
+    if(count < 2){
+        return ENOSPC;
+    }
+    qsort(map, count, sizeof(struct dx_map_entry), dx_compare_hash);
 
-    return block_num;
+    //Find the middle by size
+    int total_size = 0;
+    int i;
+    for(i = 0; i < count; i++){
+        total_size += map[i].size;
+    }
+    int split;
+    int lower_size = 0;
+    for(split = 0; split < count - 1 && lower_size + map[split].size <= total_size / 2; split++){
+        lower_size += map[split].size;
+    }
+    if(split == 0){
+        split = 1;
+    }
+    unsigned int split_hash = map[split].hash;
+    if(map[split - 1].hash == split_hash){
+        //Names with this hash continue in the new leaf
+        split_hash |= 1;
+    }
 
+    unsigned int new_logical;
+    unsigned int new_block = dx_append_block(dir, &new_logical);
+    if(new_block == 0){
+        return ENOMEM;
+    }
+    dx_pack_entries(get_block(leaf_block), leaf_copy, map, split);
+    dx_pack_entries(get_block(new_block), leaf_copy, map + split, count - split);
+    dx_insert_index(frame, split_hash, new_logical);
+    return EXIT_SUCCESS;
 }
 
-/**
- * This function finds the second last directory in the path
- * It returns its inode number if successful
- * Return ENOENT if the path is invalid
- * e.g. If the path is 'home/level1/file1', it tries to find the inode number of 'level1'
- */
-int second_last_dir_inode(char *path){
+//This function makes room in the full index block frames[levels]
+//A full root moves its entries to a new index node, a full index node is split in half into the root
+//It returns EXIT_SUCCESS, ENOMEM if there is no free block, or ENOSPC if the index cannot grow any more
+static int dx_grow_index(struct ext2_inode *dir, struct dx_root_info *info, struct dx_frame *frames, int levels){
 
-    //Check whether the path  is an absolute path
-    if(strncmp(path, "/", 1) != 0){
-        //It is not an absolute path
-        exit(ENOENT);
+    struct dx_countlimit *root_countlimit = (struct dx_countlimit *) frames[0].entries;
+    if(levels > 0 && root_countlimit->count == root_countlimit->limit){
+        //Both levels are full
+        return ENOSPC;
     }
 
-    //Check whether the path is root 
-    if (strcmp("/", path) == 0) {
-       //Path is root
-        exit(EEXIST);
+    unsigned int node_logical;
+    unsigned int node_block = dx_append_block(dir, &node_logical);
+    if(node_block == 0){
+        return ENOMEM;
     }
+    unsigned char *node = get_block(node_block);
+    mark_block_dirty(node_block);
+    mark_dirty(frames[0].entries, sizeof(struct dx_entry));
+    memset(node, 0, DX_NODE_ENTRIES_OFFSET);
+    ((struct ext2_dir_entry *) node)->rec_len = EXT2_BLOCK_SIZE;
+    struct dx_entry *node_entries = (struct dx_entry *) (node + DX_NODE_ENTRIES_OFFSET);
+    struct dx_countlimit *node_countlimit = (struct dx_countlimit *) node_entries;
 
-    struct ext2_inode *inodes = get_inode_table();
+    if(levels == 0){
+        //Move all the root entries one level down
+        memcpy(node_entries, frames[0].entries, root_countlimit->count * sizeof(struct dx_entry));
+        node_countlimit->limit = DX_NODE_LIMIT;
+        root_countlimit->count = 1;
+        frames[0].entries[0].block = node_logical;
+        info->indirect_levels = 1;
+        return EXIT_SUCCESS;
+    }
 
-    //Split the target path and store each directory in dir_name
-    char *dir_name;
-    dir_name = strtok(path, "/");
+    //Move the upper half of the full node to the new node
+    struct dx_countlimit *full_countlimit = (struct dx_countlimit *) frames[1].entries;
+    int keep = full_countlimit->count / 2;
+    mark_dirty(full_countlimit, sizeof(struct dx_entry));
+    int moved = full_countlimit->count - keep;
+    unsigned int split_hash = frames[1].entries[keep].hash;
+    memcpy(node_entries, frames[1].entries + keep, moved * sizeof(struct dx_entry));
+    node_countlimit->limit = DX_NODE_LIMIT;
+    node_countlimit->count = moved;
+    full_countlimit->count = keep;
+    dx_insert_index(&frames[0], split_hash, node_logical);
+    return EXIT_SUCCESS;
+}
 
+//This function turns a linear directory with one full block into an indexed directory:
+//the entries move to a new leaf and block 0 becomes the root of the index
+//It returns the new index header, or NULL if the directory cannot be indexed
+static struct dx_root_info *dx_make_indexed(struct ext2_inode *dir){
 
-    struct ext2_inode *curr_inode = &inodes[EXT2_ROOT_INO - 1];//In root
-    struct ext2_dir_entry *curr_entry = find_entry(curr_inode, dir_name);//Search in root
+    if(!(sb->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) || sb->s_def_hash_version > EXT2_HASH_TEA){
+        return NULL;
+    }
+    unsigned char *root = get_block(map_block(dir, 0, NULL));
+    struct ext2_dir_entry *dot = (struct ext2_dir_entry *) root;
+    if(dot->name_len != 1 || dot->name[0] != '.' || dot->rec_len >= EXT2_BLOCK_SIZE){
+        return NULL;
+    }
+    struct ext2_dir_entry *dotdot = (struct ext2_dir_entry *) (root + dot->rec_len);
+    if(dotdot->name_len != 2 || strncmp(dotdot->name, "..", 2) != 0){
+        return NULL;
+    }
 
-    int inode_num = EXT2_ROOT_INO;
+    //Move every entry after ".." to the first leaf
+    unsigned int leaf_logical;
+    unsigned int leaf_block = dx_append_block(dir, &leaf_logical);
+    if(leaf_block == 0){
+        return NULL;
+    }
+    struct dx_map_entry map[EXT2_BLOCK_SIZE / sizeof(struct ext2_dir_entry)];
+    int count = dx_map_block(root, dot->rec_len + dotdot->rec_len, NULL, map);
+    dx_pack_entries(get_block(leaf_block), root, map, count);
 
-    //After the loop, curr_inode would be the inode of the destination directory
-    while(dir_name != NULL){
-        
-        char *next_dir = strtok(NULL, "/");
-
-        // Haven't reach the bottom of the path
-        if(next_dir != NULL){
-            //Check if the entry exists
-            if(curr_entry == NULL){
-                //Invalid path
-                exit(ENOENT);
-            }
-            //Check if current entry is a directory
-            if(curr_entry->file_type != EXT2_FT_DIR){
-                //Invalid path
-                exit(ENOENT);
-            }
-        }else{
-            return inode_num; 
-        }
+    //Rebuild block 0 as "." and ".." followed by the index
+    mark_dirty(root, EXT2_BLOCK_SIZE);
+    memmove(root + 12, dotdot, 12);
+    dot->rec_len = 12;
+    dotdot = (struct ext2_dir_entry *) (root + 12);
+    dotdot->rec_len = EXT2_BLOCK_SIZE - 12;
 
-        //Go to next directory along the target path
-        dir_name = next_dir;
-        curr_inode =  &inodes[curr_entry->inode - 1];
-        inode_num = curr_entry->inode;
-        curr_entry = find_entry(curr_inode, dir_name);
+    struct dx_root_info *info = (struct dx_root_info *) (root + DX_ROOT_ENTRIES_OFFSET);
+    memset(info, 0, sizeof(struct dx_root_info));
+    info->hash_version = sb->s_def_hash_version;
+    info->info_length = sizeof(struct dx_root_info);
 
-    }
+    struct dx_entry *entries = (struct dx_entry *) (info + 1);
+    struct dx_countlimit *countlimit = (struct dx_countlimit *) entries;
+    countlimit->limit = DX_ROOT_LIMIT;
+    countlimit->count = 1;
+    entries[0].block = leaf_logical;
 
-    return inode_num;
+    dir->i_flags |= EXT2_INDEX_FL;
+    mark_inode_dirty(dir);
+    return info;
+}
 
+//This function returns the entry with the given name inside the block, or NULL if there is none
+static struct ext2_dir_entry *search_dir_block(unsigned int block_num, const char *name, int name_len){
+    unsigned char *block = get_block(block_num);
+    int curr_len = 0;
+    while(curr_len < EXT2_BLOCK_SIZE){
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *) (block + curr_len);
+        if(entry->name_len == name_len && memcmp(name, entry->name, name_len) == 0){
+            return entry;
+        }
+        if(entry->rec_len == 0){
+            break;
+        }
+        curr_len += entry->rec_len;
+    }
+    //Only the block of an entry found stays pinned
+    put_block(block_num);
+    return NULL;
 }
 
+//This function looks the name up through the index of the directory
+//It sets found to the entry (NULL if there is no such name) and returns TRUE,
+//or returns FALSE if the index is damaged and the directory must be searched linearly
+static int dx_find_entry(struct ext2_inode *dir, struct dx_root_info *info, const char *name, int name_len,
+                         struct ext2_dir_entry **found){
 
+    //"." and ".." are in the root block, outside every leaf
+    if((name_len == 1 && name[0] == '.') || (name_len == 2 && name[0] == '.' && name[1] == '.')){
+        *found = search_dir_block(map_block(dir, 0, NULL), name, name_len);
+        return TRUE;
+    }
 
-/**
- * This function initiate a directory entry at the location given by the input 'entry'
- *
+    unsigned int hash = dx_hash_name(info, name, name_len);
+    struct dx_frame frames[DX_MAX_LEVELS];
+    int levels = dx_probe(dir, info, hash, frames);
+    if(levels < 0){
+        return FALSE;
+    }
+    do{
+        unsigned int leaf_block = map_block(dir, frames[levels].at->block, NULL);
+        if(leaf_block == 0){
+            return FALSE;
+        }
+        *found = search_dir_block(leaf_block, name, name_len);
+        if(*found != NULL){
+            return TRUE;
+        }
+    }while(dx_next_leaf(dir, frames, levels, hash));
+    return TRUE;
+}
+
+/*
+ * This function returns TRUE if a lookup of the name in the directory searches the given block,
+ * so an entry with the name can be put back in it: any block of a linear directory,
+ * or a leaf covering the hash of the name in an indexed directory.
  */
-void init_dir_entry(struct ext2_dir_entry *entry, unsigned int inode_num, unsigned short rec_len, int name_len, char *name, unsigned char file_type){
-    
-    // Increment inode link count
-    struct ext2_inode * inodes = get_inode_table();
-    inodes[inode_num - 1].i_links_count += 1;
-    //Initialize entry
-    entry->inode = inode_num;
-    entry->rec_len = rec_len;
-    entry->name_len = name_len;
-    entry->file_type = file_type;
-    strcpy(entry->name, name);
+int dir_block_covers_name(struct ext2_inode *dir, unsigned int block_num, char *name){
+
+    struct dx_root_info *info = dx_root_of(dir);
+    if(info == NULL){
+        return TRUE;
+    }
+
+    unsigned int hash = dx_hash_name(info, name, strlen(name));
+    struct dx_frame frames[DX_MAX_LEVELS];
+    int levels = dx_probe(dir, info, hash, frames);
+    if(levels < 0){
+        return FALSE;
+    }
+    do{
+        if(map_block(dir, frames[levels].at->block, NULL) == block_num){
+            return TRUE;
+        }
+    }while(dx_next_leaf(dir, frames, levels, hash));
+    return FALSE;
+}
+
+//This function inserts a new entry into the leaf of the indexed directory that covers its hash
+//A full leaf is split, and a full index grows, before trying again
+//It returns the new entry, or NULL if the directory cannot grow
+static struct ext2_dir_entry *dx_insert_entry(struct ext2_inode *dir, struct dx_root_info *info, unsigned int finode,
+                                              char *fname, int name_len, int rec_len, unsigned char ftype){
 
+    unsigned int hash = dx_hash_name(info, fname, name_len);
+    int attempt;
+    //At most: add an index level, split an index node, split the leaf, insert
+    for(attempt = 0; attempt < 4; attempt++){
+        struct dx_frame frames[DX_MAX_LEVELS];
+        int levels = dx_probe(dir, info, hash, frames);
+        if(levels < 0){
+            return NULL;
+        }
+        unsigned int leaf_block = map_block(dir, frames[levels].at->block, NULL);
+        if(leaf_block == 0){
+            return NULL;
+        }
+        struct ext2_dir_entry *new_entry = add_entry_to_block(leaf_block, finode, fname, name_len, rec_len, ftype, TRUE);
+        if(new_entry != NULL){
+            return new_entry;
+        }
 
+        //The leaf is full, it needs one more entry in the index block above it
+        struct dx_countlimit *countlimit = (struct dx_countlimit *) frames[levels].entries;
+        int result;
+        if(countlimit->count == countlimit->limit){
+            result = dx_grow_index(dir, info, frames, levels);
+        }else{
+            result = dx_split_leaf(dir, info, &frames[levels], leaf_block);
+        }
+        if(result != EXIT_SUCCESS){
+            return NULL;
+        }
+    }
+    return NULL;
 }
 
 /*
  * This function returns the entry given the file_name inside the given inode.
+ * An indexed directory only searches the leaf covering the hash of the name.
+ * It returns NULL if there is no such entry, or if the inode is not a directory.
  */
 struct ext2_dir_entry *find_entry(struct ext2_inode *inode, char *file_name) {
 
     //Check if the inode type is directory
     if(get_inode_type(inode) != 'd'){
-        exit(EXIT_FAILURE);
+        return NULL;
+    }
+
+    int name_len = strlen(file_name);
+    struct dx_root_info *info = dx_root_of(inode);
+    struct ext2_dir_entry *entry;
+    if(info != NULL && dx_find_entry(inode, info, file_name, name_len, &entry)){
+        return entry;
+    }
+
+    //Search every data block of the directory
+    struct block_iter iter;
+    block_iter_init(&iter, inode);
+    unsigned int i_block;
+    int is_pointer;
+    while ((i_block = block_iter_next(&iter, NULL, &is_pointer)) != 0) {
+        if (is_pointer) {
+            continue;
+        }
+        entry = search_dir_block(i_block, file_name, name_len);
+        if (entry != NULL) {
+            return entry;
+        }
     }
 
+    return NULL;
+}
 
-	int j;
-    for (j = 0 ; j < inode->i_blocks / 2 ; j++) {
-        int i_block = inode->i_block[j];
-        int curr_len = 0;
+/*
+ * This function returns the next entry in use of the directory after the cursor and moves the cursor past it,
+ * or NULL when the directory has no more entries. Start with a zeroed cursor.
+ * Entries come in the order they are stored; blocks are mapped one at a time, so the walk needs no memory
+ * however large the directory is, and the cursor can be saved and given back later to go on from there.
+ * The rest of a block whose entries are corrupted is skipped.
+ */
+struct ext2_dir_entry *read_dir(struct ext2_inode *dir, struct dir_cursor *cursor){
 
-        while (curr_len < EXT2_BLOCK_SIZE) {
-            struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(disk + EXT2_BLOCK_SIZE * i_block + curr_len);
-            if (strlen(file_name) == ((int) entry->name_len)) {  
-                if (strncmp(file_name, entry->name, strlen(file_name)) == 0) {//entry->name matches file_name
-                    return entry;
-                }
+    while((uint64_t) cursor->logical * EXT2_BLOCK_SIZE < dir->i_size){
+        unsigned int block_num = map_block(dir, cursor->logical, NULL);
+        if(block_num == 0 || block_num >= sb->s_blocks_count){
+            //A hole in the directory
+            cursor->logical++;
+            cursor->offset = 0;
+            continue;
+        }
+        unsigned char *block = get_block(block_num);
+        while(cursor->offset + 8 <= EXT2_BLOCK_SIZE){
+            struct ext2_dir_entry *entry = (struct ext2_dir_entry *) (block + cursor->offset);
+            if(entry->rec_len < 8 || cursor->offset + entry->rec_len > EXT2_BLOCK_SIZE
+               || actual_entry_len(entry) > entry->rec_len){
+                break;
+            }
+            cursor->offset += entry->rec_len;
+            if(entry->inode != 0){
+                return entry;
             }
-            curr_len += entry->rec_len;
         }
+        put_block(block_num);
+        cursor->logical++;
+        cursor->offset = 0;
     }
-
     return NULL;
 }
 
+/*
+ * This function checks that the cursor points at an entry of the directory, so that a saved cursor
+ * can be trusted before read_dir() goes on from it.
+ * It returns TRUE if it does (or if it is past the end of the directory), FALSE otherwise
+ */
+int dir_cursor_valid(struct ext2_inode *dir, struct dir_cursor *cursor){
+
+    if(cursor->offset > EXT2_BLOCK_SIZE || cursor->offset % 4 != 0){
+        return FALSE;
+    }
+    if((uint64_t) cursor->logical * EXT2_BLOCK_SIZE >= dir->i_size || cursor->offset == 0){
+        return TRUE;
+    }
+    unsigned int block_num = map_block(dir, cursor->logical, NULL);
+    if(block_num == 0 || block_num >= sb->s_blocks_count){
+        return FALSE;
+    }
+
+    //Walk the block to the offset
+    unsigned char *block = get_block(block_num);
+    unsigned int offset = 0;
+    while(offset < cursor->offset){
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *) (block + offset);
+        if(entry->rec_len < 8){
+            break;
+        }
+        offset += entry->rec_len;
+    }
+    put_block(block_num);
+    return offset == cursor->offset;
+}
+
 /*
  * This function returns the last directory entry
  * inside the given block. (i_block is the block index)
@@ -351,7 +3904,7 @@ struct ext2_dir_entry *find_last_entry(int i_block){
     int curr_len = 0;
     struct ext2_dir_entry *entry;
     while (curr_len < EXT2_BLOCK_SIZE) {
-        entry = (struct ext2_dir_entry *) (disk + EXT2_BLOCK_SIZE * i_block + curr_len);
+        entry = (struct ext2_dir_entry *) (get_block(i_block) + curr_len);
         curr_len += entry->rec_len;
     }
     return entry;
@@ -373,23 +3926,27 @@ int actual_entry_len(struct ext2_dir_entry *entry){
  * This function inserts a new entry in the directoty
  * Input: dir_inode: the inode of the give directory where to insert a new file, finode: inode number of the new file (number = index + 1), 
  * fname: new file name, ftype: new file type(EXT2_FT_UNKNOWN, EXT2_FT_REG_FILE, EXT2_FT_DIR, EXT2_FT_SYMLINK)
- * Return: the new dir entry
+ * Output: new_entry: the new dir entry
+ * Return: EXIT_SUCCESS, EINVAL if the inode is not allocated, EEXIST if the name already exists,
+ * ENAMETOOLONG if the name is too long, or ENOMEM if there is no room for the entry
  */
-struct ext2_dir_entry *insert_dir_entry(struct ext2_inode *dir_inode, unsigned int finode, char *fname, unsigned char ftype){
+int insert_dir_entry(struct ext2_inode *dir_inode, unsigned int finode, char *fname, unsigned char ftype,
+                     struct ext2_dir_entry **new_entry){
     //Check if inode is allocated
     if(finode == 0){
-        return NULL;
+        return EINVAL;
     }
 
     //Check if the file name already exists
 	if(find_entry(dir_inode, fname) != NULL){
-        exit(EEXIST);
+        return EEXIST;
 	}
+    dentry_cache_drop(inode_num_of(dir_inode), fname);
 
 	//Get the name length and entry length
 	int name_len = strlen(fname);
     if (name_len > EXT2_NAME_LEN){
-        exit(EXIT_FAILURE);
+        return ENAMETOOLONG;
     }
 	
 	//rec_len needs to be a multiple of 4.
@@ -398,126 +3955,136 @@ struct ext2_dir_entry *insert_dir_entry(struct ext2_inode *dir_inode, unsigned i
 		rec_len += 1;
 	}
 
-	int i;
-    //The first 12 direct blocks
-	for(i = 0; i < EXT2_DIRECT_BLOCK_NUM; i++){
-
-        // The current block is not in use
-        if((dir_inode->i_block)[i] == 0){
-            int block_num = allocate_block();
-
-            //Update inode information
-            (dir_inode->i_block)[i] = block_num;
-            dir_inode->i_size += EXT2_BLOCK_SIZE;
-            //Allocate a new block increases 2 DISK SECTORS
-            dir_inode->i_blocks += EXT2_BLOCK_SIZE / EXT2_SECTOR_SIZE;
+    //An indexed directory puts the entry in the leaf that covers its hash
+    struct dx_root_info *info = dx_root_of(dir_inode);
+    if(info != NULL){
+        *new_entry = dx_insert_entry(dir_inode, info, finode, fname, name_len, rec_len, ftype);
+        return *new_entry != NULL ? EXIT_SUCCESS : ENOMEM;
+    }
 
-            struct ext2_dir_entry *entry = (struct ext2_dir_entry *) (disk + block_num * EXT2_BLOCK_SIZE);
+    //Go straight to a block with room for the entry: after the last entry of a block first,
+    //then in the holes left by removed entries
+    struct dir_space_hint *hint = get_dir_space_hint(dir_inode);
+    if(hint == NULL){
+        return ENOMEM;
+    }
+	unsigned int i;
+    int use_holes;
+    for(use_holes = FALSE; use_holes <= TRUE; use_holes++){
+        for(i = 0; i < hint->count; i++){
+            if((use_holes ? hint->largest_gap[i] : hint->tail_gap[i]) >= rec_len){
+                *new_entry = add_entry_to_block(hint->block_nums[i], finode, fname, name_len, rec_len, ftype, use_holes);
+                set_dir_space_hint(hint, i, hint->block_nums[i]);
+                if(*new_entry != NULL){
+                    return EXIT_SUCCESS;
+                }
+            }
+        }
+    }
 
-            init_dir_entry(entry, finode, EXT2_BLOCK_SIZE, name_len, fname, ftype);
+    //No block has room: use the first hole of the directory, or a new block after its last one
+    unsigned int dir_blocks = hint->count;
+    i = 0;
+    while(i < dir_blocks && hint->block_nums[i] != 0){
+        i++;
+    }
 
-            return entry;
+    //The only block is full, index the directory instead of growing it linearly
+    if(i == 1 && dir_blocks == 1 && (info = dx_make_indexed(dir_inode)) != NULL){
+        drop_dir_space_hint(hint->inode_num);
+        *new_entry = dx_insert_entry(dir_inode, info, finode, fname, name_len, rec_len, ftype);
+        return *new_entry != NULL ? EXIT_SUCCESS : ENOMEM;
+    }
 
-        }
-        // The current block is in use
-        // Find the last entry and check whether we can put our new entry here
-        else{
-            
-            
-            unsigned char *block_start = disk + ((dir_inode->i_block)[i] * EXT2_BLOCK_SIZE);
-            unsigned char *block_end = block_start + EXT2_BLOCK_SIZE;
-            
-            unsigned char *curr_pos = block_start;
-            struct ext2_dir_entry *first_entry = (struct ext2_dir_entry *)block_start;
-            curr_pos += first_entry->rec_len;
-
-            //After the loop, last_entry would be the the last entry in the block
-            struct ext2_dir_entry *last_entry = first_entry;
-            while(curr_pos != block_end){
-                last_entry = (struct ext2_dir_entry *)curr_pos;
-                curr_pos += last_entry->rec_len;
-            }
+    //Allocate the block (and the pointer blocks leading to it) and update i_blocks
+    int block_num = map_block(dir_inode, i, allocate_block);
+    if(block_num == 0){
+        //No free block for the new entry, or the directory cannot grow any more
+        return ENOMEM;
+    }
 
-            int actual_len = actual_entry_len(last_entry);
-            //There is enough place to put new entry at the end of the blcok
-            if((last_entry->rec_len - actual_len) >= rec_len){
-                
-                //Insert a new entry after the last entry
-                int new_ren_len = last_entry->rec_len - actual_len;
-                
-                //Update rec_len of the last entry
-                last_entry->rec_len = actual_len;
-                struct ext2_dir_entry *new_entry  = (struct ext2_dir_entry *)(block_end - new_ren_len);
+    //Update inode information
+    if(i == dir_blocks){
+        dir_inode->i_size += EXT2_BLOCK_SIZE;
+        mark_inode_dirty(dir_inode);
+    }
 
-                init_dir_entry(new_entry, finode, new_ren_len, name_len, fname, ftype);
+    *new_entry = (struct ext2_dir_entry *) get_block(block_num);
 
-                return new_entry;
-            }
-		}
-	}
+    init_dir_entry(*new_entry, finode, EXT2_BLOCK_SIZE, name_len, fname, ftype);
+    //Without memory to grow the summary, it is dropped and built again on the next insert
+    set_dir_space_hint(hint, i, block_num);
 
-    // If all the 12 blocks are full
-    return NULL;
+    return EXIT_SUCCESS;
 
 }
 
 //This function creates a file onto the specified location on the disk
 // e.g. If path_to_dest is '/home/level1/new_file', it should create new_file in directory '/home/level1'.
 // finode is the inode number for the newly created file. If finode is 0, it will allocate a new inode first.
-// It returns the dir_entry of the newly created file if successful
-// Return EEXIST if the file name already exists and ENOENT if the path is invalid
-struct ext2_dir_entry* create_file(char *path_to_dest, unsigned int finode, char file_type){
+// It sets new_entry to the dir_entry of the newly created file and returns EXIT_SUCCESS if successful
+// Return EEXIST if the file name already exists, ENOENT if the path is invalid, ENAMETOOLONG if the name is too long
+// It returns ENOMEM if there is no space for the new file (no free inode or block, or the directory is full)
+int create_file(char *path_to_dest, unsigned int finode, char file_type, struct ext2_dir_entry **new_entry){
 
-    //Create a copy so that path_to_dest will not be changed
-    char path_copy[strlen(path_to_dest) + 1];
-    strcpy(path_copy, path_to_dest);
-
-    //Get the inode of the second last directory
-    int parent_inode_num = second_last_dir_inode(path_copy);
-    struct ext2_inode *parent_inode = &get_inode_table()[parent_inode_num - 1];
+    //Get the inode of the second last directory and the name of the new file
+    unsigned int parent_inode_num;
+    char file_name[EXT2_NAME_LEN + 1];
+    int result = resolve_path(path_to_dest, &parent_inode_num, file_name);
+    if(result != EXIT_SUCCESS){
+        return result;
+    }
+    struct ext2_inode *parent_inode = get_inode(parent_inode_num);
     
     //Allocate a new inode for the new file
+    int is_new_inode = FALSE;
     if(finode == 0){
         finode = allocate_inode(file_type); 
+        if(finode == 0){
+            //No free inode
+            return ENOMEM;
+        }
+        is_new_inode = TRUE;
     }
-    
-    //Create a copy of path_to_dest so that path_to_dest won't be changed
-    char path_to_dest_copy[strlen(path_to_dest) + 1];
-    strcpy(path_to_dest_copy, path_to_dest);
-
-    char* file_name = get_file_name(path_to_dest_copy);
-    char const_file_name[EXT2_NAME_LEN + 1];//Make the name constont
-    int i;
-    for(i = 0; i < strlen(file_name); i++){
-        const_file_name[i] = file_name[i];
-    }
-    const_file_name[strlen(file_name)] = '\0';
 
     //Insert the entry for the new file into the current inode
-    return insert_dir_entry(parent_inode, finode, const_file_name, file_type);
+    result = insert_dir_entry(parent_inode, finode, file_name, file_type, new_entry);
+    if(result != EXIT_SUCCESS && is_new_inode){
+        //Roll back the inode allocation
+        free_inode(finode);
+    }
+    return result;
 
 }
 
-//This function marks the resource as in use in the bitmap
+//This function marks the resource as in use in the bitmap of its group
 //Input: the number of the resource; is_inode: 1 if the resource is an inode
 void set_resource_in_use(unsigned int resource_num, int is_inode){
     unsigned char *bitmap;
+    int idx;
+    unsigned int group;
     if(is_inode == 1){
-        bitmap = get_inode_bitmap();
-        gd->bg_free_inodes_count--;
+        group = group_of_inode(resource_num);
+        bitmap = get_inode_bitmap(group);
+        idx = resource_num - 1 - group * sb->s_inodes_per_group;
+        gd[group].bg_free_inodes_count--;
         sb->s_free_inodes_count--;
     }else{
-        bitmap = get_block_bitmap();
-        gd->bg_free_blocks_count--;
+        group = group_of_block(resource_num);
+        bitmap = get_block_bitmap(group);
+        idx = resource_num - sb->s_first_data_block - group * sb->s_blocks_per_group;
+        gd[group].bg_free_blocks_count--;
         sb->s_free_blocks_count--;
     }
     
-    int idx = resource_num - 1;
     int byte_idx = idx / 8;
     int bit = idx % 8;
     
     // Set the corresponding bit to 1
     bitmap[byte_idx] |= 1 << bit;
+    mark_dirty(&bitmap[byte_idx], 1);
+    put_block(is_inode == 1 ? gd[group].bg_inode_bitmap : gd[group].bg_block_bitmap);
+    mark_counters_dirty(group);
     
 }
 
@@ -527,18 +4094,33 @@ void set_resource_in_use(unsigned int resource_num, int is_inode){
  */
 void free_inode(unsigned int inode_num) {
     
-    unsigned char *inode_bitmap = get_inode_bitmap();
+    unsigned int group = group_of_inode(inode_num);
+    unsigned char *inode_bitmap = get_inode_bitmap(group);
     
-    int index = inode_num - 1;
+    int index = inode_num - 1 - group * sb->s_inodes_per_group;
     
     int byte_index = index / 8;
     int bit_offset = index % 8;
     
     // Set the corresponding bit in bitmap to 0
     inode_bitmap[byte_index] &= (~(1 << bit_offset));
+    mark_dirty(&inode_bitmap[byte_index], 1);
+    put_block(gd[group].bg_inode_bitmap);
+
+    //The freed inode is the next candidate if it comes before the cursors
+    if((unsigned int) index < inode_cursor[group]){
+        inode_cursor[group] = index;
+    }
+    if(group < inode_group_cursor){
+        inode_group_cursor = group;
+    }
     
-    gd->bg_free_inodes_count++;
+    gd[group].bg_free_inodes_count++;
     sb->s_free_inodes_count++;
+    mark_counters_dirty(group);
+
+    //A directory summary must not outlive its inode
+    drop_dir_space_hint(inode_num);
 }
 
 /*
@@ -547,78 +4129,71 @@ void free_inode(unsigned int inode_num) {
  */
 void free_block(unsigned int block_num) {
     
-    unsigned char *block_bitmap = get_block_bitmap();
+    unsigned int group = group_of_block(block_num);
+    unsigned char *block_bitmap = get_block_bitmap(group);
     
-    int index = block_num - 1;
+    int index = block_num - sb->s_first_data_block - group * sb->s_blocks_per_group;
     int byte_index = index / 8;
     int bit_offset = index % 8;
     
     // Set the corresponding bit in bitmap to 0
     block_bitmap[byte_index] &= (~(1 << bit_offset));
+    mark_dirty(&block_bitmap[byte_index], 1);
+    put_block(gd[group].bg_block_bitmap);
+
+    //The freed block is the next candidate if it comes before the cursors
+    if((unsigned int) index < block_cursor[group]){
+        block_cursor[group] = index;
+    }
+    if(group < block_group_cursor){
+        block_group_cursor = group;
+    }
     
-    gd->bg_free_blocks_count++;
+    gd[group].bg_free_blocks_count++;
     sb->s_free_blocks_count++;
+    mark_counters_dirty(group);
 }
 
 /*
  * This function frees all data blocks in the given inode.
  * This function is called when the i_links_count of this inode becomes 0
+ * It returns EXIT_SUCCESS, or EBUSY if the inode still has links
  */
-void free_data_blocks(struct ext2_inode *inode) {
+int free_data_blocks(struct ext2_inode *inode) {
     
     if(inode->i_links_count > 0) {
         //The inode still has links
-        exit(EXIT_FAILURE);
-    }
-    
-    int i;
-    // Free direct blocks
-    for (i = 0; i < EXT2_DIRECT_BLOCK_NUM; i++) {
-        if(inode->i_block[i] != 0){//The block is in use
-            unsigned int block_num = inode->i_block[i];
-            free_block(block_num);
-        }
+        return EBUSY;
     }
     
-    //Since the disk only has 128 blocks, we will use one indirect block (12-th) at most
-    unsigned int indirect_block_num = inode->i_block[EXT2_DIRECT_BLOCK_NUM];
-    
-    if (indirect_block_num != 0) {// The indirect block (12-th) is in use
-
-        // Get the indirect block
-        unsigned int *indirect_block = (unsigned int *)(disk + indirect_block_num * EXT2_BLOCK_SIZE);
-        
-        int max_indirect_blocks = EXT2_BLOCK_SIZE / sizeof(unsigned int);//1024 / 4 = 256 blocks
-        
-        int j;
-        for(j = 0; j < max_indirect_blocks; j++){
-            //The direct block store in indirect_block
-            unsigned int direct_block_num = indirect_block[j];
-            if(direct_block_num != 0){
-                free_block(direct_block_num);
-            }
-        }
-        //Free the indirect block
-        free_block(indirect_block_num);
+    // Free data blocks and the indirect, double indirect and triple indirect blocks
+    // Freeing only clears bitmap bits, so the pointer blocks can still be read while walking
+    struct block_iter iter;
+    block_iter_init(&iter, inode);
+    unsigned int block_num;
+    while((block_num = block_iter_next(&iter, NULL, NULL)) != 0){
+        free_block(block_num);
     }
+    return EXIT_SUCCESS;
 
 }
 
 /*
  * This function deecrements the inode's i_links_count by 1.
  * Free all the data blocks if its links_count becomes 0.
+ * It returns EXIT_SUCCESS, or EIO if the inode has no link left (the image is inconsistent)
  */
-void unlink_inode(unsigned int inode_num) {
+int unlink_inode(unsigned int inode_num) {
     
-    struct ext2_inode *inode_table = get_inode_table();
-    struct ext2_inode *inode = &inode_table[inode_num-1];
+    struct ext2_inode *inode = get_inode(inode_num);
     
     if (inode->i_links_count == 0) {
         //The inode doesn't have any link
-        exit(EXIT_FAILURE);
+        return EIO;
     }
     
     inode->i_links_count--;
+    mark_inode_dirty(inode);
     
     // If the i_link_count reaches 0, free all the data blocks of the inode
     if (inode->i_links_count == 0) {
@@ -629,7 +4204,156 @@ void unlink_inode(unsigned int inode_num) {
         free_data_blocks(inode);
         free_inode(inode_num);
     }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * This function sets prev_entry to the previous entry of the input file in the block
+ * It sets NULL if it is the first entry in the block
+ * It returns EXIT_SUCCESS, ENOTDIR if the inode is not a directory, or ENOENT if the file entry doesn't exist
+ */
+int find_prev_entry(struct ext2_inode *inode, char *file_name, struct ext2_dir_entry **prev_entry) {
+
+	//Check if the inode type is directory
+    if(get_inode_type(inode) != 'd'){
+        return ENOTDIR;
+    }
+
+	struct ext2_dir_entry * file_entry = find_entry(inode, file_name);
+
+	//The file doesn't exist
+    if(file_entry == NULL){
+        return ENOENT;
+    }
+
+
+    //Walk the block that holds the entry
+    unsigned char *block = get_block(block_num_of(file_entry));
+    *prev_entry = NULL;
+    int curr_len = 0;
+    while (curr_len < EXT2_BLOCK_SIZE) {
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + curr_len);
+        if (entry == file_entry) {
+            return EXIT_SUCCESS;
+        }
+        *prev_entry = entry;
+        curr_len += entry->rec_len;
+    }
+
+	//Can't find a match entry for file_name;
+    return ENOENT;
+}
+
+/*
+ * This function removes the entry of the file from the given directory without touching its inode
+ * It returns the inode number the entry referred to, or 0 if there is no such entry
+ */
+unsigned int remove_dir_entry(struct ext2_inode *dir_inode, char *file_name) {
+
+	struct ext2_dir_entry * file_entry = find_entry(dir_inode, file_name);
+    if(file_entry == NULL){
+        return 0;
+    }
+    unsigned int inode_num = file_entry->inode;
+
+    struct ext2_dir_entry * prev_entry;
+    if(find_prev_entry(dir_inode, file_name, &prev_entry) != EXIT_SUCCESS){
+        return 0;
+    }
+    
+    //Remove the entry form its parent inode
+    if(prev_entry == NULL){//This is the first entry in the block
+    	file_entry->inode = 0;//Set the block to be not in use
+        mark_dirty(file_entry, sizeof(struct ext2_dir_entry));
+    }else{
+    	//Link the previous entry to the next entry
+    	prev_entry->rec_len += file_entry->rec_len;
+        mark_dirty(prev_entry, sizeof(struct ext2_dir_entry));
+    }
+    refresh_dir_space_hint(dir_inode, block_num_of(file_entry));
+    dentry_cache_drop(inode_num_of(dir_inode), file_name);
+
+    return inode_num;
+}
+
+/*
+ * This function delete the file in the given inode
+ * It returns EXIT_SUCCESS if the file is deleted
+ * It returns ENOENT if the file doesn't exist
+ * It returns EISDIR if the file is directory
+ */
+int delete_file(int parent_inode_num, char* file_name){
+   
+    struct ext2_inode *parent_dir_inode = get_inode(parent_inode_num);
+	struct ext2_dir_entry * file_entry = find_entry(parent_dir_inode, file_name);
+
+	//The file that needs to be removed doesn't exist
+    if(file_entry == NULL){
+        return ENOENT;
+    }
+    //The file that needs to be removed is directory
+    if(file_entry->file_type == EXT2_FT_DIR){
+        return EISDIR;
+    }
+
+    unsigned int inode_num = remove_dir_entry(parent_dir_inode, file_name);
+    if(inode_num == 0){
+        return ENOENT;
+    }
+
+   	//Decrease the link count for the file
+    return unlink_inode(inode_num);
 }
 
+//This function creates a new directory at target_path
+//It returns EXIT_SUCCESS if successful, ENOENT if the parent directory doesn't exist,
+//EEXIST if the path already exists, ENAMETOOLONG if the name is too long,
+//or ENOMEM if there is no free inode or block for the new directory
+int make_directory(char *target_path){
+
+    //Get the inode of the second last directory and the name of the newly added directory
+    unsigned int parent_inode_num;
+    char dir_name[EXT2_NAME_LEN + 1];
+    int result = resolve_path(target_path, &parent_inode_num, dir_name);
+    if(result != EXIT_SUCCESS){
+        return result;
+    }
+    struct ext2_inode * parent_inode = get_inode(parent_inode_num);
+
+    //Check if the name already exists
+    if(find_entry(parent_inode, dir_name) != NULL){
+        return EEXIST;
+    }
+
+    //Allocate a new inode for the directory
+    unsigned int new_inode_num = allocate_inode(EXT2_FT_DIR);
+    if(new_inode_num == 0){
+        return ENOMEM;
+    }
+
+    //Insert the new directory into the parent inode
+    struct ext2_dir_entry *new_entry;
+    result = insert_dir_entry(parent_inode, new_inode_num, dir_name, EXT2_FT_DIR, &new_entry);
+    if(result != EXIT_SUCCESS){
+        free_inode(new_inode_num);
+        return result;
+    }
 
+    struct ext2_inode *new_inode = get_inode(new_inode_num);
+    
+    //Insert '.' and '..' into the new directory
+    //'.' allocates the first block of the new directory and '..' always fits in it
+    result = insert_dir_entry(new_inode, new_inode_num, ".", EXT2_FT_DIR, &new_entry);
+    if(result != EXIT_SUCCESS){
+        //Roll back the entry in the parent directory and the inode
+        remove_dir_entry(parent_inode, dir_name);
+        free_inode(new_inode_num);
+        return result;
+    }
+    insert_dir_entry(new_inode, parent_inode_num, "..", EXT2_FT_DIR, &new_entry);
+    
+    //Update directories count of the group the new inode belongs to
+    gd[group_of_inode(new_inode_num)].bg_used_dirs_count += 1;
 
+    return EXIT_SUCCESS;
+}
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include "ext2.h"
 
@@ -13,46 +14,272 @@
 #define FALSE 0
 #define EXT2_SECTOR_SIZE 512
 #define EXT2_DIRECT_BLOCK_NUM 12
+#define EXT2_IND_BLOCK 12  //i_block slot of the indirect block
+#define EXT2_DIND_BLOCK 13 //i_block slot of the double indirect block
+#define EXT2_TIND_BLOCK 14 //i_block slot of the triple indirect block
+#define EXT2_N_BLOCKS 15
+#define EXT2_ADDR_PER_BLOCK (EXT2_BLOCK_SIZE / sizeof(unsigned int)) //1024 / 4 = 256 block numbers in a pointer block
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE 0x0002
+#define EXT2_SUPER_MAGIC 0xEF53
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+#define EXT2_INDEX_FL 0x00001000 //i_flags of a directory with a hashed (htree) index
 
-extern unsigned char *disk;
-extern struct ext2_super_block *sb;
-extern struct ext2_group_desc *gd;
+//Directory hash versions (s_def_hash_version and dx_root_info.hash_version)
+#define EXT2_HASH_LEGACY 0
+#define EXT2_HASH_HALF_MD4 1
+#define EXT2_HASH_TEA 2
+#define EXT2_HASH_UNSIGNED 3 //Added to the version when names are hashed as unsigned chars
+//s_flags is not declared in ext2.h, it lives in s_reserved right after s_first_meta_bg and the fields before it
+#define EXT2_SB_FLAGS(sb) ((sb)->s_reserved[22])
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
 
-void load_image(const char *file);
-unsigned char *get_block_bitmap();
-unsigned char *get_inode_bitmap();
-struct ext2_inode *get_inode_table();
+//Access pattern hints for load_image()
+#define EXT2_MAP_RANDOM            0x1 //Path lookups and small updates jump around the image
+#define EXT2_MAP_SEQUENTIAL        0x2 //Bulk data is written or read in block order
+#define EXT2_MAP_PREFETCH_METADATA 0x4 //Bitmaps and inode tables of every group are about to be scanned
+#define EXT2_MAP_POPULATE          0x8 //Pre-fault the whole image at mmap() time
+#define EXT2_MAP_READ_ONLY         0x10 //Open and map the image read-only (PROT_READ, MAP_PRIVATE), nothing may be written
+#define EXT2_MAP_JOURNAL           0x20 //Keep changes in memory until ext2_commit_image() writes them through the journal
+#define EXT2_MAP_SYNC_AT_EXIT      0x40 //msync() the blocks that were changed when the image is closed (or the tool exits)
+#define EXT2_MAP_SYNC_PER_OP       0x80 //Make the changes durable after every operation, see ext2_end_operation()
+#define EXT2_MAP_PREAD             0x100 //Read blocks into buffers with pread() and write them back with pwrite() instead of mapping the image
+
+//Environment variable that chooses how a tool makes its changes durable, overriding the tool's own choice:
+//"journal" (ext2_commit_image() at exit), "none" (left to the page cache), "exit" or "op" (EXT2_MAP_SYNC_*)
+#define EXT2_SYNC_ENV "EXT2_SYNC"
+
+//Environment variable that chooses the I/O backend of a tool: "mmap" (the default) or "pread" (EXT2_MAP_PREAD)
+#define EXT2_IO_ENV "EXT2_IO"
+
+//Buffer cache of the pread backend: its size in blocks and which unpinned buffer a new block takes
+#define EXT2_CACHE_DEFAULT_BLOCKS 16384 //16 MiB
+#define EXT2_CACHE_LRU 0   //The least recently released one
+#define EXT2_CACHE_CLOCK 1 //The next one the clock hand finds unused since its last turn
+//Environment variables that set the size of the cache ("EXT2_CACHE_BLOCKS=4096") and its policy ("lru" or "clock"),
+//and print its counters when the tool exits if EXT2_CACHE_STATS is set
+#define EXT2_CACHE_BLOCKS_ENV "EXT2_CACHE_BLOCKS"
+#define EXT2_CACHE_POLICY_ENV "EXT2_CACHE_POLICY"
+#define EXT2_CACHE_STATS_ENV "EXT2_CACHE_STATS"
+
+//Counters of the buffer cache, see ext2_get_cache_stats()
+struct ext2_cache_stats {
+    uint64_t hits;          //get_block() found the block in a buffer
+    uint64_t misses;        //It read the block from the file
+    uint64_t evictions;     //A buffer was reused for another block
+    uint64_t write_backs;   //The evicted block had changed and was written to the file first
+    unsigned int buffers;   //Buffers allocated, more than max_buffers only while that many were pinned or held for the commit
+    unsigned int max_buffers;
+};
+
+//Images at least this large are advised to use transparent huge pages
+#define EXT2_HUGEPAGE_THRESHOLD (64 * 1024 * 1024)
+
+/*
+ * An open image: the mapping or the block buffers, its geometry, the allocation cursors and the directory caches.
+ * Several images can be open at once. Every helper works on the image bound to the calling thread
+ * with ext2_use_image(); the tools name its fields through the macros of ext2_image_fields.h.
+ * im_disk is NULL with the pread backend: blocks are only reached through get_block() and get_inode(),
+ * and a pointer they return is only valid until the block is released or the operation ends.
+ * An image must only be used by one thread at a time.
+ */
+struct ext2_io_backend;
+struct ext2_buffer_cache;
+
+//A run of contiguous blocks
+struct ext2_extent {
+    unsigned int start;
+    unsigned int len;
+};
+
+struct ext2_image {
+    //I/O backend, and the mapping (mmap) or the block buffers (pread) it reads the image through
+    const struct ext2_io_backend *im_io;
+    unsigned char *im_disk;
+    unsigned char *im_shared;       //Shared mapping of a journaled mapped image, for the blocks free on disk
+    struct ext2_buffer_cache *im_cache;
+    size_t im_disk_size;
+    struct ext2_super_block *im_sb;
+    struct ext2_group_desc *im_gd;
+    unsigned int im_groups_count;
+    unsigned int im_inode_size;
+    //Next-fit allocation cursors
+    unsigned int im_inode_group_cursor;
+    unsigned int im_block_group_cursor;
+    unsigned int *im_inode_cursor;
+    unsigned int *im_block_cursor;
+    //Directory caches
+    struct dir_space_hint *im_dir_hints;
+    struct dentry_cache_entry *im_dentry_cache;
+    //Blocks reserved for the file being written, handed out in block order
+    struct ext2_extent *im_reserved;
+    int im_reserved_count;
+    int im_next_extent;             //The extent the next reserved block comes from
+    unsigned int im_next_offset;    //The offset of that block inside the extent
+    //The image file, kept open by a journaled image and by the pread backend, -1 otherwise
+    int im_fd;
+    //Journaling (EXT2_MAP_JOURNAL): the path of the journal, NULL if the image is not journaled
+    char *im_journal_path;
+    //Durability (EXT2_MAP_SYNC_*): the policy flags and one bit per block changed since the last sync
+    int im_sync_flags;
+    unsigned char *im_dirty;
+};
+
+/*
+ * A journaled image is mapped privately, so changes stay in memory until ext2_commit_image().
+ * The commit finds the blocks that differ from the file. Blocks that were free on disk (new data) are written
+ * in place first (a mapped image writes them through a shared mapping of the file as they change); the other changed blocks are written to <image>.journal with a checksum and synced,
+ * which is the commit point, and only then copied into the image. Opening an image replays a committed
+ * journal left by a crash and drops an incomplete one, so recovery costs one pass over the journal.
+ * Closing a journaled image without committing it drops its changes.
+ * If the journal cannot be created next to the image when it is opened, the image is not journaled
+ * and its changes are synced when it is closed (EXT2_MAP_SYNC_AT_EXIT) instead.
+ */
+#define EXT2_JOURNAL_SUFFIX ".journal"
+#define EXT2_JOURNAL_MAGIC "EXT2JNL1"
+
+//Header of the journal, followed by block_count block numbers and then the blocks themselves
+struct ext2_journal_header {
+    char magic[8];
+    uint32_t block_count;
+    uint32_t reserved;
+    uint64_t checksum;  //FNV-1a over the block numbers and the blocks
+};
+
+extern __thread struct ext2_image *current_image;
+
+int ext2_open_image(const char *file, int map_flags, struct ext2_image **image);
+void ext2_use_image(struct ext2_image *image);
+void ext2_close_image(struct ext2_image *image);
+int ext2_commit_image(struct ext2_image *image);
+int ext2_sync_image(struct ext2_image *image);
+int ext2_flush_image(struct ext2_image *image);
+int ext2_end_operation(struct ext2_image *image);
+int ext2_configure_cache(struct ext2_image *image, unsigned int max_blocks, int policy);
+void ext2_get_cache_stats(struct ext2_image *image, struct ext2_cache_stats *stats);
+void mark_dirty(const void *address, size_t len);
+void mark_block_dirty(unsigned int block_num);
+void load_image(const char *file, int map_flags);
+void ext2_abort(int status) __attribute__((noreturn));
+int read_block(unsigned int block_num, unsigned char **data);
+unsigned char *get_block(unsigned int block_num);
+void put_block(unsigned int block_num);
+void release_block(unsigned int block_num);
+unsigned int begin_block_scope(void);
+void end_block_scope(unsigned int scope);
+unsigned int held_blocks_limit(unsigned int wanted);
+unsigned int block_num_of(const void *address);
+unsigned int group_of_inode(unsigned int inode_num);
+unsigned int group_of_block(unsigned int block_num);
+unsigned int blocks_in_group(unsigned int group);
+unsigned char *get_block_bitmap(unsigned int group);
+unsigned char *get_inode_bitmap(unsigned int group);
+struct ext2_inode *get_inode_table(unsigned int group);
+struct ext2_inode *get_inode(unsigned int inode_num);
+void put_inode(unsigned int inode_num);
+void mark_inode_dirty(struct ext2_inode *inode);
 char get_inode_type(struct ext2_inode *inode);
 int inode_num_of(struct ext2_inode *inode);
 
+//One pointer block on the path of a block_iter walk
+struct block_iter_frame {
+    unsigned int *pointers;      //The block numbers stored in the pointer block
+    unsigned int block_num;      //The pointer block, put when the walk leaves it
+    unsigned int index;          //The next pointer to look at
+    int level;                   //1 for an indirect block, 2 for double indirect, 3 for triple indirect
+    unsigned int first_logical;  //Logical index of the first data block the pointer block covers
+};
+
+//State of a walk over all the blocks of an inode
+struct block_iter {
+    struct ext2_inode *inode;
+    int slot;                           //The next slot in inode->i_block
+    int depth;                          //Number of pointer blocks being walked
+    struct block_iter_frame frames[3];
+};
+
+//Header of the hashed index stored in block 0 of an indexed directory, right after the "." and ".." entries
+struct dx_root_info {
+    unsigned int reserved_zero;
+    unsigned char hash_version;
+    unsigned char info_length;     //8
+    unsigned char indirect_levels; //0 if the root points to leaves, 1 if it points to index nodes
+    unsigned char unused_flags;
+};
+
+//One index entry: the leaf (or node) at logical block 'block' holds the names hashing from 'hash' up to the next entry.
+//The first entry of every index has no hash, its place holds the limit and count of the index
+struct dx_entry {
+    unsigned int hash;
+    unsigned int block;
+};
+
+struct dx_countlimit {
+    unsigned short limit;
+    unsigned short count;
+};
+
+unsigned int map_block(struct ext2_inode *inode, unsigned int logical, int (*alloc_block)());
+unsigned int remap_block(struct ext2_inode *inode, unsigned int logical, unsigned int block_num);
+unsigned int blocks_with_pointers(unsigned int data_blocks);
+void block_iter_init(struct block_iter *iter, struct ext2_inode *inode);
+unsigned int block_iter_next(struct block_iter *iter, unsigned int *logical, int *is_pointer);
+uint64_t get_inode_size(struct ext2_inode *inode);
+void set_inode_size(struct ext2_inode *inode, uint64_t size);
+
 //static int is_absolute_path(const char *path);
 
 char *get_file_name(char *path_to_file);
 
 int check_resource_in_use(unsigned char *bitmap, int num);
 
-int allocate_resource(unsigned char *bitmap, int num_bytes);
+uint64_t count_set_bits(const unsigned char *bitmap, uint64_t num_bits);
+
+int check_inode_in_use(unsigned int inode_num);
+
+int check_block_in_use(unsigned int block_num);
+
+int allocate_resource(unsigned char *bitmap, int num_bits, unsigned int *cursor);
 
 int allocate_inode(unsigned char file_type);
 
 int allocate_block();
 
+int allocate_blocks(unsigned int count, unsigned int *allocated);
+
+int lookup_entry(unsigned int parent_inode_num, char *name, unsigned int *inode_num, unsigned char *file_type);
+
+int find_parent_dir(char *path, unsigned int *parent_inode_num);
+
+int resolve_path(char *path, unsigned int *parent_inode_num, char *file_name);
+
 int second_last_dir_inode(char *path);
 
 void init_dir_entry(struct ext2_dir_entry *entry, unsigned int inode_num, 
 					unsigned short rec_len, int name_len, char *name, 
 					unsigned char file_type);
 
-struct ext2_dir_entry* create_file(char *path_to_dest, unsigned int finode, char file_type);
+int create_file(char *path_to_dest, unsigned int finode, char file_type, struct ext2_dir_entry **new_entry);
 
 struct ext2_dir_entry *find_entry(struct ext2_inode *inode, char *file_name);
 
+int dir_block_covers_name(struct ext2_inode *dir, unsigned int block_num, char *name);
+
+//Position of a read_dir() walk: the logical block of the directory and the byte offset of the next entry in it
+struct dir_cursor {
+    unsigned int logical;
+    unsigned int offset;
+};
+
+struct ext2_dir_entry *read_dir(struct ext2_inode *dir, struct dir_cursor *cursor);
+
+int dir_cursor_valid(struct ext2_inode *dir, struct dir_cursor *cursor);
+
 struct ext2_dir_entry *find_last_entry(int i_block);
 
 int actual_entry_len(struct ext2_dir_entry *entry);
 
-struct ext2_dir_entry *insert_dir_entry(struct ext2_inode *dir_inode, unsigned int finode, 
-										char *fname, unsigned char ftype);
+int insert_dir_entry(struct ext2_inode *dir_inode, unsigned int finode, 
+					 char *fname, unsigned char ftype, struct ext2_dir_entry **new_entry);
 
 void set_resource_in_use(unsigned int resource_num, int is_inode);
 
@@ -60,9 +287,25 @@ void free_inode(unsigned int inode_num);
 
 void free_block(unsigned int block_num);
 
-void free_data_blocks(struct ext2_inode *inode);
+int free_data_blocks(struct ext2_inode *inode);
+
+int unlink_inode(unsigned int inode_num);
+
+int find_prev_entry(struct ext2_inode *inode, char *file_name, struct ext2_dir_entry **prev_entry);
+
+unsigned int remove_dir_entry(struct ext2_inode *dir_inode, char *file_name);
+
+int delete_file(int parent_inode_num, char* file_name);
 
-void unlink_inode(unsigned int inode_num);
+//Operations of the tools. Each returns EXIT_SUCCESS or an errno value instead of exiting.
+//Every tool's main() runs one of them, ext2_batch runs many against one loaded image
+int copy_file(char *path_to_source, char *path_to_dest);
+int copy_tree(char *source_dir, char *path_to_dest);
+int make_directory(char *target_path);
+int link_file(char *source_path, char *dest_path, unsigned char file_type);
+int remove_file(char *path_to_link);
+int restore_path(char *path_to_file);
+int restore_scan(char *dir_path);
 
 
 #endif
@@ -85,3 +85,22 @@ do
 done
 
 
+# --- Cache test: with a small buffer cache the pread backend must not hold more buffers than its size ---
+# The images are not journaled here, since changed metadata is held in memory until the commit
+cp images/largefile.img self-tester/runs/cache1.img
+cp self-tester/images/removed-largefile.img self-tester/runs/cache2.img
+cp images/twolevel-corrupt.img self-tester/runs/cache3.img
+cache_test() {
+	echo "Cache Test $1"
+	shift
+	line="$(EXT2_IO=pread EXT2_CACHE_BLOCKS=8 EXT2_CACHE_STATS=1 EXT2_SYNC=none "$@" 2>&1 >/dev/null | grep '^cache:')"
+	echo "$line" | awk 'NF == 0 || $(NF-3) + 0 > $(NF-1) + 0 { print "FAIL: " ($0 == "" ? "no cache counters" : $0) }'
+}
+cache_test 1 ./ext2_cp self-tester/runs/cache1.img self-tester/files/largefile.txt /big.txt
+cache_test 2 ./ext2_mkdir self-tester/runs/cache1.img /level1
+cache_test 3 ./ext2_ln self-tester/runs/cache1.img -s /big.txt /level1/link
+cache_test 4 ./ext2_rm self-tester/runs/cache1.img /largefile.txt
+cache_test 5 ./ext2_restore self-tester/runs/cache1.img /largefile.txt
+cache_test 6 ./ext2_restore self-tester/runs/cache2.img /largefile.txt
+cache_test 7 ./ext2_checker self-tester/runs/cache3.img
+cache_test 8 ./ext2_checker self-tester/runs/cache1.img